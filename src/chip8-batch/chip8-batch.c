@@ -0,0 +1,592 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chip8-batch runs ROMs without a window, as fast as the host allows, for
+ * regression tests and other large workloads. Every ROM runs on its own
+ * machine for a given amount of frames, and the machines are spread by the
+ * scheduler of lib8 across a pool of worker threads. A line is printed for
+ * each one with its speed and the hash of the state it ended in.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <lib8/cpu.h>
+#include <lib8/scheduler.h>
+#include <config.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Scripted state of the keypad, held from a frame until the next one. */
+struct input_t
+{
+    long frame;                 // First frame with this state.
+    word keypad;                // Keys held down, bit N is key N.
+};
+
+/** Outcome of running a copy of a ROM. */
+struct result_t
+{
+    const char* file;           // Path of the ROM.
+    int copy;                   // Copy of the ROM, seeded with seed + copy.
+    struct machine_t* cpu;      // Machine running the copy.
+    int job;                    // Job of the machine in the scheduler.
+    int input;                  // Next scripted input to feed it.
+    int error;                  // The ROM could not be run.
+    long frames;                // Frames run before the ROM exited.
+    uint64_t cycles;            // Cycles run.
+    double seconds;             // Host time spent running.
+    uint32_t hash;              // Hash of the final state.
+};
+
+/* Frames to run, set by '--frames'. */
+static long frames = 600;
+
+/* Cycles to run per frame, 0 to use the default one of the timing. */
+static int speed;
+
+/* Engine set by '--engine'. */
+static int engine = ENGINE_INTERPRETER;
+
+/* Timing profile set by '--timing'. */
+static int timing = TIMING_UNIFORM;
+
+/* Seed set by '--seed'. */
+static unsigned long long seed;
+
+/* Worker threads, set by '--jobs'. */
+static int jobs;
+
+/* Copies of each ROM, set by '--copies'. */
+static int copies = 1;
+
+/* Set by '--scaling' to run the batch with more and more workers. */
+static int scaling;
+
+/* Directory set by '--dump', where final screens are written. */
+static const char* dump_dir;
+
+/* Input read from the file set by '--input', sorted by frame. */
+static struct input_t* inputs;
+static int input_count;
+
+/* ROMs to run, and the results of every copy of them. */
+static char** files;
+static int file_count;
+static struct result_t* results;
+static int result_count;
+
+/* getopt parameter structure. */
+static struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "version", no_argument, 0, 'v' },
+    { "frames", required_argument, 0, 'f' },
+    { "speed", required_argument, 0, 's' },
+    { "engine", required_argument, 0, 'e' },
+    { "timing", required_argument, 0, 't' },
+    { "seed", required_argument, 0, 'r' },
+    { "jobs", required_argument, 0, 'j' },
+    { "input", required_argument, 0, 'i' },
+    { "dump", required_argument, 0, 'd' },
+    { "copies", required_argument, 0, 'c' },
+    { "scaling", no_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+};
+
+/**
+ * Print usage. In case you use bad arguments, this will be printed.
+ * @param name how is the program named, usually argv[0].
+ */
+static void
+usage(const char* name)
+{
+    /* How many characters has Usage: %s? */
+    int pad = strlen(name) + 7; // 7 = "Usage: "
+
+    printf("Usage: %s [-h | --help] [-v | --version]\n", name);
+    printf("%*c [-f | --frames <n>] [-s | --speed <cycles>]\n", pad, ' ');
+    printf("%*c [--engine <name>] [--timing <name>] [--seed <n>]\n",
+           pad, ' ');
+    printf("%*c [-j | --jobs <n>] [-i | --input <file>] [-d | --dump <dir>]\n",
+           pad, ' ');
+    printf("%*c [-c | --copies <n>] [--scaling]\n", pad, ' ');
+    printf("%*c <file>...\n", pad, ' ');
+}
+
+/**
+ * Parses a number given in the command line, exiting if it is not a
+ * positive number.
+ */
+static long
+parse_count(const char* option, const char* value)
+{
+    char* end;
+    long count = strtol(value, &end, 10);
+    if (*value == 0 || *end != 0 || count <= 0) {
+        fprintf(stderr, "Invalid %s value: must be a positive number\n",
+                option);
+        exit(1);
+    }
+    return count;
+}
+
+static int
+compare_inputs(const void* a, const void* b)
+{
+    const struct input_t* x = a;
+    const struct input_t* y = b;
+    return (x->frame > y->frame) - (x->frame < y->frame);
+}
+
+/**
+ * Loads the scripted input. Every line has a frame and the keypad state
+ * from that frame on, in hex, bit N being key N. Empty lines and lines
+ * starting with # are skipped.
+ * @return 0 if the file was loaded, != 0 otherwise.
+ */
+static int
+load_input(const char* file)
+{
+    FILE* fp = fopen(file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot open input file %s.\n", file);
+        return 1;
+    }
+
+    char line[256];
+    int capacity = 0, number = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        number++;
+        if (line[strspn(line, " \t\r\n")] == 0 || line[0] == '#') {
+            continue;
+        }
+        long frame;
+        unsigned keypad;
+        if (sscanf(line, "%ld %x", &frame, &keypad) != 2 || frame < 0
+            || keypad > 0xFFFF) {
+            fprintf(stderr, "%s:%d: expected a frame and a keypad.\n",
+                    file, number);
+            fclose(fp);
+            return 1;
+        }
+        if (input_count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            struct input_t* grown = realloc(inputs,
+                                            capacity * sizeof(struct input_t));
+            if (grown == NULL) {
+                fprintf(stderr, "Not enough memory for the input in %s.\n",
+                        file);
+                fclose(fp);
+                return 1;
+            }
+            inputs = grown;
+        }
+        inputs[input_count].frame = frame;
+        inputs[input_count].keypad = keypad;
+        input_count++;
+    }
+    fclose(fp);
+    qsort(inputs, input_count, sizeof(struct input_t), &compare_inputs);
+    return 0;
+}
+
+/**
+ * Writes the screen of a machine as a binary PBM image, named after the
+ * ROM and the copy, in the dump directory.
+ */
+static void
+dump_screen(const struct result_t* result, const struct machine_t* cpu)
+{
+    const char* name = strrchr(result->file, '/');
+    name = name ? name + 1 : result->file;
+    char path[1024];
+    if (copies > 1) {
+        snprintf(path, sizeof(path), "%s/%s.%d.pbm", dump_dir, name,
+                 result->copy);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s.pbm", dump_dir, name);
+    }
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot write %s.\n", path);
+        return;
+    }
+
+    int width = cpu->esm ? 128 : 64, height = cpu->esm ? 64 : 32;
+    int words = width / 64;
+    fprintf(fp, "P4\n%d %d\n", width, height);
+    for (int y = 0; y < height; y++) {
+        for (int w = 0; w < words; w++) {
+            uint64_t word = cpu->screen[words * y + w];
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                fputc((word >> shift) & 0xFF, fp);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static double
+now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Feeds a machine the scripted input up to the frame it is about to run.
+ * A key pressed while the machine waits for a key is delivered.
+ */
+static void
+feed_input(struct machine_t* cpu, long frame, void* data)
+{
+    struct result_t* result = data;
+    int input = result->input;
+    for (; input < input_count && inputs[input].frame <= frame; input++) {
+        word pressed = inputs[input].keypad & ~cpu->keypad;
+        if (pressed != 0) {
+            press_key(cpu, __builtin_ctz(pressed));
+        }
+        cpu->keypad = inputs[input].keypad;
+    }
+    result->input = input;
+}
+
+/**
+ * Resumes the machines parked while waiting for a key. A machine sleeps
+ * until the first frame that holds a key down, since that is the first
+ * one that would let it go on, or until it runs every frame.
+ */
+static void
+resume_parked(struct scheduler_t* sched)
+{
+    for (int job = 0; job < sched->count; job++) {
+        if (sched->jobs[job].state != JOB_PARKED) {
+            continue;
+        }
+        struct result_t* result = sched->jobs[job].data;
+        int input = result->input;
+        while (input < input_count && inputs[input].keypad == 0) {
+            input++;
+        }
+        long frame = input < input_count ? inputs[input].frame : frames;
+        resume_machine(sched, job, frame - sched->jobs[job].frame);
+    }
+}
+
+/**
+ * Runs every copy of every ROM for the given amount of frames, feeding
+ * them the scripted input, and fills their results.
+ * @param workers worker threads to run the machines on.
+ * @param quanta filled with the quanta run by the workers.
+ * @param steals filled with the jobs stolen by the workers.
+ * @return host time spent, or a negative number if the workers couldn't
+ *         be started.
+ */
+static double
+run_batch(int workers, uint64_t* quanta, uint64_t* steals)
+{
+    struct scheduler_t sched;
+    if (init_scheduler(&sched, workers, result_count, speed,
+                       DEFAULT_QUANTUM)) {
+        return -1;
+    }
+
+    double start = now_seconds();
+    for (int run = 0; run < result_count; run++) {
+        struct result_t* result = &results[run];
+        struct machine_t* cpu = result->cpu;
+        init_machine(cpu);
+        cpu->engine = engine;
+        cpu->timing = timing;
+        seed_random(cpu, seed + result->copy);
+        result->input = 0;
+        int error = load_rom(cpu, result->file);
+        result->error = error != ROM_OK;
+        if (result->error) {
+            if (result->copy == 0) {
+                fprintf(stderr, "%s: %s.\n", result->file,
+                        rom_error_message(error));
+            }
+            free_machine(cpu);
+            continue;
+        }
+        result->job = schedule_machine(&sched, cpu, frames, &feed_input,
+                                       result);
+    }
+    while (wait_scheduler(&sched) > 0) {
+        resume_parked(&sched);
+    }
+    double seconds = now_seconds() - start;
+
+    *quanta = *steals = 0;
+    for (int worker = 0; worker < sched.workers; worker++) {
+        *quanta += sched.worker[worker].quanta;
+        *steals += sched.worker[worker].steals;
+    }
+    for (int run = 0; run < result_count; run++) {
+        struct result_t* result = &results[run];
+        if (result->error) {
+            continue;
+        }
+        const struct job_t* job = &sched.jobs[result->job];
+        result->frames = job->frame;
+        result->cycles = result->cpu->cycles;
+        result->seconds = job->seconds;
+        result->hash = hash_state(result->cpu);
+        if (dump_dir) {
+            dump_screen(result, result->cpu);
+        }
+        free_machine(result->cpu);
+    }
+    free_scheduler(&sched);
+    return seconds;
+}
+
+/**
+ * Runs the batch with 1, 2, 4... workers up to the given amount, and
+ * prints how much faster it runs with each amount than with one worker.
+ * @return 0 if every run ended in the same states, != 0 otherwise.
+ */
+static int
+run_scaling(int workers)
+{
+    uint32_t* hashes = malloc(result_count * sizeof(uint32_t));
+    double base = 0;
+    int differ = 0;
+
+    /* A first run, not shown, faults in the machines and the ROMs. */
+    uint64_t quanta, steals;
+    if (run_batch(workers, &quanta, &steals) < 0) {
+        fprintf(stderr, "Cannot start the worker threads.\n");
+        exit(1);
+    }
+
+    printf("%8s %10s %10s %8s %10s %10s %10s\n", "workers", "seconds",
+           "Mcycles/s", "speedup", "efficiency", "quanta", "steals");
+    for (int count = 1; ; count = count * 2 < workers ? count * 2 : workers) {
+        uint64_t total = 0;
+        double seconds = run_batch(count, &quanta, &steals);
+        if (seconds < 0) {
+            fprintf(stderr, "Cannot start %d worker threads.\n", count);
+            break;
+        }
+        for (int run = 0; run < result_count; run++) {
+            total += results[run].cycles;
+            if (count == 1) {
+                hashes[run] = results[run].hash;
+            } else if (hashes[run] != results[run].hash) {
+                differ = 1;
+            }
+        }
+        if (count == 1) {
+            base = seconds;
+        }
+        printf("%8d %10.3f %10.1f %7.2fx %9.0f%% %10llu %10llu\n", count,
+               seconds, total / seconds / 1e6, base / seconds,
+               100 * base / seconds / count, (unsigned long long) quanta,
+               (unsigned long long) steals);
+        if (count == workers) {
+            break;
+        }
+    }
+    if (differ) {
+        fprintf(stderr, "Some ROMs ended in other states with more workers.\n");
+    }
+    free(hashes);
+    return differ;
+}
+
+/**
+ * Parse the name of an execution engine.
+ * @param name engine name, as given in the command line.
+ * @return the engine, or -1 if there is no engine with that name.
+ */
+static int
+parse_engine(const char* name)
+{
+    if (!strcmp(name, "interpreter"))
+        return ENGINE_INTERPRETER;
+    if (!strcmp(name, "threaded"))
+        return ENGINE_THREADED;
+    if (!strcmp(name, "jit"))
+        return ENGINE_JIT;
+    return -1;
+}
+
+/**
+ * Parse the name of a timing profile.
+ * @param name profile name, as given in the command line.
+ * @return the profile, or -1 if there is no profile with that name.
+ */
+static int
+parse_timing(const char* name)
+{
+    if (!strcmp(name, "uniform"))
+        return TIMING_UNIFORM;
+    if (!strcmp(name, "vip"))
+        return TIMING_VIP;
+    return -1;
+}
+
+int
+main(int argc, char** argv)
+{
+    /* Parse parameters */
+    int indexptr, c;
+    char* end;
+    while ((c = getopt_long(argc, argv, "hvf:s:j:i:d:c:", long_options,
+                            &indexptr)) != -1) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'v':
+                printf("%s\n", PACKAGE_STRING);
+                exit(0);
+            case 'f':
+                frames = parse_count("frames", optarg);
+                break;
+            case 's':
+                speed = parse_count("speed", optarg);
+                break;
+            case 'j':
+                jobs = parse_count("jobs", optarg);
+                break;
+            case 'e':
+                engine = parse_engine(optarg);
+                if (engine == -1) {
+                    fprintf(stderr, "Invalid engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                timing = parse_timing(optarg);
+                if (timing == -1) {
+                    fprintf(stderr, "Invalid timing: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                seed = strtoull(optarg, &end, 0);
+                if (*optarg == 0 || *end != 0) {
+                    fprintf(stderr, "Invalid seed: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                if (load_input(optarg)) {
+                    exit(1);
+                }
+                break;
+            case 'd':
+                dump_dir = optarg;
+                break;
+            case 'c':
+                copies = parse_count("copies", optarg);
+                break;
+            case 'S':
+                scaling = 1;
+                break;
+            default:
+                exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%1$s: no file given. '%1$s -h' for help.\n", argv[0]);
+        exit(1);
+    }
+
+    if (speed == 0) {
+        speed = timing == TIMING_VIP ? VIP_CYCLES_PER_FRAME : 16;
+    }
+    files = argv + optind;
+    file_count = argc - optind;
+    result_count = file_count * copies;
+    results = calloc(result_count, sizeof(struct result_t));
+    for (int run = 0; run < result_count; run++) {
+        results[run].file = files[run / copies];
+        results[run].copy = run % copies;
+        results[run].cpu = malloc(sizeof(struct machine_t));
+        if (results[run].cpu == NULL) {
+            fprintf(stderr, "Not enough memory for %d machines.\n",
+                    result_count);
+            exit(1);
+        }
+    }
+
+    /* By default, use every core, but not more threads than machines. */
+    if (jobs == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cores > 0 ? cores : 1;
+    }
+    if (jobs > result_count) {
+        jobs = result_count;
+    }
+
+    int failed = 0;
+    if (scaling) {
+        failed = run_scaling(jobs);
+    } else {
+        uint64_t quanta, steals;
+        double seconds = run_batch(jobs, &quanta, &steals);
+        if (seconds < 0) {
+            fprintf(stderr, "Cannot start the worker threads.\n");
+            exit(1);
+        }
+
+        /* Results are printed in the order the ROMs were given. */
+        uint64_t total = 0;
+        printf("%-24s %8s %12s %10s %8s\n", "rom", "frames", "cycles",
+               "Mcycles/s", "hash");
+        for (int run = 0; run < result_count; run++) {
+            const struct result_t* result = &results[run];
+            char name[1024];
+            if (copies > 1) {
+                snprintf(name, sizeof(name), "%s#%d", result->file,
+                         result->copy);
+            } else {
+                snprintf(name, sizeof(name), "%s", result->file);
+            }
+            if (result->error) {
+                printf("%-24s %8s\n", name, "error");
+                failed = 1;
+                continue;
+            }
+            total += result->cycles;
+            printf("%-24s %8ld %12llu %10.1f %08x\n", name, result->frames,
+                   (unsigned long long) result->cycles,
+                   result->cycles / result->seconds / 1e6, result->hash);
+        }
+        printf("%d ROMs, %d threads, %.3f s, %.1f Mcycles/s\n",
+               result_count, jobs, seconds, total / seconds / 1e6);
+    }
+
+    for (int run = 0; run < result_count; run++) {
+        free(results[run].cpu);
+    }
+    free(results);
+    free(inputs);
+    return failed;
+}
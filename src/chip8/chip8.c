@@ -18,6 +18,10 @@
 
 #include <lib8/cpu.h>
 #include "libsdl.h"
+#include "pacing.h"
+#include "stats.h"
+#include "thread.h"
+#include "tuner.h"
 #include <config.h>
 
 #include <getopt.h>
@@ -26,6 +30,8 @@
 #include <string.h>
 #include <time.h>
 
+#define FAST_FORWARD_FRAMES 8 // Frames run per host frame by default.
+
 /* Flag set by '--hex' */
 static int use_hexloader;
 
@@ -35,8 +41,39 @@ static int use_mute;
 /* Flag used by '--debug' */
 static int use_debug;
 
-/* Opcodes to execute per frame. */
-static int speed = 16;
+/* Flag set by '--thread'. */
+static int use_thread;
+
+/* Flag set by '--stats'. */
+static int use_stats;
+
+/* File set by '--stats-csv'. */
+static const char* stats_csv;
+
+/* Flag set by '--vsync'. */
+static int use_vsync;
+
+/* Cycles to run per frame, 0 to use the default one of the timing. */
+static int speed;
+
+/* Frames run per host frame while fast-forwarding, set by '--turbo'. */
+static int turbo;
+
+/* Seed set by '--seed', if use_seed is set, or taken from the clock. */
+static unsigned long long seed;
+static int use_seed;
+
+/* Flag set by '--speed auto'. */
+static int auto_speed;
+
+/* Engine set by '--engine'. */
+static int engine = ENGINE_INTERPRETER;
+
+/* Timing profile set by '--timing'. */
+static int timing = TIMING_UNIFORM;
+
+/* Directory set by '--native'. */
+static const char* native_dir;
 
 /* getopt parameter structure. */
 static struct option long_options[] = {
@@ -45,7 +82,16 @@ static struct option long_options[] = {
     { "hex", no_argument, &use_hexloader, 1 },
     { "mute", no_argument, &use_mute, 1 },
     { "debug", no_argument, &use_debug, 1 },
+    { "thread", no_argument, &use_thread, 1 },
+    { "vsync", no_argument, &use_vsync, 1 },
     { "speed", required_argument, 0, 's' },
+    { "engine", required_argument, 0, 'e' },
+    { "timing", required_argument, 0, 't' },
+    { "turbo", required_argument, 0, 'T' },
+    { "seed", required_argument, 0, 'r' },
+    { "stats", no_argument, &use_stats, 1 },
+    { "stats-csv", required_argument, 0, 'S' },
+    { "native", required_argument, 0, 'n' },
     { 0, 0, 0, 0 }
 };
 
@@ -60,7 +106,44 @@ usage(const char* name)
     int pad = strnlen(name, 10) + 7; // 7 = "Usage: "
 
     printf("Usage: %s [-h | --help] [-v | --version]\n", name);
-    printf("%*c [--hex] [--mute] <file>\n", pad, ' ');
+    printf("%*c [--hex] [--mute] [--thread] [--vsync] [--engine <name>]\n",
+           pad, ' ');
+    printf("%*c [--speed <cycles> | --speed auto] [--timing <name>]\n",
+           pad, ' ');
+    printf("%*c [--turbo <frames>] [--seed <n>] [--stats]\n", pad, ' ');
+    printf("%*c [--stats-csv <file>] [--native <dir>] <file>\n", pad, ' ');
+}
+
+/**
+ * Parse the name of an execution engine.
+ * @param name engine name, as given in the command line.
+ * @return the engine, or -1 if there is no engine with that name.
+ */
+static int
+parse_engine(const char* name)
+{
+    if (!strcmp(name, "interpreter"))
+        return ENGINE_INTERPRETER;
+    if (!strcmp(name, "threaded"))
+        return ENGINE_THREADED;
+    if (!strcmp(name, "jit"))
+        return ENGINE_JIT;
+    return -1;
+}
+
+/**
+ * Parse the name of a timing profile.
+ * @param name profile name, as given in the command line.
+ * @return the profile, or -1 if there is no profile with that name.
+ */
+static int
+parse_timing(const char* name)
+{
+    if (!strcmp(name, "uniform"))
+        return TIMING_UNIFORM;
+    if (!strcmp(name, "vip"))
+        return TIMING_VIP;
+    return -1;
 }
 
 static char
@@ -122,51 +205,70 @@ load_hex(const char* file, struct machine_t* machine)
     return 0;
 }
 
+static int
+load_data(char* file, struct machine_t* mac)
+{
+    if (use_hexloader == 0) {
+        int error = load_rom(mac, file);
+        if (error != ROM_OK) {
+            fprintf(stderr, "%s.\n", rom_error_message(error));
+        }
+        return error;
+    } else {
+        return load_hex(file, mac);
+    }
+}
+
 /**
- * Load a ROM into a machine. This function will open a file and load its
- * contents into the memory from the provided machine data structure.
- * In compliance with the specification, ROM data will start at 0x200.
+ * Load the shared object built by chip8c for the ROM in a machine, which
+ * is named after the hash of the ROM.
  *
- * @param file file path.
- * @param machine machine data structure to load the ROM into.
+ * @param dir directory where the shared object is looked up.
+ * @param mac machine data structure that holds the ROM.
  */
 static int
-load_rom(const char* file, struct machine_t* machine)
+load_translated(const char* dir, struct machine_t* mac)
 {
-    FILE* fp = fopen(file, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Cannot open ROM file.\n");
-        return 1;
-    }
-
-    // Use the fseek/ftell/fseek trick to retrieve file size.
-    fseek(fp, 0, SEEK_END);
-    int length = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // Check the length of the rom. Must be as much 3584 bytes long, which
-    // is 4096 - 512. Since first 512 bytes of memory are reserved, program
-    // code can only allocate up to 3584 bytes. Must check for bounds in
-    // order to avoid buffer overflows.
-    if (length > 3584) {
-        fprintf(stderr, "ROM too large.\n");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%08x.so", dir, hash_program(mac));
+    if (load_native(mac, path)) {
+        fprintf(stderr, "Cannot load %s, run chip8c first.\n", path);
         return 1;
     }
-
-    // Everything is OK, read the ROM.
-    fread(machine->mem + 0x200, length, 1, fp);
-    fclose(fp);
     return 0;
 }
 
-static int
-load_data(char* file, struct machine_t* mac)
+/**
+ * Runs the machine on the emulation thread, while this thread handles
+ * input and presents the frames published by the emulation thread.
+ *
+ * @param mac machine data structure to run.
+ */
+static void
+run_threaded(struct machine_t* mac)
 {
-    if (use_hexloader == 0) {
-        return load_rom(file, mac);
-    } else {
-        return load_hex(file, mac);
+    if (start_emulation(mac, speed, auto_speed)) {
+        fprintf(stderr, "Cannot start the emulation thread.\n");
+        return;
     }
+
+    /* With vsync, presenting the frame already waits for the display. */
+    struct pacer_t pacer;
+    init_pacer(&pacer, 60);
+    word keypad = 0;
+    while (!is_close_requested() && is_emulation_running()) {
+        wait_frame(&pacer, !use_vsync);
+        set_turbo(is_fast_forwarding() ? turbo : 1);
+
+        word pressed = read_keypad();
+        if (pressed != keypad) {
+            keypad = pressed;
+            send_keypad(keypad);
+        }
+        const struct frame_t* frame = take_frame();
+        render_screen(frame->screen, frame->esm);
+    }
+    stop_emulation();
 }
 
 int
@@ -176,13 +278,18 @@ main(int argc, char** argv)
 
     /* Parse parameters */
     int indexptr, c;
-    while ((c = getopt_long(argc, argv, "hs:v", long_options, &indexptr))
+    char* end;
+    while ((c = getopt_long(argc, argv, "hs:ve:t:", long_options, &indexptr))
            != -1) {
         switch (c) {
             case 'h':
                 usage(argv[0]);
                 exit(0);
             case 's':
+                if (optarg && !strcmp(optarg, "auto")) {
+                    auto_speed = 1;
+                    break;
+                }
                 if (optarg) {
                     speed = atoi(optarg);
                 }
@@ -193,6 +300,43 @@ main(int argc, char** argv)
                     exit(1);
                 }
                 break;
+            case 'e':
+                engine = parse_engine(optarg);
+                if (engine == -1) {
+                    fprintf(stderr, "Invalid engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                timing = parse_timing(optarg);
+                if (timing == -1) {
+                    fprintf(stderr, "Invalid timing: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                turbo = atoi(optarg);
+                if (turbo <= 0) {
+                    fprintf(stderr,
+                            "Invalid turbo value: must be a positive number\n");
+                    exit(1);
+                }
+                break;
+            case 'r':
+                seed = strtoull(optarg, &end, 0);
+                if (*optarg == 0 || *end != 0) {
+                    fprintf(stderr, "Invalid seed: %s\n", optarg);
+                    exit(1);
+                }
+                use_seed = 1;
+                break;
+            case 'S':
+                use_stats = 1;
+                stats_csv = optarg;
+                break;
+            case 'n':
+                native_dir = optarg;
+                break;
             case 'v':
                 printf("%s\n", PACKAGE_STRING);
                 exit(0);
@@ -215,11 +359,22 @@ main(int argc, char** argv)
         exit(1);
     }
 
+    /* The VIP profile counts cycles, so it needs a larger budget. */
+    if (speed == 0) {
+        speed = timing == TIMING_VIP ? VIP_CYCLES_PER_FRAME : 16;
+    }
+
+    /* The seed is printed, so that the run can be reproduced. */
+    if (!use_seed) {
+        seed = time(NULL);
+    }
+
     printf("CHIP-8 emulator\n");
     printf("Speed emulation: %d\n", speed);
+    printf("Random seed: %llu\n", seed);
 
     /* Initialize SDL Context. */
-    if (init_context()) {
+    if (init_context(use_vsync)) {
         fprintf(stderr, "Error initializing SDL graphical context:\n");
         fprintf(stderr, "%s\n", SDL_GetError());
         return 1;
@@ -230,50 +385,126 @@ main(int argc, char** argv)
     }
 
     /* Init emulator. */
-    srand(time(NULL));
+    init_machine(&mac);
+    seed_random(&mac, seed);
     if (use_debug) {
-        set_debug_mode(1);
+        set_debug_mode(&mac, 1);
     }
-    init_machine(&mac);
-    mac.keydown = &is_key_down;
+    mac.engine = engine;
+    mac.timing = timing;
     if (!use_mute) {
         mac.speaker = &update_speaker;
     }
-    load_data(argv[optind], &mac);
+    if (load_data(argv[optind], &mac)) {
+        exit(1);
+    }
+    if (native_dir && !load_translated(native_dir, &mac)) {
+        mac.engine = ENGINE_NATIVE;
+    }
 
-    int last_ticks = SDL_GetTicks();
-    int last_delta = 0;
+    /* --turbo starts fast-forwarding, otherwise it waits for the key. */
+    set_fast_forward(turbo != 0);
+    if (turbo == 0) {
+        turbo = FAST_FORWARD_FRAMES;
+    }
+
+    if (use_thread) {
+        if (use_stats) {
+            fprintf(stderr, "Statistics are not taken with --thread.\n");
+        }
+        run_threaded(&mac);
+        free_machine(&mac);
+        destroy_context();
+        return 0;
+    }
+
+    /*
+     * Frames are run at 60 Hz, which is timed by the pacer unless every
+     * frame presented already takes a 60 Hz refresh of the display.
+     */
+    struct pacer_t pacer;
+    int frame_per_refresh = use_vsync && presents_at_60hz();
+    init_pacer(&pacer, 60);
+    struct tuner_t tuner;
+    init_tuner(&tuner, &mac, speed);
+    speaker_handler_t speaker = mac.speaker;
+    struct stats_t stats;
+    if (init_stats(&stats, &mac, use_stats, stats_csv)) {
+        fprintf(stderr, "Cannot write %s.\n", stats_csv);
+        free_machine(&mac);
+        destroy_context();
+        return 1;
+    }
     while (!is_close_requested()) {
-        /* Update timers. */
-        last_delta = SDL_GetTicks() - last_ticks;
-        last_ticks = SDL_GetTicks();
+        mark_time(&stats, STAT_EVENTS);
+        int frames = frame_per_refresh ? 1 : wait_frame(&pacer, !use_vsync);
+        mark_time(&stats, STAT_SLEEP);
+
+        /*
+         * While fast-forwarding, several frames are run per host frame and
+         * only the last one is shown. The speaker is only updated once they
+         * have been run, and the speed is not tuned.
+         */
+        int fast = is_fast_forwarding();
+        if (fast) {
+            frames *= turbo;
+        }
+        mac.speaker = fast ? NULL : speaker;
 
         /* Update computer. */
-        update_time(&mac, last_delta);
-        for (int i = 0; i < speed; i++) {
-            step_machine(&mac);
+        start_work(&tuner);
+        mac.keypad = read_keypad();
+        for (int frame = 0; frame < frames; frame++) {
+            tick_timers(&mac);
+            run_machine(&mac, speed);
+            if (!fast) {
+                count_frame(&tuner, &mac);
+            }
+            if (mac.stop == STOP_EXIT) {
+                break;
+            }
         }
+        if (mac.stop == STOP_EXIT) {
+            /* Game executed 00FD. */
+            break;
+        }
+        if (fast && speaker) {
+            speaker(mac.st != 0);
+        }
+        mark_time(&stats, STAT_EMULATION);
 
-        /* Render computer. */
+        /* Render computer. With vsync, this also waits for the display. */
+        if (use_vsync && !fast) {
+            end_work(&tuner);
+        }
         render_display(&mac);
+        if (!use_vsync && !fast) {
+            end_work(&tuner);
+        }
+        mark_time(&stats, STAT_RENDER);
+        if (auto_speed && update_tuner(&tuner)) {
+            speed = tuner.speed;
+        }
 
         /*
-         * To render at 60 Hz, you must render a frame each 16.6 ms.
-         * If it took less than 16.6 ms, you can afford sleep some
-         * time. 1 ms will always be slept to keep the CPU cold.
+         * If the game is waiting for a key and the timers are stopped,
+         * nothing is going to change until a key is pressed, so block
+         * until then instead of running empty frames.
          */
-        int render_time = SDL_GetTicks() - last_ticks;
-        if (render_time < 16) {
-            /* We can sleep :) */
-            SDL_Delay(16 - render_time);
-        } else {
-            /* We should not sleep, but we will do because the CPU will
-             * otherwise explode. */
-            SDL_Delay(1);
+        if (mac.stop == STOP_WAIT_KEY && mac.dt == 0 && mac.st == 0) {
+            int key = wait_key_event();
+            if (key != -1) {
+                press_key(&mac, key);
+            }
+            init_pacer(&pacer, 60);
+            mark_time(&stats, STAT_SLEEP);
         }
+        end_frame(&stats, &mac);
     }
 
-    /* Dispose SDL context. */
+    /* Dispose machine and SDL context. */
+    free_stats(&stats);
+    free_machine(&mac);
     destroy_context();
 
     return 0;
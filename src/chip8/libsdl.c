@@ -20,6 +20,7 @@
 #include "libsdl.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /**
@@ -47,6 +48,9 @@ char keys[] = {
     SDL_SCANCODE_V  // F
 };
 
+/** PC key that toggles fast-forward. */
+#define FAST_FORWARD_KEY SDL_SCANCODE_TAB
+
 /**
  * This is a private structure used for holding information about audio.
  * I need to create the structure becuase the feeding function for audio
@@ -63,7 +67,25 @@ static SDL_Window* window = NULL;
 
 static SDL_Renderer* renderer = NULL;
 
-static SDL_Texture* texture = NULL;
+/* Textures for the low resolution mode and the extended screen mode. */
+static SDL_Texture* textures[2] = { NULL, NULL };
+
+/* Copy of the texture pixels, so that only dirty rows are expanded again. */
+static Uint32 pixels[128 * 64];
+
+/* Pixels for each value of a byte of the screen, leftmost pixel first. */
+static Uint32 byte_pixels[256][8];
+
+/* Screen generation shown by the textures, if each one has been filled. */
+static unsigned shown_generation;
+static int texture_ready[2] = { 0, 0 };
+
+/* Screen shown by the texture when rendering copies of the screen. */
+static uint64_t shown_screen[128];
+static int shown_esm;
+
+/* Toggled by pressing the fast-forward key. */
+static int fast_forward = 0;
 
 static SDL_AudioDeviceID device = 0;
 
@@ -120,9 +142,11 @@ clean_up()
         free(spec);
         spec = NULL;
     }
-    if (texture != NULL) {
-        SDL_DestroyTexture(texture);
-        texture = NULL;
+    for (int esm = 0; esm < 2; esm++) {
+        if (textures[esm] != NULL) {
+            SDL_DestroyTexture(textures[esm]);
+            textures[esm] = NULL;
+        }
     }
     if (renderer != NULL) {
         SDL_DestroyRenderer(renderer);
@@ -135,57 +159,120 @@ clean_up()
     SDL_Quit();
 }
 
-#define TEXTURE_PIXEL(x, y) (128 * (y) + (x))
+/**
+ * Fills the table used to expand the screen, which has the 8 pixels for
+ * each value of a byte of the screen. Lit pixels are white.
+ */
+static void
+init_byte_pixels()
+{
+    for (int value = 0; value < 256; value++) {
+        for (int x = 0; x < 8; x++)
+            byte_pixels[value][x] = (value >> (7 - x)) & 1 ? -1 : 0;
+    }
+}
 
+/**
+ * Expands a row of the screen into the texture pixels, a byte at a time.
+ * The texture has the same size as the screen.
+ */
 static void
-expand_screen(char* from, Uint32* to, int use_hdpi)
+expand_row(const uint64_t* from, Uint32* to, int y, int width)
 {
-    if (use_hdpi) {
-        for (int i = 0; i < 8192; i++)
-            to[i] = from[i] ? -1 : 0;
-    } else {
-        int x = 0, y = 0;
-        for (int i = 0; i < 2048; i++) {
-            Uint32 val = from[i] ? -1 : 0;
-            to[TEXTURE_PIXEL(2 * x + 0, 2 * y + 0)] = val;
-            to[TEXTURE_PIXEL(2 * x + 1, 2 * y + 0)] = val;
-            to[TEXTURE_PIXEL(2 * x + 0, 2 * y + 1)] = val;
-            to[TEXTURE_PIXEL(2 * x + 1, 2 * y + 1)] = val;
-            if (++x == 64) {
-                x = 0;
-                y++;
-            }
+    int words = width / 64;
+    to += width * y;
+    for (int w = 0; w < words; w++) {
+        uint64_t word = from[words * y + w];
+        for (int shift = 56; shift >= 0; shift -= 8, to += 8) {
+            const Uint32* eight = byte_pixels[(word >> shift) & 0xFF];
+            memcpy(to, eight, sizeof(byte_pixels[0]));
         }
     }
 }
 
+/**
+ * Uploads to the texture the rows of the screen that are dirty, bit N of
+ * dirty being row N. Each run of consecutive dirty rows is uploaded using
+ * a single update.
+ */
+static void
+update_texture(const uint64_t* screen, int esm, uint64_t dirty)
+{
+    int width = esm ? 128 : 64, height = esm ? 64 : 32;
+    if (!texture_ready[esm]) {
+        dirty = ~0ull;
+    }
+    if (height < 64) {
+        dirty &= (1ull << height) - 1;
+    }
+    texture_ready[esm] = 1;
+
+    while (dirty != 0) {
+        int first = __builtin_ctzll(dirty), last = first;
+        do {
+            expand_row(screen, pixels, last++, width);
+            dirty &= dirty - 1;
+        } while (last < height && (dirty >> last & 1));
+
+        SDL_Rect rect = { 0, first, width, last - first };
+        SDL_UpdateTexture(textures[esm], &rect, pixels + width * first,
+                          width * sizeof(Uint32));
+    }
+}
+
 int
-init_context()
+init_context(int vsync)
 {
     if (SDL_Init(SDL_INIT_EVERYTHING)) {
         return 1;
     }
     window = SDL_CreateWindow("CHIP-8 Emulator",
             SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-            640, 320, SDL_WINDOW_SHOWN);
+            640, 320, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
     if (window == NULL) {
         clean_up();
         return 1;
     }
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    Uint32 flags = SDL_RENDERER_ACCELERATED;
+    if (vsync) {
+        flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    renderer = SDL_CreateRenderer(window, -1, flags);
     if (renderer == NULL) {
         clean_up();
         return 1;
     }
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-            SDL_TEXTUREACCESS_STREAMING, 128, 64);
-    if (texture == NULL) {
-        clean_up();
-        return 1;
+    /* Textures are as big as the screen and scaled by the renderer. */
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    for (int esm = 0; esm < 2; esm++) {
+        textures[esm] = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                SDL_TEXTUREACCESS_STREAMING, 64 << esm, 32 << esm);
+        if (textures[esm] == NULL) {
+            clean_up();
+            return 1;
+        }
+        texture_ready[esm] = 0;
     }
+    init_byte_pixels();
     return 0;
 }
 
+int
+presents_at_60hz()
+{
+    SDL_RendererInfo info;
+    SDL_DisplayMode mode;
+    if (SDL_GetRendererInfo(renderer, &info)
+        || !(info.flags & SDL_RENDERER_PRESENTVSYNC)) {
+        return 0;
+    }
+    int display = SDL_GetWindowDisplayIndex(window);
+    if (display < 0 || SDL_GetCurrentDisplayMode(display, &mode)) {
+        return 0;
+    }
+    return mode.refresh_rate == 60;
+}
+
 int
 try_enable_sound()
 {
@@ -209,27 +296,114 @@ is_close_requested()
         if (ev.type == SDL_QUIT) {
             return 1;
         }
+        if (ev.type == SDL_KEYDOWN && !ev.key.repeat
+            && ev.key.keysym.scancode == FAST_FORWARD_KEY) {
+            fast_forward = !fast_forward;
+        }
     }
     return 0;
 }
 
 void
-render_display(struct machine_t* machine)
+set_fast_forward(int enabled)
+{
+    fast_forward = enabled;
+}
+
+int
+is_fast_forwarding()
 {
-    void*   pixels;
-    int     pitch;
+    return fast_forward;
+}
+
+int
+wait_key_event()
+{
+    SDL_Event ev;
+    while (SDL_WaitEvent(&ev)) {
+        switch (ev.type) {
+        case SDL_QUIT:
+            /* Put it back so that is_close_requested sees it. */
+            SDL_PushEvent(&ev);
+            return -1;
+        case SDL_WINDOWEVENT:
+            /* The window might have to be rendered again. */
+            return -1;
+        case SDL_KEYDOWN:
+            if (ev.key.repeat)
+                break;
+            if (ev.key.keysym.scancode == FAST_FORWARD_KEY)
+                fast_forward = !fast_forward;
+            for (int key = 0; key < 16; key++) {
+                if (keys[key] == ev.key.keysym.scancode)
+                    return key;
+            }
+            break;
+        }
+    }
+    return -1;
+}
 
-    /* Update SDL Texture with current data in CPU. */
-    SDL_LockTexture(texture, NULL, &pixels, &pitch);
-    expand_screen(machine->screen, (Uint32 *) pixels, machine->esm);
-    SDL_UnlockTexture(texture);
+/**
+ * Presents the texture for a screen mode. The texture is scaled by the
+ * largest integer factor that fits in the window, using nearest neighbour
+ * scaling, and it is centered in the window.
+ */
+static void
+present(int esm)
+{
+    int width, height;
+    SDL_GetRendererOutputSize(renderer, &width, &height);
+    int scale = width / 128 < height / 64 ? width / 128 : height / 64;
+    if (scale < 1) {
+        scale = 1;
+    }
+    SDL_Rect rect;
+    rect.w = 128 * scale;
+    rect.h = 64 * scale;
+    rect.x = (width - rect.w) / 2;
+    rect.y = (height - rect.h) / 2;
 
-    /* Render the texture. */
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderCopy(renderer, textures[esm], NULL, &rect);
     SDL_RenderPresent(renderer);
 }
 
+void
+render_display(struct machine_t* machine)
+{
+    /* Update SDL Texture only if the screen changed since last frame. */
+    if (!texture_ready[machine->esm]
+        || machine->generation != shown_generation) {
+        update_texture(machine->screen, machine->esm, machine->dirty);
+        machine->dirty = 0;
+        shown_generation = machine->generation;
+    }
+    present(machine->esm);
+}
+
+void
+render_screen(const uint64_t* screen, int esm)
+{
+    /* There is no dirty bitmap, so look for the rows that changed. */
+    int words = esm ? 2 : 1, height = esm ? 64 : 32;
+    uint64_t dirty = 0;
+    for (int y = 0; y < height; y++) {
+        if (esm != shown_esm
+            || memcmp(screen + y * words, shown_screen + y * words,
+                      words * sizeof(uint64_t))) {
+            dirty |= 1ull << y;
+        }
+    }
+    memcpy(shown_screen, screen, sizeof(shown_screen));
+    shown_esm = esm;
+
+    if (dirty != 0 || !texture_ready[esm]) {
+        update_texture(screen, esm, dirty);
+    }
+    present(esm);
+}
+
 /**
  * Checks if a given key is pressed. This function acceps a CHIP-8 key in
  * range 0-F. It will check using SDL if the PC keyboard mapped to that
@@ -250,6 +424,23 @@ is_key_down(char key)
     return sdl_keys[real_key];
 }
 
+/**
+ * Reads the state of the keyboard as a CHIP-8 keypad. Bit N of the value
+ * is set if the PC key mapped to the CHIP-8 key N is being pressed.
+ *
+ * @return the keypad state.
+ */
+word
+read_keypad()
+{
+    const Uint8* sdl_keys = SDL_GetKeyboardState(NULL);
+    word keypad = 0;
+    for (int key = 0; key < 16; key++) {
+        keypad |= (sdl_keys[(int) keys[key]] != 0) << key;
+    }
+    return keypad;
+}
+
 void
 update_speaker(int enabled)
 {
@@ -23,7 +23,18 @@
 
 #include <SDL.h>
 
-int init_context();
+/**
+ * Creates the window and the renderer.
+ * @param vsync if != 0, presenting a frame waits for the display refresh.
+ * @return 0 if the context was created, != 0 otherwise.
+ */
+int init_context(int vsync);
+
+/**
+ * Tells whether presenting a frame waits for the refresh of a 60 Hz
+ * display, in which case every frame presented is a CHIP-8 frame.
+ */
+int presents_at_60hz();
 
 int try_enable_sound();
 
@@ -31,10 +42,37 @@ void destroy_context();
 
 void render_display(struct machine_t* cpu);
 
+/**
+ * Renders a copy of the screen of a machine, such as a frame published by
+ * the emulation thread. Only the rows that are not the same as in the
+ * screen rendered last time are uploaded.
+ */
+void render_screen(const uint64_t* screen, int esm);
+
 int is_close_requested();
 
+/**
+ * Sets whether the emulator is fast-forwarding. Pressing Tab toggles it,
+ * which is seen when the events are read by is_close_requested.
+ */
+void set_fast_forward(int enabled);
+
+/**
+ * Tells whether the emulator is fast-forwarding.
+ */
+int is_fast_forwarding();
+
+/**
+ * Blocks until a mapped key is pressed, the window has to be rendered
+ * again or the user wants to close the emulator.
+ * @return the CHIP-8 key that was pressed, or -1 if there was no key.
+ */
+int wait_key_event();
+
 int is_key_down(char);
 
+word read_keypad();
+
 void update_speaker(int);
 
 #endif // LIBSDL_H_
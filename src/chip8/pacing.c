@@ -0,0 +1,76 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pacing.h"
+
+#define MAX_LATE_FRAMES 4 // Frames the loop may fall behind and catch up.
+
+#define SPIN_MS 2 // Milliseconds spent spinning instead of sleeping.
+
+void
+init_pacer(struct pacer_t* pacer, int rate)
+{
+    pacer->frequency = SDL_GetPerformanceFrequency();
+    pacer->start = SDL_GetPerformanceCounter();
+    pacer->frames = 0;
+    pacer->rate = rate;
+}
+
+/**
+ * Gets the value of the counter when a frame starts.
+ */
+static Uint64
+frame_start(const struct pacer_t* pacer, Uint64 frame)
+{
+    /* Split the product, so that it doesn't overflow on long sessions. */
+    Uint64 seconds = frame / pacer->rate, rest = frame % pacer->rate;
+    return pacer->start + seconds * pacer->frequency
+        + rest * pacer->frequency / pacer->rate;
+}
+
+int
+wait_frame(struct pacer_t* pacer, int wait)
+{
+    Uint64 next = frame_start(pacer, pacer->frames + 1);
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (wait) {
+        Uint64 spin = pacer->frequency * SPIN_MS / 1000;
+        while (now < next) {
+            if (next - now > spin) {
+                SDL_Delay((next - now - spin) * 1000 / pacer->frequency);
+            }
+            now = SDL_GetPerformanceCounter();
+        }
+    } else if (now < next) {
+        /* The frame has not started yet. */
+        return 0;
+    }
+
+    /* Count every frame that has started since the last call. */
+    int frames = 1;
+    while (frames <= MAX_LATE_FRAMES
+           && now >= frame_start(pacer, pacer->frames + frames + 1)) {
+        frames++;
+    }
+    if (frames > MAX_LATE_FRAMES) {
+        init_pacer(pacer, pacer->rate);
+        return 1;
+    }
+    pacer->frames += frames;
+    return frames;
+}
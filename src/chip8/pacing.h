@@ -0,0 +1,60 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame pacing. Frames are timed using the performance counter of SDL,
+ * and the start of every frame is computed from the start of the first
+ * one, so that rounding errors don't pile up and frames come exactly at
+ * the given rate, 60 Hz for CHIP-8.
+ */
+
+#ifndef PACING_H_
+#define PACING_H_
+
+#include <SDL.h>
+
+/** State of the clock of a frame loop. */
+struct pacer_t
+{
+    Uint64 frequency;           // Ticks of the counter per second.
+    Uint64 start;               // Counter at the start of the first frame.
+    Uint64 frames;              // Frames since the start.
+    int rate;                   // Frames per second.
+};
+
+/**
+ * Starts the clock of a frame loop at the current time.
+ * @param rate frames per second.
+ */
+void init_pacer(struct pacer_t* pacer, int rate);
+
+/**
+ * Waits until the next frame has to start. Most of the wait is slept, and
+ * the last moments are spent spinning, since sleeping is not accurate.
+ * If wait is 0, this doesn't wait at all, which is meant for loops that
+ * are already throttled by vsync.
+ *
+ * If the loop falls behind by a few frames, they are returned so that the
+ * caller catches up, but if it falls behind by more than that, for
+ * instance because it blocked, the clock is started again.
+ *
+ * @return the amount of frames that have passed since the last call.
+ */
+int wait_frame(struct pacer_t* pacer, int wait);
+
+#endif // PACING_H_
@@ -0,0 +1,140 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Names of the values, as printed and as columns of the CSV file. */
+static const char* names[STATS] = {
+    "events_us", "sleep_us", "emulation_us", "render_us", "cycles", "draws"
+};
+
+int
+init_stats(struct stats_t* stats, const struct machine_t* cpu,
+           int enabled, const char* csv)
+{
+    memset(stats, 0, sizeof(struct stats_t));
+    stats->enabled = enabled;
+    if (!enabled) {
+        return 0;
+    }
+    if (csv != NULL) {
+        stats->csv = fopen(csv, "w");
+        if (stats->csv == NULL) {
+            return 1;
+        }
+        fprintf(stats->csv, "frame");
+        for (int stat = 0; stat < STATS; stat++) {
+            fprintf(stats->csv, ",%s", names[stat]);
+        }
+        fprintf(stats->csv, "\n");
+    }
+    stats->frequency = SDL_GetPerformanceFrequency();
+    stats->mark = SDL_GetPerformanceCounter();
+    stats->cycles = cpu->cycles;
+    stats->generation = cpu->generation;
+    return 0;
+}
+
+void
+mark_time(struct stats_t* stats, int stat)
+{
+    if (!stats->enabled) {
+        return;
+    }
+    Uint64 now = SDL_GetPerformanceCounter();
+    stats->ticks[stat] += now - stats->mark;
+    stats->mark = now;
+}
+
+void
+end_frame(struct stats_t* stats, const struct machine_t* cpu)
+{
+    if (!stats->enabled) {
+        return;
+    }
+
+    Uint32 values[STATS];
+    for (int stat = STAT_EVENTS; stat <= STAT_RENDER; stat++) {
+        values[stat] = stats->ticks[stat] * 1000000 / stats->frequency;
+        stats->ticks[stat] = 0;
+    }
+    values[STAT_CYCLES] = cpu->cycles - stats->cycles;
+    values[STAT_DRAWS] = cpu->generation - stats->generation;
+    stats->cycles = cpu->cycles;
+    stats->generation = cpu->generation;
+
+    /* The window is a ring, the oldest frame being overwritten. */
+    int at = stats->frames % STATS_WINDOW;
+    for (int stat = 0; stat < STATS; stat++) {
+        stats->window[stat][at] = values[stat];
+    }
+    if (stats->csv != NULL) {
+        fprintf(stats->csv, "%llu", (unsigned long long) stats->frames);
+        for (int stat = 0; stat < STATS; stat++) {
+            fprintf(stats->csv, ",%u", values[stat]);
+        }
+        fprintf(stats->csv, "\n");
+    }
+    stats->frames++;
+    if (stats->count < STATS_WINDOW) {
+        stats->count++;
+    }
+    if (stats->frames % STATS_WINDOW == 0) {
+        print_stats(stats);
+    }
+}
+
+static int
+compare_values(const void* a, const void* b)
+{
+    Uint32 x = *(const Uint32*) a, y = *(const Uint32*) b;
+    return (x > y) - (x < y);
+}
+
+void
+print_stats(const struct stats_t* stats)
+{
+    if (!stats->enabled || stats->count == 0) {
+        return;
+    }
+
+    fprintf(stderr, "%-14s %8s %8s %8s  (%d frames)\n",
+            "", "p50", "p95", "p99", stats->count);
+    Uint32 sorted[STATS_WINDOW];
+    for (int stat = 0; stat < STATS; stat++) {
+        memcpy(sorted, stats->window[stat], stats->count * sizeof(Uint32));
+        qsort(sorted, stats->count, sizeof(Uint32), &compare_values);
+        fprintf(stderr, "%-14s %8u %8u %8u\n", names[stat],
+                sorted[stats->count * 50 / 100],
+                sorted[stats->count * 95 / 100],
+                sorted[stats->count * 99 / 100]);
+    }
+}
+
+void
+free_stats(struct stats_t* stats)
+{
+    print_stats(stats);
+    if (stats->csv != NULL) {
+        fclose(stats->csv);
+        stats->csv = NULL;
+    }
+}
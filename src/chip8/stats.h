@@ -0,0 +1,95 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame statistics. With --stats, the main loop measures where the time
+ * of every frame goes and what the machine did in it. The last frames are
+ * kept in a rolling window, whose percentiles are printed on stderr every
+ * time the window is filled and on exit. Every frame can also be dumped
+ * to a CSV file.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <lib8/cpu.h>
+#include <SDL.h>
+#include <stdio.h>
+
+#define STATS_WINDOW 600 // Frames kept in the rolling window, 10 seconds.
+
+/** Values measured for every frame. */
+enum stat_t
+{
+    STAT_EVENTS,                // Microseconds reading events.
+    STAT_SLEEP,                 // Microseconds waiting for the next frame.
+    STAT_EMULATION,             // Microseconds running the machine.
+    STAT_RENDER,                // Microseconds rendering the screen.
+    STAT_CYCLES,                // Cycles run by the machine.
+    STAT_DRAWS,                 // Times the screen was modified.
+    STATS                       // Amount of values.
+};
+
+/** Statistics of the frames run by the main loop. */
+struct stats_t
+{
+    int enabled;                // Are statistics being taken?
+    FILE* csv;                  // File where frames are dumped, or NULL.
+    Uint64 frequency;           // Ticks of the counter per second.
+    Uint64 mark;                // Counter when the last time was measured.
+    Uint64 ticks[STATS];        // Ticks measured in the current frame.
+    uint64_t cycles;            // Cycles of the machine at the last frame.
+    unsigned generation;        // Generation of the screen at the last frame.
+    Uint32 window[STATS][STATS_WINDOW]; // Values of the last frames.
+    int count;                  // Frames in the window.
+    Uint64 frames;              // Frames since the start.
+};
+
+/**
+ * Starts taking statistics of a machine.
+ * @param enabled if 0, the other functions don't do anything.
+ * @param csv path of the file where frames are dumped, or NULL.
+ * @return 0 if statistics were started, != 0 if the file can't be opened.
+ */
+int init_stats(struct stats_t* stats, const struct machine_t* cpu,
+               int enabled, const char* csv);
+
+/**
+ * Adds the time passed since the last call to a time value of the current
+ * frame, which tells how long the main loop spent doing that.
+ */
+void mark_time(struct stats_t* stats, int stat);
+
+/**
+ * Ends the current frame, counting the cycles run and the draws made by
+ * the machine since the last frame ended. Percentiles are printed when
+ * the window is filled.
+ */
+void end_frame(struct stats_t* stats, const struct machine_t* cpu);
+
+/**
+ * Prints the percentiles of the frames in the window on stderr.
+ */
+void print_stats(const struct stats_t* stats);
+
+/**
+ * Stops taking statistics, printing the last ones and closing the file.
+ */
+void free_stats(struct stats_t* stats);
+
+#endif // STATS_H_
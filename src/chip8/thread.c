@@ -0,0 +1,216 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thread.h"
+#include "pacing.h"
+#include "tuner.h"
+
+#include <SDL.h>
+#include <string.h>
+
+/*
+ * Triple buffer. The emulation thread writes to the back frame and then
+ * swaps it with the middle one; the main thread swaps the front frame with
+ * the middle one when the middle one is fresh. This way none of them ever
+ * waits for the other, and the main thread always gets the latest frame.
+ */
+
+#define FRESH 4 // Set in the middle index if the frame was not taken yet.
+
+static struct frame_t frames[3];
+
+static int back = 0;            // Owned by the emulation thread.
+
+static SDL_atomic_t middle = { 1 };
+
+static int front = 2;           // Owned by the main thread.
+
+/*
+ * Keypad queue. The main thread appends at the tail and the emulation
+ * thread removes from the head, so each counter has a single writer.
+ */
+
+#define QUEUE_SIZE 64
+
+static word keypads[QUEUE_SIZE];
+
+static SDL_atomic_t head, tail;
+
+static SDL_Thread* thread = NULL;
+
+static SDL_atomic_t running;
+
+/**
+ * Swaps the value of an atomic variable. Unlike SDL_AtomicSet, which may
+ * only be an acquire barrier, this is a full memory barrier.
+ * @return the previous value.
+ */
+static int
+exchange(SDL_atomic_t* atomic, int value)
+{
+    int old;
+    do {
+        old = SDL_AtomicGet(atomic);
+    } while (!SDL_AtomicCAS(atomic, old, value));
+    return old;
+}
+
+/**
+ * Publishes the screen of the machine as the latest frame.
+ */
+static void
+publish_frame(const struct machine_t* cpu)
+{
+    memcpy(frames[back].screen, cpu->screen, sizeof(cpu->screen));
+    frames[back].esm = cpu->esm;
+    back = exchange(&middle, back | FRESH) & ~FRESH;
+}
+
+const struct frame_t*
+take_frame()
+{
+    if (SDL_AtomicGet(&middle) & FRESH) {
+        front = exchange(&middle, front) & ~FRESH;
+    }
+    return &frames[front];
+}
+
+void
+send_keypad(word keypad)
+{
+    int at = SDL_AtomicGet(&tail);
+    if (at - SDL_AtomicGet(&head) == QUEUE_SIZE) {
+        /* The emulation thread is stuck; it will get the next one. */
+        return;
+    }
+    keypads[at % QUEUE_SIZE] = keypad;
+    SDL_AtomicAdd(&tail, 1);
+}
+
+/**
+ * Updates the keypad of the machine with the states sent by the main
+ * thread. A key pressed while the machine waits for a key is delivered.
+ */
+static void
+receive_keypad(struct machine_t* cpu)
+{
+    int from = SDL_AtomicGet(&head), to = SDL_AtomicGet(&tail);
+    for (int at = from; at != to; at++) {
+        word keypad = keypads[at % QUEUE_SIZE];
+        word pressed = keypad & ~cpu->keypad;
+        if (pressed != 0) {
+            press_key(cpu, __builtin_ctz(pressed));
+        }
+        cpu->keypad = keypad;
+    }
+    SDL_AtomicAdd(&head, to - from);
+}
+
+/* Cycles to run per frame. */
+static int cycles_per_frame;
+
+/* Tunes cycles_per_frame if the speed is automatic. */
+static int auto_speed;
+
+/* Frames run per frame of the main thread, set by set_turbo. */
+static SDL_atomic_t turbo = { 1 };
+
+static int
+emulate(void* data)
+{
+    struct machine_t* cpu = (struct machine_t *) data;
+    unsigned generation = cpu->generation;
+    publish_frame(cpu);
+
+    /* Frames are presented by the main thread, so only emulation is work. */
+    struct tuner_t tuner;
+    init_tuner(&tuner, cpu, cycles_per_frame);
+
+    /* As in the main loop, fast-forwarded frames are not heard one by one. */
+    speaker_handler_t speaker = cpu->speaker;
+
+    struct pacer_t pacer;
+    init_pacer(&pacer, 60);
+    while (SDL_AtomicGet(&running) && cpu->stop != STOP_EXIT) {
+        int frames = wait_frame(&pacer, 1);
+        int times = SDL_AtomicGet(&turbo);
+        cpu->speaker = times > 1 ? NULL : speaker;
+        receive_keypad(cpu);
+        start_work(&tuner);
+        for (int frame = 0; frame < frames * times; frame++) {
+            tick_timers(cpu);
+            run_machine(cpu, cycles_per_frame);
+            if (times == 1) {
+                count_frame(&tuner, cpu);
+            }
+            if (cpu->stop == STOP_EXIT) {
+                break;
+            }
+        }
+        if (times > 1 && speaker) {
+            speaker(cpu->st != 0);
+        } else if (times == 1) {
+            end_work(&tuner);
+        }
+        if (auto_speed && update_tuner(&tuner)) {
+            cycles_per_frame = tuner.speed;
+        }
+        if (cpu->generation != generation) {
+            generation = cpu->generation;
+            publish_frame(cpu);
+        }
+    }
+    SDL_AtomicSet(&running, 0);
+    return 0;
+}
+
+void
+set_turbo(int frames)
+{
+    SDL_AtomicSet(&turbo, frames);
+}
+
+int
+start_emulation(struct machine_t* cpu, int speed, int tune)
+{
+    cycles_per_frame = speed;
+    auto_speed = tune;
+    SDL_AtomicSet(&running, 1);
+    thread = SDL_CreateThread(&emulate, "emulation", cpu);
+    if (thread == NULL) {
+        SDL_AtomicSet(&running, 0);
+        return 1;
+    }
+    return 0;
+}
+
+int
+is_emulation_running()
+{
+    return SDL_AtomicGet(&running);
+}
+
+void
+stop_emulation()
+{
+    SDL_AtomicSet(&running, 0);
+    if (thread != NULL) {
+        SDL_WaitThread(thread, NULL);
+        thread = NULL;
+    }
+}
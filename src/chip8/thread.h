@@ -0,0 +1,79 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Emulation thread. When chip8 is run with --thread, the machine runs on
+ * its own thread, so that presenting a frame doesn't stall emulation and
+ * the other way around. Both threads share no locks: frames go from the
+ * emulation thread to the main thread through a triple buffer, and the
+ * state of the keypad goes the other way through a queue.
+ */
+
+#ifndef THREAD_H_
+#define THREAD_H_
+
+#include <lib8/cpu.h>
+
+/** Copy of the screen of the machine, published by the emulation thread. */
+struct frame_t
+{
+    uint64_t screen[128];       // Screen bitmap, as in machine_t.
+    int esm;                    // Is in Extended Screen Mode?
+};
+
+/**
+ * Starts running a machine on the emulation thread. The machine must not
+ * be used by the caller until stop_emulation returns.
+ * @param cpu machine to run.
+ * @param speed cycles to run per frame.
+ * @param tune if set, speed is only the initial speed, which is then tuned
+ *        as described in tuner.h.
+ * @return 0 if the thread was started, != 0 otherwise.
+ */
+int start_emulation(struct machine_t* cpu, int speed, int tune);
+
+/**
+ * Sets how many frames the emulation thread runs per frame of the main
+ * thread, which is more than one while fast-forwarding.
+ */
+void set_turbo(int frames);
+
+/**
+ * Tells whether the emulation thread is still running. It stops on its own
+ * when the machine exits.
+ */
+int is_emulation_running();
+
+/**
+ * Stops the emulation thread and waits for it to finish.
+ */
+void stop_emulation();
+
+/**
+ * Gets the latest frame published by the emulation thread. The frame stays
+ * valid until take_frame is called again.
+ */
+const struct frame_t* take_frame();
+
+/**
+ * Sends the state of the keypad to the emulation thread. Bit N is set if
+ * key N is held down.
+ */
+void send_keypad(word keypad);
+
+#endif // THREAD_H_
@@ -0,0 +1,130 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tuner.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define WINDOW_FRAMES 30 // Frames counted before adjusting the speed.
+
+#define MAX_LOAD 50 // Percent of host time that may be spent working.
+
+void
+init_tuner(struct tuner_t* tuner, const struct machine_t* cpu, int speed)
+{
+    memset(tuner, 0, sizeof(struct tuner_t));
+    tuner->speed = tuner->base = speed;
+    tuner->min = speed / 4 > 0 ? speed / 4 : 1;
+    tuner->max = speed * 64;
+    tuner->frequency = SDL_GetPerformanceFrequency();
+    tuner->generation = cpu->generation;
+}
+
+void
+start_work(struct tuner_t* tuner)
+{
+    tuner->started = SDL_GetPerformanceCounter();
+}
+
+void
+end_work(struct tuner_t* tuner)
+{
+    tuner->busy += SDL_GetPerformanceCounter() - tuner->started;
+}
+
+void
+count_frame(struct tuner_t* tuner, const struct machine_t* cpu)
+{
+    tuner->frames++;
+    if (cpu->stop == STOP_BUDGET) {
+        tuner->full++;
+    } else if (cpu->stop == STOP_IDLE) {
+        tuner->idle++;
+    }
+    if (cpu->pc == tuner->pc) {
+        tuner->stuck++;
+    }
+    tuner->pc = cpu->pc;
+    tuner->draws += cpu->generation - tuner->generation;
+    tuner->generation = cpu->generation;
+}
+
+/**
+ * Gets the speed that the ROM should run at, according to the frames
+ * counted in the window.
+ */
+static int
+tuned_speed(const struct tuner_t* tuner)
+{
+    int speed = tuner->speed;
+    if (tuner->load > MAX_LOAD) {
+        return speed - speed / 4;
+    }
+
+    /* Frames spent waiting for a key tell nothing about the speed. */
+    if (2 * (tuner->full + tuner->idle) < tuner->frames) {
+        return speed;
+    }
+    if (4 * tuner->idle >= 3 * tuner->frames) {
+        /* The ROM paces itself; give it time to reach its wait. */
+        return 10 * tuner->full >= tuner->frames ? speed + speed / 8 + 1
+                                                 : speed;
+    }
+    if (tuner->idle == 0) {
+        /*
+         * The speed of the game depends on the budget, so keep the one it
+         * was started at, unless the ROM is busy without drawing anything
+         * and not just spinning in place, as ROMs do when they end.
+         */
+        if (tuner->draws == 0 && 2 * tuner->stuck < tuner->frames) {
+            return speed + speed / 8 + 1;
+        }
+        if (speed > tuner->base) {
+            return speed - (speed - tuner->base + 7) / 8;
+        }
+    }
+    return speed;
+}
+
+int
+update_tuner(struct tuner_t* tuner)
+{
+    if (tuner->frames < WINDOW_FRAMES) {
+        return 0;
+    }
+
+    /* Each frame lasts 1/60 of a second. */
+    tuner->load = tuner->busy * 60 * 100 / (tuner->frequency * tuner->frames);
+    int speed = tuned_speed(tuner);
+    if (speed < tuner->min) {
+        speed = tuner->min;
+    } else if (speed > tuner->max) {
+        speed = tuner->max;
+    }
+
+    tuner->busy = 0;
+    tuner->frames = tuner->full = tuner->idle = tuner->stuck = 0;
+    tuner->draws = 0;
+    if (speed == tuner->speed) {
+        return 0;
+    }
+    tuner->speed = speed;
+    fprintf(stderr, "Speed emulation: %d (%d%% busy)\n", speed, tuner->load);
+    return 1;
+}
@@ -0,0 +1,86 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Speed tuner. With --speed auto, the cycles run per frame are not fixed:
+ * they are adjusted every half a second, looking at the host time spent
+ * running the machine and at what the ROM did with its budget.
+ */
+
+#ifndef TUNER_H_
+#define TUNER_H_
+
+#include <lib8/cpu.h>
+#include <SDL.h>
+
+/** State of the tuner, which measures frames in windows. */
+struct tuner_t
+{
+    int speed;                  // Cycles to run per frame.
+    int base;                   // Speed the tuner was started at.
+    int min, max;               // Bounds of the speed.
+    int load;                   // Percent of host time busy, last window.
+    Uint64 frequency;           // Ticks of the counter per second.
+    Uint64 started;             // Counter when the current work started.
+    Uint64 busy;                // Ticks spent working in this window.
+    int frames;                 // Frames run in this window.
+    int full;                   // Frames that spent the whole budget.
+    int idle;                   // Frames that ended waiting on the timer.
+    int stuck;                  // Frames that ended where the last one did.
+    address pc;                 // Program counter when the last frame ended.
+    unsigned draws;             // Screen updates in this window.
+    unsigned generation;        // Generation of the screen last seen.
+};
+
+/**
+ * Starts tuning the speed of a machine.
+ * @param speed initial cycles per frame. The speed is kept between a
+ *        fourth of it and 64 times it.
+ */
+void init_tuner(struct tuner_t* tuner, const struct machine_t* cpu,
+                int speed);
+
+/**
+ * Marks the start of work that counts as host time, such as running or
+ * rendering the machine.
+ */
+void start_work(struct tuner_t* tuner);
+
+/**
+ * Marks the end of work started with start_work.
+ */
+void end_work(struct tuner_t* tuner);
+
+/**
+ * Records what the machine did in the frame it has just run.
+ */
+void count_frame(struct tuner_t* tuner, const struct machine_t* cpu);
+
+/**
+ * Adjusts the speed once enough frames have been counted. The speed goes
+ * down when the host is busy for more than half the time. Otherwise, it
+ * goes up when a ROM that waits on the delay timer runs out of budget
+ * before its wait, and it moves towards one screen update per frame for
+ * ROMs that don't use the timer, like the COSMAC VIP did by waiting for
+ * the display before drawing a sprite.
+ *
+ * @return 1 if the speed changed, 0 otherwise.
+ */
+int update_tuner(struct tuner_t* tuner);
+
+#endif // TUNER_H_
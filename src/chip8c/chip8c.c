@@ -0,0 +1,206 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chip8c translates a ROM ahead of time. The ROM is translated to C and
+ * compiled as a shared object that chip8 loads with --native. Files are
+ * named after the hash of the ROM, so a directory can be used as a cache
+ * of compiled ROMs.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <lib8/cpu.h>
+#include <config.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Flag set by '--source'. */
+static int source_only;
+
+/* Flag set by '--force'. */
+static int force;
+
+/* Directory set by '--output'. */
+static const char* output = ".";
+
+/* getopt parameter structure. */
+static struct option long_options[] = {
+    { "help", no_argument, 0, 'h' },
+    { "version", no_argument, 0, 'v' },
+    { "source", no_argument, &source_only, 1 },
+    { "force", no_argument, &force, 1 },
+    { "output", required_argument, 0, 'o' },
+    { 0, 0, 0, 0 }
+};
+
+/**
+ * Print usage. In case you use bad arguments, this will be printed.
+ * @param name how is the program named, usually argv[0].
+ */
+static void
+usage(const char* name)
+{
+    /* How many characters has Usage: %s? */
+    int pad = strlen(name) + 7; // 7 = "Usage: "
+
+    printf("Usage: %s [-h | --help] [-v | --version]\n", name);
+    printf("%*c [--source] [--force] [-o | --output <dir>] <file>\n",
+           pad, ' ');
+}
+
+/**
+ * Compiles the translated source as a shared object, using the compiler
+ * given in the CC environment variable or cc if it is not set. CC is
+ * split on blanks into the compiler and its own options; no shell is
+ * involved, so paths are passed as they are.
+ * @return 0 if the shared object was built, != 0 otherwise.
+ */
+static int
+compile(const char* source, const char* object)
+{
+    const char* cc = getenv("CC");
+    if (cc == NULL || cc[strspn(cc, " \t")] == 0) {
+        cc = "cc";
+    }
+
+    static const char* flags[] = {
+        "-O2", "-fPIC", "-shared", "-fno-strict-aliasing", "-o"
+    };
+    char words[1024];
+    char* argv[64];
+    int argc = 0;
+    if (strlen(cc) >= sizeof(words)) {
+        fprintf(stderr, "CC too long.\n");
+        return 1;
+    }
+    strcpy(words, cc);
+    for (char* word = strtok(words, " \t"); word != NULL;
+         word = strtok(NULL, " \t")) {
+        /* Room is left for the flags, the paths and NULL. */
+        if (argc == 64 - 8) {
+            fprintf(stderr, "Too many words in CC.\n");
+            return 1;
+        }
+        argv[argc++] = word;
+    }
+    for (size_t flag = 0; flag < sizeof(flags) / sizeof(flags[0]); flag++) {
+        argv[argc++] = (char*) flags[flag];
+    }
+    argv[argc++] = (char*) object;
+    argv[argc++] = (char*) source;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return 1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        fprintf(stderr, "Cannot run %s.\n", argv[0]);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    static struct machine_t mac;
+
+    /* Parse parameters */
+    int indexptr, c;
+    while ((c = getopt_long(argc, argv, "hvo:", long_options, &indexptr))
+           != -1) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'v':
+                printf("%s\n", PACKAGE_STRING);
+                exit(0);
+            case 'o':
+                output = optarg;
+                break;
+            case 0:
+                /* A long option is being processed. */
+                break;
+            default:
+                exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%1$s: no file given. '%1$s -h' for help.\n", argv[0]);
+        exit(1);
+    }
+
+    init_machine(&mac);
+    int error = load_rom(&mac, argv[optind]);
+    if (error != ROM_OK) {
+        fprintf(stderr, "%s.\n", rom_error_message(error));
+        exit(1);
+    }
+
+    /* Files are named after the ROM, so that they can be looked up. */
+    char source[1024], object[1024];
+    uint32_t hash = hash_program(&mac);
+    snprintf(source, sizeof(source), "%s/%08x.c", output, hash);
+    snprintf(object, sizeof(object), "%s/%08x.so", output, hash);
+
+    FILE* fp = fopen(object, "rb");
+    if (fp != NULL && !force && !source_only) {
+        /* Already compiled. */
+        fclose(fp);
+        printf("%s\n", object);
+        return 0;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    if (translate_program(&mac, source)) {
+        fprintf(stderr, "Cannot write %s.\n", source);
+        exit(1);
+    }
+    if (source_only) {
+        printf("%s\n", source);
+        return 0;
+    }
+    if (compile(source, object)) {
+        fprintf(stderr, "Cannot compile %s.\n", source);
+        exit(1);
+    }
+    remove(source);
+    printf("%s\n", object);
+
+    free_machine(&mac);
+    return 0;
+}
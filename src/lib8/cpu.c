@@ -17,6 +17,7 @@
  */
 
 #include "cpu.h"
+#include "engine.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -28,19 +29,18 @@
 #define OPCODE_Y(opcode) ((opcode >> 4) & 0xF)
 #define OPCODE_P(opcode) (opcode >> 12)
 
-static int is_debug = 0;
-
 static void
-log(const char* msg)
+log(const struct machine_t* cpu, const char* msg)
 {
-    if (is_debug) {
+    if (cpu->debug) {
         printf("MESSAGE: %s\n", msg);
     }
 }
 
 void
-set_debug_mode(int debug_mode) {
-    is_debug = debug_mode;
+set_debug_mode(struct machine_t* cpu, int debug_mode) {
+    cpu->debug = debug_mode;
+    log(cpu, "Debug mode is enabled");
 }
 
 /**
@@ -49,7 +49,7 @@ set_debug_mode(int debug_mode) {
  * instruction sets I register to the memory address of a provided
  * number.
  */
-static char hexcodes[] = {
+static const char hexcodes[] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -68,340 +68,600 @@ static char hexcodes[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-static int global_delta;
+/*
+ * Opcode handlers. There is one handler per opcode. The handler to use for
+ * every instruction is chosen once during decoding, so the operands given
+ * in the instruction have already been extracted from the opcode.
+ */
 
-typedef void (*opcode_table_t) (struct machine_t* cpu, word opcode);
+static void
+op_nop(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* Unknown or unsupported opcode. Do nothing. */
+}
 
 static void
-nibble_0(struct machine_t* cpu, word opcode)
+op_00CN(struct machine_t* cpu, const struct instr_t* in)
 {
-    if ((opcode & 0xFFF0) == 0x00c0)  {
-        /* 00CN: SCD - Scroll down. */
-        int rowsiz = cpu->esm ? 128 : 64;
-        int colsiz = cpu->esm ? 64 : 32;
-        int n = OPCODE_N(opcode);
-        int start_row = 0, last_row = colsiz - n - 1;
-        for (int row = last_row; row >= start_row; row--) {
-            for (int x = 0; x < rowsiz; x++) {
-                int from = row * rowsiz + x;
-                int to = (row + n) * rowsiz + x;
-                cpu->screen[to] = cpu->screen[from];
-            }
-        }
-    } else if (opcode == 0x00e0) {
-        /* 00E0: CLS - Clear the screen. */
-        memset(cpu->screen, 0, 2048);
-    } else if (opcode == 0x00ee) {
-        /* 00EE: RET - Return from subroutine. */
-        if (cpu->sp > 0)
-        cpu->pc = cpu->stack[(int) --cpu->sp];
-        /* TODO: Should throw an error on stack underflow. */
-    } else if (opcode == 0x00fb) {
-        /* 00FB: SCR - Scroll 4 pixels to the right. */
-        int rowsiz = cpu->esm ? 128 : 64;
-        int colsiz = cpu->esm ? 64 : 32;
-        int start_col = 0, last_col = rowsiz - 4 - 1;
-        for (int col = last_col; col >= start_col; col--) {
-            for (int y = 0; y < colsiz; y++) {
-                int from = y * rowsiz + col;
-                int to = y * rowsiz + (4 + col);
-                cpu->screen[to] = cpu->screen[from];
-            }
-        }
-    } else if (opcode == 0x00fc) {
-        /* 00FC: SCL - Scroll 4 pixels to the left. */
-        int rowsiz = cpu->esm ? 128 : 64;
-        int colsiz = cpu->esm ? 64 : 32;
-        int start_col = 4, last_col = rowsiz - 1;
-        for (int col = start_col; col <= last_col; col++) {
-            for (int y = 0; y < colsiz; y++) {
-                int from = y * rowsiz + col;
-                int to = y * rowsiz + (col - 4);
-                cpu->screen[to] = cpu->screen[from];
-            }
-        }
-    } else if (opcode == 0x00fd) {
-        /* 00FD: EXIT - Stop emulator. */
-        cpu->exit = 1;
-    } else if (opcode == 0x00fe) {
-        /* 00FE: LOW - Disable extended screen mode. */
-        cpu->esm = 0;
-    } else if (opcode == 0x00ff) {
-        /* 00FF: HIGH - Enable extended scren mode. */
-        cpu->esm = 1;
-    }
+    /* 00CN: SCD - Scroll down. */
+    SCREEN_MODE(cpu)->scroll_down(cpu, in);
+    cpu->drawn = 1;
+}
+
+static void
+op_00E0(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00E0: CLS - Clear the screen. */
+    memset(cpu->screen, 0, sizeof(cpu->screen));
+    MARK_DIRTY(cpu, ALL_ROWS);
+    cpu->drawn = 1;
+}
+
+static void
+op_00EE(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00EE: RET - Return from subroutine. */
+    if (cpu->sp > 0)
+    cpu->pc = cpu->stack[(int) --cpu->sp];
+    /* TODO: Should throw an error on stack underflow. */
+}
+
+static void
+op_00FB(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00FB: SCR - Scroll 4 pixels to the right. */
+    SCREEN_MODE(cpu)->scroll_right(cpu, in);
+    cpu->drawn = 1;
+}
+
+static void
+op_00FC(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00FC: SCL - Scroll 4 pixels to the left. */
+    SCREEN_MODE(cpu)->scroll_left(cpu, in);
+    cpu->drawn = 1;
+}
+
+static void
+op_00FD(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00FD: EXIT - Stop emulator. */
+    cpu->exit = 1;
+}
+
+static void
+op_00FE(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00FE: LOW - Disable extended screen mode. */
+    cpu->esm = 0;
+    MARK_DIRTY(cpu, ALL_ROWS);
+    cpu->drawn = 1;
+}
+
+static void
+op_00FF(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 00FF: HIGH - Enable extended scren mode. */
+    cpu->esm = 1;
+    MARK_DIRTY(cpu, ALL_ROWS);
+    cpu->drawn = 1;
 }
 
 static void
-nibble_1(struct machine_t* cpu, word opcode)
+op_1NNN(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 1NNN: JMP - Jump to address location NNN. */
-    cpu->pc = OPCODE_NNN(opcode);
+    cpu->pc = in->nnn;
 }
 
 static void
-nibble_2(struct machine_t* cpu, word opcode)
+op_2NNN(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 2NNN: CALL - Call subroutine starting at address NNN. */
     if (cpu->sp < 16) {
         cpu->stack[(int) cpu->sp++] = cpu->pc;
-        cpu->pc = OPCODE_NNN(opcode);
+        cpu->pc = in->nnn;
     }
     /* TODO: Should throw an error on stack overflow. */
 }
 
 static void
-nibble_3(struct machine_t* cpu, word opcode)
+op_3XKK(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 3XKK: SE: Skip next instruction if V[X] = KK. */
-    if (cpu->v[OPCODE_X(opcode)] == OPCODE_KK(opcode))
+    if (cpu->v[in->x] == in->kk)
         cpu->pc = (cpu->pc + 2) & 0xfff;
 }
 
 static void
-nibble_4(struct machine_t* cpu, word opcode)
+op_4XKK(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 4XKK: SNE - Skip next instruction if V[X] != KK. */
-    if (cpu->v[OPCODE_X(opcode)] != OPCODE_KK(opcode))
+    if (cpu->v[in->x] != in->kk)
         cpu->pc = (cpu->pc + 2) & 0xfff;
 }
 
 static void
-nibble_5(struct machine_t* cpu, word opcode)
+op_5XY0(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 5XY0: SE - Skip next instruction if V[X] == V[Y]. */
-    if (cpu->v[OPCODE_X(opcode)] == cpu->v[OPCODE_Y(opcode)])
+    if (cpu->v[in->x] == cpu->v[in->y])
         cpu->pc = (cpu->pc + 2) & 0xfff;
 }
 
 static void
-nibble_6(struct machine_t* cpu, word opcode)
+op_6XKK(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 6XKK: LD - Set V[X] = KK. */
-    cpu->v[OPCODE_X(opcode)] = OPCODE_KK(opcode);
+    cpu->v[in->x] = in->kk;
 }
 
 static void
-nibble_7(struct machine_t* cpu, word opcode)
+op_7XKK(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 7XKK: ADD - Add KK to V[X]. */
-    cpu->v[OPCODE_X(opcode)] += OPCODE_KK(opcode);
-}
-
-static void
-nibble_8(struct machine_t* cpu, word opcode)
-{
-    /* All these opcodes work with X and most of them with Y, worth it. */
-    byte x = OPCODE_X(opcode), y = OPCODE_Y(opcode);
-    switch (OPCODE_N(opcode))
-    {
-    case 0:
-        /* 8XY0: LD - Set V[X] = V[Y]. */
-        cpu->v[x] = cpu->v[y];
-        break;
-    case 1:
-        /* 8XY1: OR - Set V[X] |= V[Y]. */
-        cpu->v[x] |= cpu->v[y];
-        break;
-    case 2:
-        /* 8XY2: AND - Set V[X] &= V[Y]. */
-        cpu->v[x] &= cpu->v[y];
-        break;
-    case 3:
-        /* 8XY3: XOR - Set V[X] ^= V[Y]. */
-        cpu->v[x] ^= cpu->v[y];
-        break;
-    case 4:
-        /* 8XY4: ADD - Set V[X] += V[Y], V[15] is carry flag. */
-        cpu->v[0xf] = cpu->v[x] > ((cpu->v[x] + cpu->v[y]) & 0xFF);
-        cpu->v[x] += cpu->v[y];
-        break;
-    case 5:
-        /* 8XY5: SUB - Set V[X] -= V[Y], V[15] is borrow flag. */
-        cpu->v[0xf] = (cpu->v[x] > cpu->v[y]);
-        cpu->v[x] -= cpu->v[y];
-        break;
-    case 6:
-        /* 8X06: SHR - Shifts right V[X], LSB bit goes to V[15]. */
-        cpu->v[0xf] = (cpu->v[x] & 1);
-        cpu->v[x] >>= 1;
-        break;
-    case 7:
-        /* 8XY7: SUBN X, Y - Set V[X] = V[Y] - V[X], V[16] is borrow. */
-        cpu->v[0xF] = (cpu->v[y] > cpu->v[x]);
-        cpu->v[x] = cpu->v[y] - cpu->v[x];
-        break;
-    case 0xE:
-        /* 8X0E: SHL - Shifts left V[X], MSB bit goes to V[15]. */
-        cpu->v[0xF] = ((cpu->v[x] & 0x80) != 0);
-        cpu->v[x] <<= 1;
-        break;
-    }
-}
-
-static void
-nibble_9(struct machine_t* cpu, word opcode)
+    cpu->v[in->x] += in->kk;
+}
+
+static void
+op_8XY0(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY0: LD - Set V[X] = V[Y]. */
+    cpu->v[in->x] = cpu->v[in->y];
+}
+
+static void
+op_8XY1(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY1: OR - Set V[X] |= V[Y]. */
+    cpu->v[in->x] |= cpu->v[in->y];
+}
+
+static void
+op_8XY2(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY2: AND - Set V[X] &= V[Y]. */
+    cpu->v[in->x] &= cpu->v[in->y];
+}
+
+static void
+op_8XY3(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY3: XOR - Set V[X] ^= V[Y]. */
+    cpu->v[in->x] ^= cpu->v[in->y];
+}
+
+static void
+op_8XY4(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY4: ADD - Set V[X] += V[Y], V[15] is carry flag. */
+    byte x = in->x, y = in->y;
+    cpu->v[0xf] = cpu->v[x] > ((cpu->v[x] + cpu->v[y]) & 0xFF);
+    cpu->v[x] += cpu->v[y];
+}
+
+static void
+op_8XY5(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY5: SUB - Set V[X] -= V[Y], V[15] is borrow flag. */
+    byte x = in->x, y = in->y;
+    cpu->v[0xf] = (cpu->v[x] > cpu->v[y]);
+    cpu->v[x] -= cpu->v[y];
+}
+
+static void
+op_8X06(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8X06: SHR - Shifts right V[X], LSB bit goes to V[15]. */
+    byte x = in->x;
+    cpu->v[0xf] = (cpu->v[x] & 1);
+    cpu->v[x] >>= 1;
+}
+
+static void
+op_8XY7(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8XY7: SUBN X, Y - Set V[X] = V[Y] - V[X], V[16] is borrow. */
+    byte x = in->x, y = in->y;
+    cpu->v[0xF] = (cpu->v[y] > cpu->v[x]);
+    cpu->v[x] = cpu->v[y] - cpu->v[x];
+}
+
+static void
+op_8X0E(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* 8X0E: SHL - Shifts left V[X], MSB bit goes to V[15]. */
+    byte x = in->x;
+    cpu->v[0xF] = ((cpu->v[x] & 0x80) != 0);
+    cpu->v[x] <<= 1;
+}
+
+static void
+op_9XY0(struct machine_t* cpu, const struct instr_t* in)
 {
     /* 9XY0: SNE - Skip next instruction if V[X] != V[Y]. */
-    if (cpu->v[OPCODE_X(opcode)] != cpu->v[OPCODE_Y(opcode)])
+    if (cpu->v[in->x] != cpu->v[in->y])
         cpu->pc = (cpu->pc + 2) & 0xFFF;
 }
 
 static void
-nibble_A(struct machine_t* cpu, word opcode)
+op_ANNN(struct machine_t* cpu, const struct instr_t* in)
 {
     /* ANNN: LD - Set I to NNN. */
-    cpu->i = OPCODE_NNN(opcode);
+    cpu->i = in->nnn;
 }
 
 static void
-nibble_B(struct machine_t* cpu, word opcode)
+op_BNNN(struct machine_t* cpu, const struct instr_t* in)
 {
     /* BNNN: JP - Jump to memory address (V[0] + NNN). */
-    cpu->pc = (cpu->v[0] + OPCODE_NNN(opcode)) & 0xFFF;
+    cpu->pc = (cpu->v[0] + in->nnn) & 0xFFF;
+}
+
+/**
+ * Gets the next byte of the random generator of a machine, which is a
+ * xoshiro128** generator. Each machine has its own, so that machines
+ * running on different threads don't share state nor wait on a lock, and
+ * a machine seeded the same way always gets the same numbers.
+ */
+static byte
+next_random(struct machine_t* cpu)
+{
+    uint32_t* s = cpu->random;
+    uint32_t x = s[1] * 5;
+    uint32_t result = (x << 7 | x >> 25) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 11 | s[3] >> 21;
+    return result >> 24;
+}
+
+void
+seed_random(struct machine_t* cpu, uint64_t seed)
+{
+    /* Spread the seed with splitmix64, whose outputs are never both 0. */
+    for (int i = 0; i < 4; i += 2) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+        cpu->random[i] = z;
+        cpu->random[i + 1] = z >> 32;
+    }
 }
 
 static void
-nibble_C(struct machine_t* cpu, word opcode)
+op_CXKK(struct machine_t* cpu, const struct instr_t* in)
 {
     /* CXKK: RND - Put a random value, bitmasked against KK in V[X]. */
-    cpu->v[OPCODE_X(opcode)] = rand() & OPCODE_KK(opcode);
+    cpu->v[in->x] = next_random(cpu) & in->kk;
 }
 
 static void
-nibble_D(struct machine_t* cpu, word opcode)
+op_DXYN(struct machine_t* cpu, const struct instr_t* in)
 {
     /* DXYN: DRW - Draw a sprite on the screen at location V[X], V[Y]. */
-    byte x = OPCODE_X(opcode), y = OPCODE_Y(opcode);
-    cpu->v[15] = 0;
-    if (cpu->esm && OPCODE_N(opcode) == 0) {
-        for (int j = 0; j < 16; j++) {
-            // Sprite to plot on this line.
-            byte hi = cpu->mem[(cpu->i + 2 * j) & ADDRESS_MASK];
-            byte lo = cpu->mem[(cpu->i + 2 * j + 1) & ADDRESS_MASK];
-            word sprite = hi << 8 | lo;
-            for (int i = 0; i < 16; i++) {
-                // Where to plot at.
-                int px = (cpu->v[x] + i) & 127;
-                int py = (cpu->v[y] + j) & 63;
-                int pos = 128 * py + px;
-                // What to plot.
-                int pixel = (sprite & (1 << (15-i))) != 0;
-                cpu->v[15] |= (cpu->screen[pos] & pixel);
-                cpu->screen[pos] ^= pixel;
-            }
-        }
-    } else for (int j = 0; j < OPCODE_N(opcode); j++) {
-        byte sprite = cpu->mem[(cpu->i + j) & ADDRESS_MASK];
-        for (int i = 0; i < 8; i++) {
-            // Where to plot at.
-            int px = (cpu->v[x] + i) & (cpu->esm ? 127 : 63);
-            int py = (cpu->v[y] + j) & (cpu->esm ? 63 : 31);
-            int pos = (cpu->esm ? 128 : 64) * py + px;
-            // What to plot.
-            int pixel = (sprite & (1 << (7-i))) != 0;
-            cpu->v[15] |= (cpu->screen[pos] & pixel);
-            cpu->screen[pos] ^= pixel;
-        }
+    SCREEN_MODE(cpu)->draw(cpu, in);
+    cpu->drawn = 1;
+}
+
+/**
+ * Checks whether a key is held down, asking the keyboard poller if there
+ * is one, or looking at the keypad otherwise.
+ */
+static int
+is_key_held(struct machine_t* cpu, int key)
+{
+    if (cpu->keydown)
+        return cpu->keydown(key) != 0;
+    return (cpu->keypad >> key) & 1;
+}
+
+static void
+op_EX9E(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* EX9E: SKP - Skip next instruction if key V[X] is down. */
+    int down = is_key_held(cpu, cpu->v[in->x] & 0xF);
+    cpu->pc = (cpu->pc + 2 * down) & 0xFFF;
+}
+
+static void
+op_EXA1(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* EXA1: SKNP - Skip next instruction if key V[X] is not down. */
+    int down = is_key_held(cpu, cpu->v[in->x] & 0xF);
+    cpu->pc = (cpu->pc + 2 * !down) & 0xFFF;
+}
+
+static void
+op_FX07(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX07: LD - Set V[X] to DT. */
+    cpu->v[in->x] = cpu->dt;
+}
+
+/**
+ * FX07 at the head of an idle loop, see is_idle_head. Flags the machine as
+ * idle if the skip that follows is not going to leave the loop, since the
+ * delay timer doesn't change until update_time is called again.
+ */
+static void
+op_FX07_idle(struct machine_t* cpu, const struct instr_t* in)
+{
+    cpu->v[in->x] = cpu->dt;
+    int se = (cpu->mem[cpu->pc & ADDRESS_MASK] >> 4) == 0x3;
+    byte kk = cpu->mem[(cpu->pc + 1) & ADDRESS_MASK];
+    /* 3XKK stays in the loop while DT != KK, 4XKK while DT == KK. */
+    cpu->idle = se == (cpu->dt != kk);
+}
+
+static void
+op_FX0A(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX0A: LD - Wait for a keypress, then store the key in V[X]. */
+    cpu->wait_key = in->x;
+}
+
+static void
+op_FX15(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX15: LD - Set DT to V[X]. */
+    cpu->dt = cpu->v[in->x];
+}
+
+static void
+op_FX18(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX18: LD - Set ST to V[X]. */
+    cpu->st = cpu->v[in->x];
+}
+
+static void
+op_FX1E(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX1E: ADD - Add V[X] to I. */
+    cpu->i += cpu->v[in->x];
+}
+
+static void
+op_FX29(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX29: LD - Set I to the address location for the sprite. */
+    cpu->i = 0x50 + (cpu->v[in->x] & 0xF) * 5;
+}
+
+static void
+op_FX30(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX30: LD H, F - Load a 10 byte font glyph. */
+    cpu->i = 0x8200 + (cpu->v[in->x] & 0xF) * 10;
+}
+
+static void
+op_FX33(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX33: Represent V[X] as BCD in I, I+1, I+2. */
+    cpu->mem[(cpu->i + 2) & ADDRESS_MASK] = cpu->v[in->x] % 10;
+    cpu->mem[(cpu->i + 1) & ADDRESS_MASK] = (cpu->v[in->x] / 10) % 10;
+    cpu->mem[cpu->i & ADDRESS_MASK] = cpu->v[in->x] / 100;
+    invalidate_code(cpu, cpu->i, 3);
+}
+
+static void
+op_FX55(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX55: LD - Save registers V[0] to V[x] starting at I. */
+    for (int reg = 0; reg <= in->x; reg++) {
+        cpu->mem[(cpu->i + reg) & ADDRESS_MASK] = cpu->v[reg];
     }
+    invalidate_code(cpu, cpu->i, in->x + 1);
 }
 
 static void
-nibble_E(struct machine_t* cpu, word opcode)
-{
-    char key = cpu->v[OPCODE_X(opcode)];
-    if (OPCODE_KK(opcode) == 0x9E) {
-        /* EX9E: SKP - Skip next instruction if key V[X] is down. */
-        if (cpu->keydown && cpu->keydown(key & 0xF))
-            cpu->pc = (cpu->pc + 2) & 0xFFF;
-    } else if (OPCODE_KK(opcode) == 0xA1) {
-        /* EXA1: SKNP - Skip next instruction if key V[X] is not down. */
-        if (cpu->keydown && !cpu->keydown(key & 0xF))
-            cpu->pc = (cpu->pc + 2) & 0xFFF;
-    }
-}
-
-static void
-nibble_F(struct machine_t* cpu, word opcode)
-{
-    switch (OPCODE_KK(opcode)) {
-    case 0x07:
-        /* FX07: LD - Set V[X] to DT. */
-        cpu->v[OPCODE_X(opcode)] = cpu->dt;
-        break;
-    case 0x0A:
-        /* FX0A: LD - Wait for a keypress, then store the key in V[X]. */
-        cpu->wait_key = OPCODE_X(opcode);
-        break;
-    case 0x15:
-        /* FX15: LD - Set DT to V[X]. */
-        cpu->dt = cpu->v[OPCODE_X(opcode)];
-        break;
-    case 0x18:
-        /* FX18: LD - Set ST to V[X]. */
-        cpu->st = cpu->v[OPCODE_X(opcode)];
-        break;
-    case 0x1E:
-        /* FX1E: ADD - Add V[X] to I. */
-        cpu->i += cpu->v[OPCODE_X(opcode)];
-        break;
-    case 0x29:
-        /* FX29: LD - Set I to the address location for the sprite. */
-        cpu->i = 0x50 + (cpu->v[OPCODE_X(opcode)] & 0xF) * 5;
-        break;
-    case 0x30:
-        /* FX30: LD H, F - Load a 10 byte font glyph. */
-        cpu->i = 0x8200 + (cpu->v[OPCODE_X(opcode)] & 0xF) * 10;
-        break;
-    case 0x33:
-        /* FX33: Represent V[X] as BCD in I, I+1, I+2. */
-        cpu->mem[(cpu->i + 2) & ADDRESS_MASK] = cpu->v[OPCODE_X(opcode)] % 10;
-        cpu->mem[(cpu->i + 1) & ADDRESS_MASK] = (cpu->v[OPCODE_X(opcode)] / 10) % 10;
-        cpu->mem[cpu->i & ADDRESS_MASK] = cpu->v[OPCODE_X(opcode)] / 100;
-        break;
-    case 0x55:
-        /* FX55: LD - Save registers V[0] to V[x] starting at I. */
-        for (int reg = 0; reg <= OPCODE_X(opcode); reg++) {
-            cpu->mem[(cpu->i + reg) & ADDRESS_MASK] = cpu->v[reg];
-        }
-        break;
-    case 0x65:
-        /* FX65: LD - Load registers V[0] to V[x] from I. */
-        for (int reg = 0; reg <= OPCODE_X(opcode); reg++) {
-            cpu->v[reg] = cpu->mem[(cpu->i + reg) & ADDRESS_MASK];
-        }
-        break;
-    case 0x75:
-        /* FX75: LD R, V - Store V[0]..V[X] in R registers. */
-        // FIXME: Should check that X <= 7.
-        for (int reg = 0; reg <= OPCODE_X(opcode); reg++) {
-            cpu->r[reg] = cpu->v[reg];
-        }
-        break;
-    case 0x85:
-        /* FX85: LD V, R - Load V[0]..V[X] in R registers. */
-        // FIXME: Should check that X <= 7.
-        for (int reg = 0; reg <= OPCODE_X(opcode); reg++) {
-            cpu->v[reg] = cpu->r[reg];
-        }
-        break;
+op_FX65(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX65: LD - Load registers V[0] to V[x] from I. */
+    for (int reg = 0; reg <= in->x; reg++) {
+        cpu->v[reg] = cpu->mem[(cpu->i + reg) & ADDRESS_MASK];
+    }
+}
+
+static void
+op_FX75(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX75: LD R, V - Store V[0]..V[X] in R registers. */
+    /* There are only 8 R registers, so X is taken modulo 8. */
+    for (int reg = 0; reg <= (in->x & 7); reg++) {
+        cpu->r[reg] = cpu->v[reg];
+    }
+}
+
+static void
+op_FX85(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* FX85: LD V, R - Load V[0]..V[X] in R registers. */
+    /* There are only 8 R registers, so X is taken modulo 8. */
+    for (int reg = 0; reg <= (in->x & 7); reg++) {
+        cpu->v[reg] = cpu->r[reg];
+    }
+}
+
+/*
+ * Decoders. There is one decoder per possible value of the most significant
+ * nibble of an opcode. A decoder picks the handler that matches the opcode
+ * among the handlers for opcodes starting by that nibble. Nibbles that
+ * cover a single opcode don't require a decoder, just the handler.
+ */
+
+static instr_handler_t
+decode_0(const struct instr_t* in)
+{
+    if ((in->opcode & 0xFFF0) == 0x00c0)
+        return &op_00CN;
+    switch (in->opcode) {
+    case 0x00e0: return &op_00E0;
+    case 0x00ee: return &op_00EE;
+    case 0x00fb: return &op_00FB;
+    case 0x00fc: return &op_00FC;
+    case 0x00fd: return &op_00FD;
+    case 0x00fe: return &op_00FE;
+    case 0x00ff: return &op_00FF;
+    }
+    return &op_nop;
+}
+
+static instr_handler_t
+decode_8(const struct instr_t* in)
+{
+    switch (in->n) {
+    case 0x0: return &op_8XY0;
+    case 0x1: return &op_8XY1;
+    case 0x2: return &op_8XY2;
+    case 0x3: return &op_8XY3;
+    case 0x4: return &op_8XY4;
+    case 0x5: return &op_8XY5;
+    case 0x6: return &op_8X06;
+    case 0x7: return &op_8XY7;
+    case 0xE: return &op_8X0E;
+    }
+    return &op_nop;
+}
+
+static instr_handler_t
+decode_E(const struct instr_t* in)
+{
+    switch (in->kk) {
+    case 0x9E: return &op_EX9E;
+    case 0xA1: return &op_EXA1;
+    }
+    return &op_nop;
+}
+
+static instr_handler_t
+decode_F(const struct instr_t* in)
+{
+    switch (in->kk) {
+    case 0x07: return &op_FX07;
+    case 0x0A: return &op_FX0A;
+    case 0x15: return &op_FX15;
+    case 0x18: return &op_FX18;
+    case 0x1E: return &op_FX1E;
+    case 0x29: return &op_FX29;
+    case 0x30: return &op_FX30;
+    case 0x33: return &op_FX33;
+    case 0x55: return &op_FX55;
+    case 0x65: return &op_FX65;
+    case 0x75: return &op_FX75;
+    case 0x85: return &op_FX85;
     }
+    return &op_nop;
 }
 
 /**
- * This is the handler table. There are 16 handlers in the following array,
- * each one covering a subset of the opcodes for the CHIP-8. During opcode
- * fetching, the most significant nibble (most significant hex char) is taken
- * out as a value in range [0, 15]. The handler from this array whose index
- * matches the value of that nibble is executed. The handler should execute
- * opcodes starting by that value.
+ * Gets the cycles taken by an opcode in the COSMAC VIP, in machine cycles
+ * of 8 clock cycles each. These approximate the timings of the original
+ * interpreter, including the 40 cycles that it takes to fetch and decode
+ * every opcode. The SCHIP opcodes, which the VIP lacks, take as long as
+ * the CHIP-8 opcode closest to them: scrolls take as long as CLS and the
+ * 16x16 sprites as long as a 32 rows tall sprite.
  */
-static opcode_table_t nibbles[16] = {
-    &nibble_0, &nibble_1, &nibble_2, &nibble_3,
-    &nibble_4, &nibble_5, &nibble_6, &nibble_7,
-    &nibble_8, &nibble_9, &nibble_A, &nibble_B,
-    &nibble_C, &nibble_D, &nibble_E, &nibble_F
-};
+static int
+vip_cost(const struct instr_t* in)
+{
+    switch (OPCODE_P(in->opcode)) {
+    case 0x0:
+        if (in->opcode == 0x00E0 || (in->opcode & 0xFFF0) == 0x00C0
+            || in->opcode == 0x00FB || in->opcode == 0x00FC)
+            return 3078;
+        return in->opcode == 0x00EE ? 50 : 40;
+    case 0x1: return 52;
+    case 0x2: return 66;
+    case 0x3: case 0x4: return 50;
+    case 0x5: case 0x9: return 58;
+    case 0x6: return 46;
+    case 0x7: return 50;
+    case 0x8: return 84;
+    case 0xA: return 52;
+    case 0xB: return 62;
+    case 0xC: return 76;
+    case 0xD: return 68 + 46 * (in->n ? in->n : 32);
+    case 0xE: return 54;
+    }
+    switch (in->kk) {
+    case 0x1E: case 0x29: case 0x30: return 56;
+    case 0x33: return 112;
+    case 0x55: case 0x65: case 0x75: case 0x85: return 64 + 14 * in->x;
+    }
+    return 50;
+}
+
+/**
+ * Tells whether the FX07 at the given address is the head of a loop that
+ * polls the delay timer, that is, FX07, then 3XKK or 4XKK over the same
+ * register, then a jump back to the FX07.
+ */
+static int
+is_idle_head(struct machine_t* cpu, address pc)
+{
+    byte x = cpu->mem[pc & ADDRESS_MASK] & 0xF;
+    word skip = cpu->mem[(pc + 2) & ADDRESS_MASK] << 8
+              | cpu->mem[(pc + 3) & ADDRESS_MASK];
+    word jump = cpu->mem[(pc + 4) & ADDRESS_MASK] << 8
+              | cpu->mem[(pc + 5) & ADDRESS_MASK];
+    return (OPCODE_P(skip) == 0x3 || OPCODE_P(skip) == 0x4)
+        && OPCODE_X(skip) == x && jump == (0x1000 | pc);
+}
+
+/**
+ * Decodes the opcode stored in memory at a given address. The operands are
+ * extracted from the opcode and the handler is chosen using the most
+ * significant nibble (most significant hex char) of the opcode, taken out
+ * as a value in range [0, 15].
+ *
+ * @param cpu machine whose memory contains the opcode.
+ * @param pc memory address where the opcode is stored.
+ * @param in instruction where the decoded opcode is written.
+ */
+static void
+decode(struct machine_t* cpu, address pc, struct instr_t* in)
+{
+    word opcode = (cpu->mem[pc & ADDRESS_MASK] << 8)
+                | cpu->mem[(pc + 1) & ADDRESS_MASK];
+    in->opcode = opcode;
+    in->nnn = OPCODE_NNN(opcode);
+    in->x = OPCODE_X(opcode);
+    in->y = OPCODE_Y(opcode);
+    in->n = OPCODE_N(opcode);
+    in->kk = OPCODE_KK(opcode);
+
+    switch (OPCODE_P(opcode)) {
+    case 0x0: in->exec = decode_0(in); break;
+    case 0x1: in->exec = &op_1NNN; break;
+    case 0x2: in->exec = &op_2NNN; break;
+    case 0x3: in->exec = &op_3XKK; break;
+    case 0x4: in->exec = &op_4XKK; break;
+    case 0x5: in->exec = &op_5XY0; break;
+    case 0x6: in->exec = &op_6XKK; break;
+    case 0x7: in->exec = &op_7XKK; break;
+    case 0x8: in->exec = decode_8(in); break;
+    case 0x9: in->exec = &op_9XY0; break;
+    case 0xA: in->exec = &op_ANNN; break;
+    case 0xB: in->exec = &op_BNNN; break;
+    case 0xC: in->exec = &op_CXKK; break;
+    case 0xD: in->exec = &op_DXYN; break;
+    case 0xE: in->exec = decode_E(in); break;
+    case 0xF: in->exec = decode_F(in); break;
+    }
+    if (in->exec == &op_FX07 && is_idle_head(cpu, pc)) {
+        in->exec = &op_FX07_idle;
+    }
+    cpu->cost[pc & ADDRESS_MASK] = cpu->timing == TIMING_VIP
+                                 ? vip_cost(in) : 1;
+}
 
 void
 init_machine(struct machine_t* machine)
@@ -410,125 +670,467 @@ init_machine(struct machine_t* machine)
     memcpy(machine->mem + 0x50, hexcodes, 80);
     machine->pc = 0x200;
     machine->wait_key = -1;
-    global_delta = 0;
-    log("Debug mode is enabled");
-    log("Machine has been initialized");
+    seed_random(machine, 0);
+    log(machine, "Machine has been initialized");
 }
 
-void
-step_machine(struct machine_t* cpu)
+int
+is_drawing(const struct instr_t* in)
 {
-    if (cpu->exit)
-        return;
+    switch (OPCODE_P(in->opcode)) {
+    case 0x0:
+        return (in->opcode & 0xFFF0) == 0x00C0 || in->opcode == 0x00E0
+            || in->opcode == 0x00FB || in->opcode == 0x00FC
+            || in->opcode == 0x00FE || in->opcode == 0x00FF;
+    case 0xD:
+        return 1;
+    }
+    return 0;
+}
 
-    /* Are we waiting for a key press? */
-    if (cpu->wait_key != -1 && cpu->keydown) {
-        for (int i = 0; i < 16; i++) {
-            int status = cpu->keydown(i);
-            if (status) {
-                /* Key was down. Restore system. */
-                cpu->v[(int) cpu->wait_key] = i;
-                cpu->wait_key = -1;
-                break;
-            }
+int
+is_idle_loop(const struct instr_t* in)
+{
+    return in->exec == &op_FX07_idle;
+}
+
+/**
+ * Tells whether an instruction must be the last one in a basic block.
+ * These are the instructions that modify the program counter, the ones
+ * that stop or pause the machine, the ones that draw, the ones that
+ * write to memory, since they could be overwriting the instructions that
+ * follow them, and the heads of idle loops.
+ */
+static int
+ends_block(const struct instr_t* in)
+{
+    if (is_drawing(in) || is_idle_loop(in))
+        return 1;
+    switch (OPCODE_P(in->opcode)) {
+    case 0x0:
+        return in->opcode == 0x00ee || in->opcode == 0x00fd;
+    case 0x1: case 0x2: case 0x3: case 0x4:
+    case 0x5: case 0x9: case 0xB: case 0xE:
+        return 1;
+    case 0xF:
+        return in->kk == 0x0A || in->kk == 0x33 || in->kk == 0x55;
+    }
+    return 0;
+}
+
+/*
+ * Blocks never wrap around the end of the memory and are at most
+ * BLOCK_MAX instructions long. They don't cover breakpoints either,
+ * unless the breakpoint is at the start of the block.
+ */
+int
+build_block(struct machine_t* cpu, address start)
+{
+    struct instr_t* in;
+    address pc = start;
+    int len = 0;
+    do {
+        in = &cpu->code[pc];
+        if (in->exec == NULL) {
+            decode(cpu, pc, in);
         }
-        /* Test again. If we are still waiting for a key, don't fetch. */
-        if (cpu->wait_key != -1) {
-            return;
+        pc += 2;
+        len++;
+    } while (!ends_block(in) && len < BLOCK_MAX && pc < ADDRESS_MASK
+             && !cpu->breakpoint[pc]);
+    cpu->block_len[start] = len;
+    return len;
+}
+
+int
+block_cost(struct machine_t* cpu, address start, int len)
+{
+    int cost = 0;
+    for (address pc = start; pc < start + 2 * len; pc += 2) {
+        struct instr_t* in = &cpu->code[pc & ADDRESS_MASK];
+        if (in->exec == NULL) {
+            decode(cpu, pc, in);
         }
+        cost += cpu->cost[pc & ADDRESS_MASK];
     }
-    
-    /* Fetch next opcode. */
-    word opcode = (cpu->mem[cpu->pc & ADDRESS_MASK] << 8)
-                 | cpu->mem[(cpu->pc + 1) & ADDRESS_MASK];
-    cpu->pc = (cpu->pc + 2) & 0xFFF;
+    return cost;
+}
 
-    if (is_debug) {
-        printf("Executing opcode 0x%x...\n", opcode);
+/**
+ * Invalidates every block that could contain the instruction at the given
+ * address. Since a block is at most BLOCK_MAX instructions long, only the
+ * blocks starting a few bytes before the instruction have to be checked.
+ */
+static void
+invalidate_blocks(struct machine_t* cpu, address addr)
+{
+    for (int back = 0; back < 2 * BLOCK_MAX; back++) {
+        cpu->block_len[(addr - back) & ADDRESS_MASK] = 0;
     }
+}
 
-    /* Execute the corresponding handler from the nibble table. */
-    nibbles[OPCODE_P(opcode)](cpu, opcode);
+void
+set_breakpoint(struct machine_t* cpu, address addr, int enabled)
+{
+    addr &= ADDRESS_MASK;
+    cpu->breakpoint[addr] = enabled != 0;
+    invalidate_blocks(cpu, addr);
+    jit_invalidate(cpu, addr);
+    native_invalidate(cpu, addr);
 }
 
 void
-update_time(struct machine_t* cpu, int delta)
+free_machine(struct machine_t* machine)
+{
+    jit_free(machine);
+    native_free(machine);
+}
+
+int
+load_rom(struct machine_t* cpu, const char* file)
 {
-    global_delta += delta;
-    while (global_delta > (1000 / 60)) {
-        global_delta -= (1000 / 60);
-        if (cpu->dt > 0) {
-            cpu->dt--;
+    FILE* fp = fopen(file, "rb");
+    if (fp == NULL)
+        return ROM_CANNOT_OPEN;
+
+    /* A byte more than fits is read to tell when the ROM is too large. */
+    byte program[MEMSIZ - 0x200 + 1];
+    size_t length = fread(program, 1, sizeof(program), fp);
+    int error = ferror(fp) ? ROM_CANNOT_READ : ROM_OK;
+    fclose(fp);
+    if (error == ROM_OK && length > MEMSIZ - 0x200)
+        error = ROM_TOO_LARGE;
+    if (error != ROM_OK)
+        return error;
+
+    memcpy(cpu->mem + 0x200, program, length);
+    invalidate_code(cpu, 0x200, length);
+    return ROM_OK;
+}
+
+const char*
+rom_error_message(int error)
+{
+    switch (error) {
+        case ROM_OK: return "ROM loaded";
+        case ROM_CANNOT_OPEN: return "Cannot open ROM file";
+        case ROM_CANNOT_READ: return "Cannot read ROM file";
+        case ROM_TOO_LARGE: return "ROM too large";
+        default: return "Cannot load ROM";
+    }
+}
+
+/**
+ * Adds bytes to a FNV-1a hash.
+ */
+static uint32_t
+hash_bytes(uint32_t hash, const void* data, size_t length)
+{
+    const byte* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t
+hash_state(const struct machine_t* cpu)
+{
+    uint32_t hash = 2166136261u;
+    hash = hash_bytes(hash, cpu->mem, sizeof(cpu->mem));
+    hash = hash_bytes(hash, &cpu->pc, sizeof(cpu->pc));
+    hash = hash_bytes(hash, cpu->stack, sizeof(cpu->stack));
+    hash = hash_bytes(hash, &cpu->sp, sizeof(cpu->sp));
+    hash = hash_bytes(hash, cpu->v, sizeof(cpu->v));
+    hash = hash_bytes(hash, &cpu->i, sizeof(cpu->i));
+    hash = hash_bytes(hash, &cpu->dt, sizeof(cpu->dt));
+    hash = hash_bytes(hash, &cpu->st, sizeof(cpu->st));
+    hash = hash_bytes(hash, cpu->screen, sizeof(cpu->screen));
+    hash = hash_bytes(hash, &cpu->esm, sizeof(cpu->esm));
+    hash = hash_bytes(hash, cpu->r, sizeof(cpu->r));
+    hash = hash_bytes(hash, cpu->random, sizeof(cpu->random));
+    return hash;
+}
+
+void
+invalidate_code(struct machine_t* cpu, address addr, int length)
+{
+    /*
+     * The instruction starting one byte before also covers addr, and the
+     * head of an idle loop depends on the five bytes that follow it.
+     */
+    for (int pos = -5; pos < length; pos++) {
+        address at = (addr + pos) & ADDRESS_MASK;
+        /* Programs translated ahead of time were never decoded here. */
+        native_invalidate(cpu, at);
+        /* Blocks are made of decoded instructions only. */
+        if (cpu->code[at].exec != NULL) {
+            cpu->code[at].exec = NULL;
+            invalidate_blocks(cpu, at);
+            jit_invalidate(cpu, at);
         }
-        if (cpu->st > 0) {
-            if (--cpu->st == 0 && cpu->speaker) {
-                /* Disable speaker buzz. */
-                cpu->speaker(0);
-            } else if (cpu->speaker) {
-                /* Enable speaker buzz. */
-                cpu->speaker(1);
-            }
+    }
+}
+
+/**
+ * Checks if the machine is still waiting for a key press. If any key is
+ * pressed while waiting, the key is stored in the register given to FX0A
+ * and the machine is restored so that it can fetch opcodes again.
+ *
+ * @return 0 if the machine can fetch opcodes, != 0 if it is still waiting.
+ */
+static int
+is_waiting_key(struct machine_t* cpu)
+{
+    if (cpu->wait_key == -1)
+        return 0;
+    for (int i = 0; i < 16; i++) {
+        int status = is_key_held(cpu, i);
+        if (status) {
+            /* Key was down. Restore system. */
+            cpu->v[(int) cpu->wait_key] = i;
+            cpu->wait_key = -1;
+            break;
         }
     }
+    return cpu->wait_key != -1;
 }
 
 void
-screen_fill_column(struct machine_t* cpu, int column)
+press_key(struct machine_t* cpu, int key)
 {
-    int rowsiz = cpu->esm ? 128 : 64;
-    int limit = cpu->esm ? 64 : 32;
-    for (int y = 0; y < limit; y++) {
-        cpu->screen[rowsiz * y + column] = 1;
+    if (cpu->wait_key != -1) {
+        cpu->v[(int) cpu->wait_key] = key & 0xF;
+        cpu->wait_key = -1;
     }
 }
 
-void
-screen_clear_column(struct machine_t* cpu, int column)
+/**
+ * Fetches the instruction pointed by the program counter and executes it.
+ * The instruction is decoded first if it is not in the cache yet.
+ * @return the cycles taken by the instruction.
+ */
+static int
+execute_instr(struct machine_t* cpu)
 {
-    int rowsiz = cpu->esm ? 128 : 64;
-    int limit = cpu->esm ? 64 : 32;
-    for (int y = 0; y < limit; y++) {
-        cpu->screen[rowsiz * y + column] = 0;
+    address pc = cpu->pc & ADDRESS_MASK;
+    struct instr_t* in = &cpu->code[pc];
+    if (in->exec == NULL) {
+        decode(cpu, pc, in);
     }
+    cpu->pc = (cpu->pc + 2) & 0xFFF;
+
+    if (cpu->debug) {
+        printf("Executing opcode 0x%x...\n", in->opcode);
+    }
+
+    /* Execute the handler that was chosen when decoding the opcode. */
+    in->exec(cpu, in);
+    return cpu->cost[pc];
 }
 
 void
-screen_fill_row(struct machine_t* cpu, int row)
+execute_at(struct machine_t* cpu, address pc)
 {
-    int limit = cpu->esm ? 128 : 64;
-    int rowsiz = limit;
-    for (int x = 0; x < limit; x++) {
-        cpu->screen[rowsiz * row + x] = 1;
+    struct instr_t* in = &cpu->code[pc & ADDRESS_MASK];
+    if (in->exec == NULL) {
+        decode(cpu, pc, in);
     }
+    in->exec(cpu, in);
+}
+
+/**
+ * Executes basic blocks starting at the program counter, building them
+ * first if required. Instructions in a block are executed one after the
+ * other without going back to the dispatch loop. Only the last
+ * instruction in a block can depend on the program counter, so it is
+ * moved past the block before running it; if the budget is spent before
+ * reaching it, the program counter is moved back to where the block was
+ * cut. Blocks are chained until the budget is spent or until must_stop
+ * says so.
+ *
+ * @param max_cycles maximum amount of cycles to run.
+ * @return the amount of cycles that have been run.
+ */
+static int
+execute_blocks(struct machine_t* cpu, int max_cycles)
+{
+    int retired = 0;
+    do {
+        address start = cpu->pc & ADDRESS_MASK;
+        int len = cpu->block_len[start];
+        if (len == 0) {
+            len = build_block(cpu, start);
+        }
+
+        const struct instr_t* in = &cpu->code[start];
+        const word* cost = &cpu->cost[start];
+        cpu->pc = (start + 2 * len) & 0xFFF;
+        int i = 0;
+        do {
+            in[2 * i].exec(cpu, &in[2 * i]);
+            retired += cost[2 * i];
+        } while (++i < len && retired < max_cycles);
+        if (i < len) {
+            cpu->pc = (start + 2 * i) & 0xFFF;
+        }
+    } while (retired < max_cycles && !must_stop(cpu));
+    return retired;
 }
 
 void
-screen_clear_row(struct machine_t* cpu, int row)
+step_machine(struct machine_t* cpu)
+{
+    if (cpu->exit)
+        return;
+
+    /* Are we waiting for a key press? If so, don't fetch. */
+    if (is_waiting_key(cpu))
+        return;
+
+    cpu->cycles += execute_instr(cpu);
+}
+
+int
+must_stop(const struct machine_t* cpu)
+{
+    return cpu->exit || cpu->wait_key != -1 || cpu->idle
+        || (cpu->stop_on_draw && cpu->drawn)
+        || cpu->breakpoint[cpu->pc & ADDRESS_MASK];
+}
+
+/**
+ * Checks whether run_machine has to return before executing the next
+ * instruction.
+ * @return the reason to stop, or STOP_NONE if the machine can go on.
+ */
+static int
+stop_reason(struct machine_t* cpu, int retired, int max_cycles)
+{
+    if (cpu->exit)
+        return STOP_EXIT;
+    if (is_waiting_key(cpu))
+        return STOP_WAIT_KEY;
+    if (cpu->stop_on_draw && cpu->drawn)
+        return STOP_DRAW;
+    /* Resuming from a breakpoint has to execute it. */
+    if (retired > 0 && cpu->breakpoint[cpu->pc & ADDRESS_MASK])
+        return STOP_BREAKPOINT;
+    if (retired >= max_cycles)
+        return cpu->idle ? STOP_IDLE : STOP_BUDGET;
+    return STOP_NONE;
+}
+
+/**
+ * Fast-forwards an idle loop whose head has just been executed. Until the
+ * next timer tick the loop would keep running the same three instructions,
+ * which don't change anything but the program counter, so the rest of the
+ * budget is spent at once and the program counter is moved to where those
+ * instructions would leave it.
+ *
+ * @param budget amount of cycles left in the budget.
+ * @return the amount of cycles that have been skipped.
+ */
+static int
+skip_idle_loop(struct machine_t* cpu, int budget)
 {
-    int limit = cpu->esm ? 128 : 64;
-    int rowsiz = limit;
-    for (int x = 0; x < limit; x++) {
-        cpu->screen[rowsiz * row + x] = 0;
+    address head = (cpu->pc - 2) & 0xFFF;
+    for (int pos = 0; pos < 6; pos += 2) {
+        if (cpu->breakpoint[(head + pos) & ADDRESS_MASK]) {
+            /* Run the loop, so that it stops at the breakpoint. */
+            cpu->idle = 0;
+            return 0;
+        }
+    }
+    /* Each loop starts at the skip, which is 2 bytes past the head. */
+    static const int offset[3] = { 2, 4, 0 };
+    int cost[3], loop = 0;
+    for (int i = 0; i < 3; i++) {
+        cost[i] = block_cost(cpu, head + offset[i], 1);
+        loop += cost[i];
     }
+
+    /* Skip whole loops, then run the last instructions one at a time. */
+    int skipped = (budget - 1) / loop * loop, next = 0;
+    while (skipped < budget) {
+        skipped += cost[next];
+        next = (next + 1) % 3;
+    }
+    cpu->pc = (head + offset[next]) & 0xFFF;
+    return skipped;
 }
 
 int
-screen_get_pixel(struct machine_t* cpu, int row, int column)
+run_machine(struct machine_t* cpu, int max_cycles)
 {
-    int rowsiz = cpu->esm ? 128 : 64;
-    return cpu->screen[rowsiz * row + column] != 0;
+    /* Pay back the cycles that the last call ran past its budget. */
+    int budget = max_cycles - cpu->overrun;
+    int retired = 0;
+    cpu->drawn = 0;
+    cpu->idle = 0;
+    while ((cpu->stop = stop_reason(cpu, retired, budget)) == STOP_NONE) {
+        if (cpu->idle && !cpu->debug) {
+            retired += skip_idle_loop(cpu, budget - retired);
+            continue;
+        }
+
+        /*
+         * Debug mode wants to log every opcode, let the interpreter run.
+         * So does a breakpoint being resumed, engines stop in front of it.
+         */
+        int single = cpu->debug || cpu->breakpoint[cpu->pc & ADDRESS_MASK];
+        if (cpu->engine == ENGINE_JIT && !single) {
+            /* Blocks that don't fit in the budget run in the threaded engine. */
+            int count = jit_execute(cpu, budget - retired);
+            if (count == 0) {
+                count = execute_blocks(cpu, budget - retired);
+            }
+            retired += count;
+        } else if (cpu->engine == ENGINE_NATIVE && !single) {
+            /* Code that was not translated runs in the interpreter. */
+            int count = native_execute(cpu, budget - retired);
+            if (count == 0) {
+                count = execute_instr(cpu);
+            }
+            retired += count;
+        } else if (cpu->engine == ENGINE_THREADED && !single) {
+            retired += execute_blocks(cpu, budget - retired);
+        } else {
+            retired += execute_instr(cpu);
+        }
+    }
+    cpu->overrun = retired > budget ? retired - budget : 0;
+    cpu->cycles += retired;
+    return retired;
 }
 
 void
-screen_set_pixel(struct machine_t* cpu, int row, int column)
+tick_timers(struct machine_t* cpu)
 {
-    int rowsiz = cpu->esm ? 128 : 64;
-    cpu->screen[rowsiz * row + column] = 1;
+    if (cpu->dt > 0) {
+        cpu->dt--;
+    }
+    if (cpu->st > 0) {
+        if (--cpu->st == 0 && cpu->speaker) {
+            /* Disable speaker buzz. */
+            cpu->speaker(0);
+        } else if (cpu->speaker) {
+            /* Enable speaker buzz. */
+            cpu->speaker(1);
+        }
+    }
 }
 
 void
-screen_clear_pixel(struct machine_t* cpu, int row, int column)
+update_time(struct machine_t* cpu, int delta)
 {
-    int rowsiz = cpu->esm ? 128 : 64;
-    cpu->screen[rowsiz * row + column] = 0;
+    /*
+     * A tick is 1000 / 60 ms, which is not a whole amount of milliseconds,
+     * so time is counted in sixtieths of a millisecond to avoid drifting.
+     */
+    cpu->timer_delta += delta * 60;
+    while (cpu->timer_delta >= 1000) {
+        cpu->timer_delta -= 1000;
+        tick_timers(cpu);
+    }
 }
@@ -57,6 +57,94 @@ typedef int (*keyboard_poller_t)(char);
 
 typedef void (*speaker_handler_t)(int);
 
+struct machine_t;
+struct instr_t;
+struct jit_t;
+struct native_t;
+
+/**
+ * Type definition for an opcode handler. Handlers receive the machine they
+ * operate on and the predecoded instruction they have to execute.
+ */
+typedef void (*instr_handler_t)(struct machine_t*, const struct instr_t*);
+
+/**
+ * A predecoded instruction. Fetching and decoding an opcode is done once and
+ * the result is kept here, so that the next time the instruction at the same
+ * address is executed the handler can be invoked straight away using the
+ * operands that were already extracted.
+ */
+struct instr_t
+{
+    instr_handler_t exec;       // Handler for this opcode, NULL if not decoded.
+    word opcode;                // Raw opcode as it was fetched from memory.
+    address nnn;                // NNN operand (12 least significant bits).
+    byte x, y;                  // X and Y register operands.
+    byte n, kk;                 // N nibble and KK byte operands.
+};
+
+/**
+ * Execution engines that can be used to run a machine. The interpreter
+ * fetches and executes opcodes one at a time. The threaded engine splits
+ * the program in basic blocks that end on jumps, calls and skips, and
+ * executes every instruction in a block in a row. The JIT engine
+ * translates those blocks to native code. It is only available on x86-64
+ * systems; on any other system it behaves as the threaded engine. The
+ * native engine runs the blocks of a program that was translated ahead
+ * of time, see load_native; anything else runs in the interpreter.
+ */
+enum engine_t
+{
+    ENGINE_INTERPRETER,         // One opcode at a time.
+    ENGINE_THREADED,            // One basic block at a time.
+    ENGINE_JIT,                 // Basic blocks translated to native code.
+    ENGINE_NATIVE               // Basic blocks translated ahead of time.
+};
+
+/**
+ * Timing profiles. The budget given to run_machine is counted in cycles,
+ * and the timing profile of the machine tells how many cycles each opcode
+ * takes. In the uniform profile every opcode takes one cycle, so the
+ * budget is an amount of opcodes. The VIP profile approximates the time
+ * taken by each opcode in the COSMAC VIP, so that opcodes that draw or
+ * copy many bytes take longer than arithmetic ones.
+ */
+enum timing_t
+{
+    TIMING_UNIFORM,             // Every opcode takes one cycle.
+    TIMING_VIP                  // Machine cycles taken in the COSMAC VIP.
+};
+
+/** Machine cycles run by the COSMAC VIP in a 60 Hz frame. */
+#define VIP_CYCLES_PER_FRAME 3668
+
+/**
+ * Reasons why run_machine returns. Running out of budget, exiting and
+ * waiting for a key always stop the machine. Running out of budget in a
+ * loop that waits for the delay timer is reported as STOP_IDLE, since
+ * nothing will happen until the timers are updated again. Drawing only stops it if
+ * stop_on_draw is set, and breakpoints are set using set_breakpoint.
+ */
+enum stop_t
+{
+    STOP_NONE,                  // Machine has not been run yet.
+    STOP_BUDGET,                // All the cycles were run.
+    STOP_WAIT_KEY,              // Waiting for a key press (FX0A).
+    STOP_EXIT,                  // Machine exited (00FD).
+    STOP_DRAW,                  // Screen was modified.
+    STOP_BREAKPOINT,            // About to execute a breakpoint.
+    STOP_IDLE                   // Budget spent polling the delay timer.
+};
+
+/** Reasons why load_rom fails. */
+enum rom_error_t
+{
+    ROM_OK,                     // ROM was loaded.
+    ROM_CANNOT_OPEN,            // File could not be opened.
+    ROM_CANNOT_READ,            // File could not be read to the end.
+    ROM_TOO_LARGE               // ROM doesn't fit from 0x200 on.
+};
+
 /**
  * Main data structure for holding information and state about processor.
  * Memory, stack, and register set is all defined here.
@@ -73,15 +161,38 @@ struct machine_t
     address i;                 // Special I register
     byte dt, st;             // Timers
 
-    char screen[8192];          // Screen bitmap
+    uint64_t screen[128];       // Screen bitmap, see screen_get_pixel.
+    uint64_t dirty;             // Rows changed since cleared, bit N is row N.
+    unsigned generation;        // Bumped every time the screen changes.
     char wait_key;              // Key the CHIP-8 is idle waiting for.
 
-    keyboard_poller_t keydown; // Keyboard poller
+    word keypad;                // Keys held down, bit N is key N.
+    keyboard_poller_t keydown; // Keyboard poller, overrides keypad if set.
     speaker_handler_t speaker; // Speaker handler
 
+    uint32_t random[4];         // State of the generator used by CXKK.
+    int timer_delta;            // Time not ticked yet by update_time.
+    int debug;                  // Log opcodes, see set_debug_mode.
+
     int exit;                   // Should close the game.
     int esm;                    // Is in Extended Screen Mode? 
     byte r[8];                  // R register set.
+
+    int engine;                 // Engine used by run_machine.
+    int timing;                 // Cost of the opcodes, see timing_t.
+    struct instr_t code[MEMSIZ]; // Predecoded instruction cache.
+    byte block_len[MEMSIZ];     // Length of basic blocks, 0 if not built.
+    word cost[MEMSIZ];          // Cycles taken by each decoded instruction.
+    struct jit_t* jit;          // JIT compiler state, NULL if not used.
+    struct native_t* native;    // Program loaded by load_native, or NULL.
+
+    int stop;                   // Why run_machine returned, see stop_t.
+    int stop_on_draw;           // Should run_machine return after drawing.
+    int drawn;                  // Screen was modified by the last run.
+    int idle;                   // Machine is polling the delay timer.
+    int overrun;                // Cycles run past the last budget.
+    uint64_t cycles;            // Cycles run since the machine was initialized.
+    byte breakpoint[MEMSIZ];    // Addresses where run_machine stops.
 };
 
 /**
@@ -94,6 +205,40 @@ struct machine_t
  */
 void init_machine(struct machine_t* cpu);
 
+/**
+ * Releases any resource allocated by a machine while it was running, such
+ * as the native code translated by the JIT engine. This function must be
+ * called before the machine is disposed or initialized again.
+ *
+ * @param cpu machine data structure that wants to be released.
+ */
+void free_machine(struct machine_t* cpu);
+
+/**
+ * Loads a ROM file into the memory of a machine. In compliance with the
+ * specification, ROM data starts at 0x200, so ROMs can be at most 3584
+ * bytes long. Memory is left as it was unless the whole file was read.
+ * @param cpu reference pointer to the machine.
+ * @param file path of the ROM.
+ * @return ROM_OK if the ROM was loaded, otherwise why not, see rom_error_t.
+ */
+int load_rom(struct machine_t* cpu, const char* file);
+
+/**
+ * Describes an error returned by load_rom.
+ * @return a sentence without a final period, such as "ROM too large".
+ */
+const char* rom_error_message(int error);
+
+/**
+ * Hashes the state of a machine that programs can observe: memory,
+ * registers, stack, timers, screen and random generator. Two runs of a
+ * program that end with the same hash ended in the same state.
+ * @param cpu reference pointer to the machine.
+ * @return hash of the state.
+ */
+uint32_t hash_state(const struct machine_t* cpu);
+
 /**
  * Step the machine. This method will fetch an instruction from memory
  * and execute it. After invoking this method, the state of the provided
@@ -102,15 +247,120 @@ void init_machine(struct machine_t* cpu);
  */
 void step_machine(struct machine_t* cpu);
 
+/**
+ * Run the machine. This method will execute instructions using the engine
+ * set in the machine until the given amount of cycles have been run, or
+ * until the machine exits, has to wait for a key press, draws on the
+ * screen while stop_on_draw is set, or reaches a breakpoint. The reason is
+ * stored in the stop field of the machine. The instruction at the program
+ * counter is always executed, even if it has a breakpoint, so that the
+ * machine can be resumed after stopping on it.
+ *
+ * Cycles are counted using the timing profile of the machine, which must
+ * be set before the program is run or translated. An instruction is
+ * started as long as the budget is not spent, so the last one may run past
+ * the budget; those cycles are taken from the budget of the next call, so
+ * that over many calls the machine runs exactly the cycles it was given.
+ *
+ * @param cpu reference pointer to the machine to run.
+ * @param max_cycles maximum amount of cycles to run.
+ * @return the amount of cycles that have been run, which are also added
+ *         to the cycles field of the machine.
+ */
+int run_machine(struct machine_t* cpu, int max_cycles);
+
+/**
+ * Sets or clears a breakpoint. run_machine stops before executing the
+ * instruction at an address that has a breakpoint.
+ * @param cpu reference pointer to the machine.
+ * @param addr address of the instruction.
+ * @param enabled != 0 to set the breakpoint, 0 to clear it.
+ */
+void set_breakpoint(struct machine_t* cpu, address addr, int enabled);
+
+/**
+ * Reports a key press to the machine. If the machine is parked waiting for
+ * a key (run_machine returned STOP_WAIT_KEY), the key is stored in the
+ * register given to FX0A and the machine can run again. Otherwise, the key
+ * press is ignored. While parked, the keyboard poller or the keypad is
+ * only checked once per call to run_machine, so hosts can block on their
+ * own event queue and resolve the wait using this function.
+ * @param cpu reference pointer to the machine.
+ * @param key CHIP-8 key that was pressed, in range 0-F.
+ */
+void press_key(struct machine_t* cpu, int key);
+
+/**
+ * Ticks the timers once, as it happens 60 times per second. DT and ST are
+ * decremented if they are not 0, and the speaker is updated.
+ * @param cpu reference pointer to the machine.
+ */
+void tick_timers(struct machine_t* cpu);
+
 /**
  * Updates subsystems that depend on time. Several parts of the CHIP-8
  * depend on a timer. Examples are the DT and ST countdown registers, whose
  * values must countdown at a rate of 60 times per second. This function
- * should be called regularly so that the systems are updated.
+ * should be called regularly so that the systems are updated. Frontends
+ * that keep their own 60 Hz clock may call tick_timers instead.
  * @param delta amount of milliseconds since last call to function.
  */
 void update_time(struct machine_t* cpu, int delta);
 
+/**
+ * Invalidates the predecoded instructions that cover a range of memory.
+ * Opcodes that write to memory already do this by themselves, but any
+ * host that modifies the memory of a machine that has already been
+ * stepped must call this function, otherwise stale opcodes could run.
+ * @param cpu reference pointer to the machine.
+ * @param addr first memory address that has been modified.
+ * @param length amount of bytes that have been modified.
+ */
+void invalidate_code(struct machine_t* cpu, address addr, int length);
+
+/**
+ * Hashes the program in the memory of a machine. Programs translated ahead
+ * of time can only be loaded into machines whose program has the same hash.
+ * @param cpu reference pointer to the machine.
+ * @return hash of the memory from address 0x200.
+ */
+uint32_t hash_program(const struct machine_t* cpu);
+
+/**
+ * Translates the program in the memory of a machine to C source code. The
+ * program is walked from 0x200 and every block that can be reached by
+ * jumps, calls and skips is written as a function. The source has to be
+ * compiled as a shared object before it is given to load_native. The
+ * machine is only used to decode the program.
+ * @param cpu reference pointer to the machine.
+ * @param path path of the C file to write.
+ * @return 0 if the source was written, != 0 otherwise.
+ */
+int translate_program(struct machine_t* cpu, const char* path);
+
+/**
+ * Loads a program translated by translate_program and compiled as a shared
+ * object, so that it is used by the native engine. Must be called after
+ * loading the program into the memory of the machine, since the shared
+ * object is rejected if the program is not the same.
+ * @param cpu reference pointer to the machine.
+ * @param path path of the shared object.
+ * @return 0 if the shared object was loaded, != 0 otherwise.
+ */
+int load_native(struct machine_t* cpu, const char* path);
+
+/*
+ * Screen accessors. The screen is stored one bit per pixel. In low
+ * resolution mode row Y is the word screen[Y]; in extended screen mode it
+ * takes the words screen[2 * Y] and screen[2 * Y + 1]. The leftmost pixel
+ * of a word is its most significant bit.
+ *
+ * Every opcode and accessor that changes the screen sets the bits of the
+ * changed rows in dirty and bumps generation. Frontends can skip a frame
+ * if generation didn't change, and upload only the dirty rows otherwise,
+ * clearing dirty afterwards.
+ */
+
 void screen_fill_column(struct machine_t* cpu, int column);
 
 void screen_clear_column(struct machine_t* cpu, int column);
@@ -125,6 +375,18 @@ void screen_set_pixel(struct machine_t* cpu, int row, int column);
 
 void screen_clear_pixel(struct machine_t* cpu, int row, int column);
 
-void set_debug_mode(int mode);
+/**
+ * Seeds the random generator used by CXKK. Machines seeded with the same
+ * value get the same random numbers, so runs can be reproduced; a machine
+ * that is initialized is seeded with 0.
+ */
+void seed_random(struct machine_t* cpu, uint64_t seed);
+
+/**
+ * Sets whether a machine logs the opcodes it runs. While logging, opcodes
+ * are run one at a time by the interpreter. Every machine has its own
+ * state, so machines can be run on different threads.
+ */
+void set_debug_mode(struct machine_t* cpu, int mode);
 
 #endif // CPU_H_
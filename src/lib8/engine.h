@@ -0,0 +1,140 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Internal interface shared by the execution engines of lib8. This header
+ * is not part of the public API and should only be included by lib8.
+ */
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include "cpu.h"
+
+#define BLOCK_MAX 64 // Max amount of instructions in a basic block.
+
+/** Mask with every row of the screen, whatever the screen mode is. */
+#define ALL_ROWS (~0ull)
+
+/**
+ * Marks rows of the screen as changed, bit N of the mask being row N, so
+ * that frontends only have to upload the rows that changed.
+ */
+#define MARK_DIRTY(cpu, rows) ((cpu)->dirty |= (rows), (cpu)->generation++)
+
+/** Screen routines for the screen mode a machine is in. */
+#define SCREEN_MODE(cpu) (&screen_modes[(cpu)->esm != 0])
+
+/**
+ * Set of screen routines specialised for a screen mode. The routines
+ * that run opcodes take the same arguments as an instruction handler.
+ */
+struct screen_mode_t
+{
+    int width, height;              // Size of the screen in this mode.
+    instr_handler_t scroll_down;    // 00CN
+    instr_handler_t scroll_right;   // 00FB
+    instr_handler_t scroll_left;    // 00FC
+    instr_handler_t draw;           // DXYN
+};
+
+/** Routines for the low resolution mode and the extended screen mode. */
+extern const struct screen_mode_t screen_modes[2];
+
+/**
+ * Builds the basic block starting at the given address, decoding every
+ * instruction that belongs to the block.
+ * @return the amount of instructions in the block.
+ */
+int build_block(struct machine_t* cpu, address start);
+
+/**
+ * Gets the cycles taken by the instructions starting at the given address,
+ * as counted by the timing profile of the machine, decoding them first if
+ * they are not in the cache yet.
+ * @param len amount of instructions.
+ */
+int block_cost(struct machine_t* cpu, address start, int len);
+
+/**
+ * Tells whether an instruction modifies the screen. These instructions
+ * end a basic block, so that engines can stop after drawing.
+ */
+int is_drawing(const struct instr_t* in);
+
+/**
+ * Tells whether an instruction is the FX07 at the head of a loop that
+ * polls the delay timer. When run, it sets the idle flag if the machine
+ * is going to spin in the loop until the next timer tick. These
+ * instructions end a basic block, so that the loop can be fast-forwarded.
+ */
+int is_idle_loop(const struct instr_t* in);
+
+/**
+ * Tells whether an engine has to go back to run_machine before running
+ * the next block, because the machine exited, is waiting for a key, is
+ * idle, has drawn while stop_on_draw is set or is at a breakpoint.
+ */
+int must_stop(const struct machine_t* cpu);
+
+/**
+ * Runs the instruction at the given address using its handler, decoding
+ * it first if it is not in the cache. The program counter must already
+ * point past the instruction.
+ */
+void execute_at(struct machine_t* cpu, address pc);
+
+/**
+ * Runs the machine using the JIT compiler. Execution stops when the next
+ * block doesn't fit in the budget, or when must_stop says so.
+ * @return the amount of cycles that have been run, 0 if the JIT is not
+ *         available.
+ */
+int jit_execute(struct machine_t* cpu, int max_cycles);
+
+/**
+ * Tells the JIT that a decoded instruction is being overwritten, so that
+ * the code translated from it is not executed anymore.
+ */
+void jit_invalidate(struct machine_t* cpu, address addr);
+
+/**
+ * Releases the memory used by the JIT compiler of a machine.
+ */
+void jit_free(struct machine_t* cpu);
+
+/**
+ * Runs the machine using the blocks loaded by load_native. Execution stops
+ * when the next block was not translated or doesn't fit in the budget, or
+ * when must_stop says so.
+ * @return the amount of cycles that have been run.
+ */
+int native_execute(struct machine_t* cpu, int max_cycles);
+
+/**
+ * Stops using the translated blocks that contain the given address, since
+ * the instruction there is being overwritten or has a breakpoint.
+ */
+void native_invalidate(struct machine_t* cpu, address addr);
+
+/**
+ * Unloads the program loaded by load_native, if any.
+ */
+void native_free(struct machine_t* cpu);
+
+#endif // ENGINE_H_
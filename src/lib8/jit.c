@@ -0,0 +1,1627 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * JIT compiler. Basic blocks are translated to x86-64 code. While a block
+ * runs, the V registers and the I register are kept in host registers and
+ * they are only written back to the machine when the block is left or when
+ * an opcode that is not translated has to be run by its handler.
+ *
+ * The translator also tracks the guest registers whose value is known at
+ * translation time, so that instructions working on constants are folded
+ * and only the final values are written back, and it skips computing VF
+ * when a flag is overwritten before anything could read it.
+ *
+ * Translated blocks jump straight into the next block when it is known at
+ * translation time, and look the next block up in the entry table for
+ * returns and computed jumps. Every block takes its cost in cycles from
+ * the budget on entry, and it goes back to the caller if the budget is
+ * not enough to run it completely.
+ *
+ * Register usage in translated code:
+ *   rbx           pointer to the machine.
+ *   r13d          cycles left in the budget.
+ *   rax, rcx, rdx scratch registers.
+ *   r8-r12, r14,
+ *   r15, rbp      V0-VF and I, allocated per block as they are needed.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "cpu.h"
+#include "engine.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define JIT_CODE_SIZE (1 << 20) // Size of the buffer for translated code.
+#define JIT_MAX_LINKS 4096 // Max amount of jumps between blocks.
+#define JIT_MAX_DEAD 64 // Max blocks invalidated between two entries.
+
+/*
+ * Worst case size of the code of an instruction. The largest is FX65 when
+ * I is not known, which takes up to 29 bytes per register, plus the code
+ * that gets I into a host register; everything else takes less than 300,
+ * FX65 with I known included.
+ */
+#define JIT_INSTR_SIZE 512
+
+/*
+ * Worst case size of a block. The budget check, the exits of the block and
+ * the registers written back before them take less than an instruction.
+ */
+#define JIT_BLOCK_SIZE ((BLOCK_MAX + 1) * JIT_INSTR_SIZE)
+
+/* Host registers. */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/* Condition codes for Jcc and SETcc. */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_GE 0xD
+#define CC_LE 0xE
+
+/* ALU operations, as encoded in their opcode and ModRM reg field. */
+#define ALU_ADD 0
+#define ALU_OR 1
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_XOR 6
+#define ALU_CMP 7
+
+/* Offsets of the machine fields used by translated code. */
+#define OFF_MEM offsetof(struct machine_t, mem)
+#define OFF_PC offsetof(struct machine_t, pc)
+#define OFF_STACK offsetof(struct machine_t, stack)
+#define OFF_SP offsetof(struct machine_t, sp)
+#define OFF_V offsetof(struct machine_t, v)
+#define OFF_I offsetof(struct machine_t, i)
+#define OFF_DT offsetof(struct machine_t, dt)
+#define OFF_ST offsetof(struct machine_t, st)
+#define OFF_CODE offsetof(struct machine_t, code)
+#define OFF_STOP_ON_DRAW offsetof(struct machine_t, stop_on_draw)
+#define OFF_KEYPAD offsetof(struct machine_t, keypad)
+#define OFF_KEYDOWN offsetof(struct machine_t, keydown)
+
+#define GUEST_I 16 // Guest register index used for the I register.
+#define GUEST_REGS 17 // V0-VF and I.
+#define POOL_SIZE 8
+
+/* Host registers that can hold guest registers. */
+static const int pool[POOL_SIZE] = {
+    8, 9, 10, 11, R12, R14, R15, RBP
+};
+
+/**
+ * A jump to a block. While the target is translated the jump goes
+ * straight into it; otherwise it goes to code that goes back to the
+ * caller, and it is patched once the target is translated.
+ */
+struct link_t
+{
+    int site;                   // Offset of the rel32 to patch.
+    int next;                   // Next link to the same target, or -1.
+};
+
+struct jit_t
+{
+    byte* code;                 // Buffer, either writable or executable.
+    int writable;               // Buffer is mapped for writing right now.
+    int used;                   // Bytes of the buffer in use.
+    int base;                   // Bytes used by the entry and exit code.
+    int epilogue;               // Offset of the exit code.
+    int flush;                  // Translated code has to be discarded.
+
+    void* entry[MEMSIZ];        // Translated blocks, NULL if not translated.
+    byte len[MEMSIZ];           // Instructions in each translated block.
+    int links_head[MEMSIZ];     // First link to each target, or -1.
+    struct link_t links[JIT_MAX_LINKS];
+    int links_used;
+    address dead[JIT_MAX_DEAD]; // Blocks whose links have to be undone.
+    int dead_count;
+};
+
+/** Signature of the entry code, that jumps into a translated block. */
+typedef int (*jit_enter_t)(struct machine_t* cpu, int budget, void* block);
+
+/**
+ * State of the translator while a block is being translated. Tracks which
+ * guest register is kept in which host register.
+ */
+struct trans_t
+{
+    struct jit_t* jit;
+    struct machine_t* cpu;
+    int host[GUEST_REGS];       // Host register for each guest, or -1.
+    int dirty[GUEST_REGS];      // Host register differs from the machine.
+    int owner[POOL_SIZE];       // Guest in each pool slot, or -1.
+    int pinned;                 // Guests that cannot be evicted now.
+    int victim;                 // Next pool slot to evict.
+    int known;                  // Guests holding a constant, one bit each.
+    int value[GUEST_REGS];      // Value of the guests holding a constant.
+    int flags_live;             // VF is read after the current instruction.
+    byte vf_live[BLOCK_MAX];    // VF is read after each instruction.
+};
+
+/** Tells whether a guest register holds a constant. */
+#define KNOWN(t, guest) (((t)->known >> (guest)) & 1)
+
+/*
+ * Code emitter. These functions append x86-64 instructions to the buffer.
+ */
+
+static void
+emit8(struct jit_t* jit, int value)
+{
+    jit->code[jit->used++] = value;
+}
+
+static void
+emit16(struct jit_t* jit, int value)
+{
+    emit8(jit, value & 0xFF);
+    emit8(jit, (value >> 8) & 0xFF);
+}
+
+static void
+emit32(struct jit_t* jit, int32_t value)
+{
+    memcpy(jit->code + jit->used, &value, 4);
+    jit->used += 4;
+}
+
+static void
+emit64(struct jit_t* jit, uint64_t value)
+{
+    memcpy(jit->code + jit->used, &value, 8);
+    jit->used += 8;
+}
+
+/**
+ * Emit a REX prefix if required. 8-bit operations always require it,
+ * otherwise SPL, BPL, SIL and DIL would be taken as AH, CH, DH and BH.
+ */
+static void
+emit_rex(struct jit_t* jit, int w, int r, int x, int b, int byte_op)
+{
+    int rex = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+    if (rex != 0x40 || byte_op) {
+        emit8(jit, rex);
+    }
+}
+
+/** ModRM for a register to register operation. */
+static void
+emit_modrm_reg(struct jit_t* jit, int reg, int rm)
+{
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/** ModRM for a memory operand in the machine, [rbx + disp32]. */
+static void
+emit_modrm_cpu(struct jit_t* jit, int reg, int disp)
+{
+    emit8(jit, 0x80 | ((reg & 7) << 3) | RBX);
+    emit32(jit, disp);
+}
+
+/** ModRM for an indexed memory operand, [rbx + index * scale + disp32]. */
+static void
+emit_modrm_index(struct jit_t* jit, int reg, int index, int scale, int disp)
+{
+    emit8(jit, 0x84 | ((reg & 7) << 3));
+    emit8(jit, (scale << 6) | ((index & 7) << 3) | RBX);
+    emit32(jit, disp);
+}
+
+/* mov r32, imm32 */
+static void
+x_mov_imm(struct jit_t* jit, int reg, int32_t imm)
+{
+    emit_rex(jit, 0, 0, 0, reg, 0);
+    emit8(jit, 0xB8 + (reg & 7));
+    emit32(jit, imm);
+}
+
+/* mov r64, imm64 */
+static void
+x_mov_imm64(struct jit_t* jit, int reg, uint64_t imm)
+{
+    emit_rex(jit, 1, 0, 0, reg, 0);
+    emit8(jit, 0xB8 + (reg & 7));
+    emit64(jit, imm);
+}
+
+/* mov r32, r32 */
+static void
+x_mov(struct jit_t* jit, int dst, int src)
+{
+    emit_rex(jit, 0, src, 0, dst, 0);
+    emit8(jit, 0x89);
+    emit_modrm_reg(jit, src, dst);
+}
+
+/* mov r64, r64 */
+static void
+x_mov64(struct jit_t* jit, int dst, int src)
+{
+    emit_rex(jit, 1, src, 0, dst, 0);
+    emit8(jit, 0x89);
+    emit_modrm_reg(jit, src, dst);
+}
+
+/* op r32, r32 */
+static void
+x_alu(struct jit_t* jit, int op, int dst, int src)
+{
+    emit_rex(jit, 0, src, 0, dst, 0);
+    emit8(jit, (op << 3) | 0x01);
+    emit_modrm_reg(jit, src, dst);
+}
+
+/* op r8, r8 */
+static void
+x_alu8(struct jit_t* jit, int op, int dst, int src)
+{
+    emit_rex(jit, 0, src, 0, dst, 1);
+    emit8(jit, op << 3);
+    emit_modrm_reg(jit, src, dst);
+}
+
+/* test r32, r32 */
+static void
+x_test(struct jit_t* jit, int reg)
+{
+    emit_rex(jit, 0, reg, 0, reg, 0);
+    emit8(jit, 0x85);
+    emit_modrm_reg(jit, reg, reg);
+}
+
+/* test r64, r64 */
+static void
+x_test64(struct jit_t* jit, int reg)
+{
+    emit_rex(jit, 1, reg, 0, reg, 0);
+    emit8(jit, 0x85);
+    emit_modrm_reg(jit, reg, reg);
+}
+
+/* bt r32, r32 */
+static void
+x_bt(struct jit_t* jit, int reg, int bit)
+{
+    emit_rex(jit, 0, bit, 0, reg, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xA3);
+    emit_modrm_reg(jit, bit, reg);
+}
+
+/* op r32, imm32 */
+static void
+x_alu_imm(struct jit_t* jit, int op, int reg, int32_t imm)
+{
+    emit_rex(jit, 0, 0, 0, reg, 0);
+    emit8(jit, 0x81);
+    emit_modrm_reg(jit, op, reg);
+    emit32(jit, imm);
+}
+
+/* op r8, imm8 */
+static void
+x_alu8_imm(struct jit_t* jit, int op, int reg, int imm)
+{
+    emit_rex(jit, 0, 0, 0, reg, 1);
+    emit8(jit, 0x80);
+    emit_modrm_reg(jit, op, reg);
+    emit8(jit, imm);
+}
+
+/* shl r8, 1 (ext = 4) or shr r8, 1 (ext = 5) */
+static void
+x_shift8(struct jit_t* jit, int ext, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg, 1);
+    emit8(jit, 0xD0);
+    emit_modrm_reg(jit, ext, reg);
+}
+
+/* shr r32, imm8 */
+static void
+x_shr_imm(struct jit_t* jit, int reg, int imm)
+{
+    emit_rex(jit, 0, 0, 0, reg, 0);
+    emit8(jit, 0xC1);
+    emit_modrm_reg(jit, 5, reg);
+    emit8(jit, imm);
+}
+
+/* neg r8 */
+static void
+x_neg8(struct jit_t* jit, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg, 1);
+    emit8(jit, 0xF6);
+    emit_modrm_reg(jit, 3, reg);
+}
+
+/* setcc r8 */
+static void
+x_setcc(struct jit_t* jit, int cc, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg, 1);
+    emit8(jit, 0x0F);
+    emit8(jit, 0x90 + cc);
+    emit_modrm_reg(jit, 0, reg);
+}
+
+/* movzx r32, r16 */
+static void
+x_movzx16(struct jit_t* jit, int dst, int src)
+{
+    emit_rex(jit, 0, dst, 0, src, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit_modrm_reg(jit, dst, src);
+}
+
+/* lea r32, [src + disp32] */
+static void
+x_lea_disp(struct jit_t* jit, int dst, int src, int32_t disp)
+{
+    emit_rex(jit, 0, dst, 0, src, 0);
+    emit8(jit, 0x8D);
+    emit8(jit, 0x84 | ((dst & 7) << 3));
+    emit8(jit, 0x20 | (src & 7));
+    emit32(jit, disp);
+}
+
+/* lea r32, [src + src * 4 + disp8] */
+static void
+x_lea_x5(struct jit_t* jit, int dst, int src, int disp)
+{
+    emit_rex(jit, 0, dst, src, src, 0);
+    emit8(jit, 0x8D);
+    emit8(jit, 0x44 | ((dst & 7) << 3));
+    emit8(jit, (2 << 6) | ((src & 7) << 3) | (src & 7));
+    emit8(jit, disp);
+}
+
+/* movzx r32, byte [rbx + disp] */
+static void
+x_load8(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB6);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* movsx r32, byte [rbx + disp] */
+static void
+x_load8s(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xBE);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* movzx r32, word [rbx + disp] */
+static void
+x_load16(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov r64, qword [rbx + disp] */
+static void
+x_load64(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 1, reg, 0, RBX, 0);
+    emit8(jit, 0x8B);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov r32, dword [rbx + disp] */
+static void
+x_load32(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x8B);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* movzx r32, byte [rbx + index + disp] */
+static void
+x_load8_index(struct jit_t* jit, int reg, int index, int disp)
+{
+    emit_rex(jit, 0, reg, index, RBX, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB6);
+    emit_modrm_index(jit, reg, index, 0, disp);
+}
+
+/* movzx r32, word [rbx + index * 2 + disp] */
+static void
+x_load16_index(struct jit_t* jit, int reg, int index, int disp)
+{
+    emit_rex(jit, 0, reg, index, RBX, 0);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit_modrm_index(jit, reg, index, 1, disp);
+}
+
+/* mov byte [rbx + disp], r8 */
+static void
+x_store8(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 1);
+    emit8(jit, 0x88);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov word [rbx + disp], r16 */
+static void
+x_store16(struct jit_t* jit, int reg, int disp)
+{
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x89);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov dword [rbx + disp], r32 */
+static void
+x_store32(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 0, reg, 0, RBX, 0);
+    emit8(jit, 0x89);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov qword [rbx + disp], r64 */
+static void
+x_store64(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 1, reg, 0, RBX, 0);
+    emit8(jit, 0x89);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* mov word [rbx + disp], imm16 */
+static void
+x_store16_imm(struct jit_t* jit, int disp, int imm)
+{
+    emit8(jit, 0x66);
+    emit8(jit, 0xC7);
+    emit_modrm_cpu(jit, 0, disp);
+    emit16(jit, imm);
+}
+
+/* mov byte [rbx + disp], imm8 */
+static void
+x_store8_imm(struct jit_t* jit, int disp, int imm)
+{
+    emit8(jit, 0xC6);
+    emit_modrm_cpu(jit, 0, disp);
+    emit8(jit, imm);
+}
+
+/* mov word [rbx + index * 2 + disp], imm16 */
+static void
+x_store16_index_imm(struct jit_t* jit, int index, int disp, int imm)
+{
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, 0, index, RBX, 0);
+    emit8(jit, 0xC7);
+    emit_modrm_index(jit, 0, index, 1, disp);
+    emit16(jit, imm);
+}
+
+/* lea r64, [rbx + disp] */
+static void
+x_lea_cpu(struct jit_t* jit, int reg, int disp)
+{
+    emit_rex(jit, 1, reg, 0, RBX, 0);
+    emit8(jit, 0x8D);
+    emit_modrm_cpu(jit, reg, disp);
+}
+
+/* push r64 */
+static void
+x_push(struct jit_t* jit, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg, 0);
+    emit8(jit, 0x50 + (reg & 7));
+}
+
+/* pop r64 */
+static void
+x_pop(struct jit_t* jit, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg, 0);
+    emit8(jit, 0x58 + (reg & 7));
+}
+
+/**
+ * jmp rel32. The target of the jump is not emitted yet.
+ * @return offset of the rel32 that has to be patched.
+ */
+static int
+x_jmp(struct jit_t* jit)
+{
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    return jit->used - 4;
+}
+
+/**
+ * jcc rel32. The target of the jump is not emitted yet.
+ * @return offset of the rel32 that has to be patched.
+ */
+static int
+x_jcc(struct jit_t* jit, int cc)
+{
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 + cc);
+    emit32(jit, 0);
+    return jit->used - 4;
+}
+
+/** Makes the rel32 at the given offset point to the target offset. */
+static void
+patch(struct jit_t* jit, int site, int target)
+{
+    int32_t rel = target - (site + 4);
+    memcpy(jit->code + site, &rel, 4);
+}
+
+/*
+ * Register cache. Guest registers are loaded into host registers the first
+ * time they are used in a block, and they are written back only if they
+ * were modified. Guests holding a constant don't use a host register until
+ * an instruction that is not folded needs them.
+ */
+
+static void
+reg_store(struct trans_t* t, int guest)
+{
+    if (KNOWN(t, guest)) {
+        if (guest == GUEST_I)
+            x_store16_imm(t->jit, OFF_I, t->value[guest]);
+        else
+            x_store8_imm(t->jit, OFF_V + guest, t->value[guest]);
+    } else if (guest == GUEST_I) {
+        x_store16(t->jit, t->host[guest], OFF_I);
+    } else {
+        x_store8(t->jit, t->host[guest], OFF_V + guest);
+    }
+    t->dirty[guest] = 0;
+}
+
+/** Writes back every modified guest register to the machine. */
+static void
+reg_flush(struct trans_t* t)
+{
+    for (int guest = 0; guest < GUEST_REGS; guest++) {
+        if (t->dirty[guest]) {
+            reg_store(t, guest);
+        }
+    }
+}
+
+/** Forgets a guest register without writing it back. */
+static void
+reg_forget(struct trans_t* t, int guest)
+{
+    t->known &= ~(1 << guest);
+    t->dirty[guest] = 0;
+    if (t->host[guest] != -1) {
+        for (int slot = 0; slot < POOL_SIZE; slot++) {
+            if (t->owner[slot] == guest)
+                t->owner[slot] = -1;
+        }
+        t->host[guest] = -1;
+        t->dirty[guest] = 0;
+    }
+}
+
+/** Forgets every guest register. Must be flushed before. */
+static void
+reg_forget_all(struct trans_t* t)
+{
+    t->known = 0;
+    for (int guest = 0; guest < GUEST_REGS; guest++) {
+        t->host[guest] = -1;
+        t->dirty[guest] = 0;
+    }
+    for (int slot = 0; slot < POOL_SIZE; slot++) {
+        t->owner[slot] = -1;
+    }
+}
+
+/**
+ * Get the host register that holds a guest register, allocating one if
+ * the guest is not in a host register yet. The guest register is pinned
+ * until the next instruction is translated so that it is not evicted.
+ *
+ * @param guest guest register, 0-15 for V0-VF or GUEST_I.
+ * @param load whether the current value has to be loaded. If the guest
+ *             is going to be overwritten there is no need to load it.
+ */
+static int
+reg_get(struct trans_t* t, int guest, int load)
+{
+    t->pinned |= 1 << guest;
+    if (t->host[guest] != -1)
+        return t->host[guest];
+
+    int slot = -1;
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (t->owner[i] == -1) {
+            slot = i;
+            break;
+        }
+    }
+    while (slot == -1) {
+        int candidate = t->victim;
+        t->victim = (t->victim + 1) % POOL_SIZE;
+        if (!(t->pinned & (1 << t->owner[candidate]))) {
+            int old = t->owner[candidate];
+            if (t->dirty[old])
+                reg_store(t, old);
+            t->host[old] = -1;
+            slot = candidate;
+        }
+    }
+
+    int reg = pool[slot];
+    t->owner[slot] = guest;
+    t->host[guest] = reg;
+    if (KNOWN(t, guest)) {
+        /* The machine is still out of date if the guest is dirty. */
+        t->known &= ~(1 << guest);
+        if (load)
+            x_mov_imm(t->jit, reg, t->value[guest]);
+        return reg;
+    }
+    t->dirty[guest] = 0;
+    if (load) {
+        if (guest == GUEST_I)
+            x_load16(t->jit, reg, OFF_I);
+        else
+            x_load8(t->jit, reg, OFF_V + guest);
+    }
+    return reg;
+}
+
+/**
+ * Records that a guest register holds a constant. No code is emitted, the
+ * value is written back to the machine when registers are flushed.
+ */
+static void
+const_set(struct trans_t* t, int guest, int value)
+{
+    reg_forget(t, guest);
+    t->known |= 1 << guest;
+    t->value[guest] = value;
+    t->dirty[guest] = 1;
+}
+
+/**
+ * Emits an 8-bit ALU operation between a host register and a guest
+ * register, using an immediate if the guest holds a constant.
+ */
+static void
+alu8_guest(struct trans_t* t, int op, int reg, int guest)
+{
+    if (KNOWN(t, guest))
+        x_alu8_imm(t->jit, op, reg, t->value[guest]);
+    else
+        x_alu8(t->jit, op, reg, reg_get(t, guest, 1));
+}
+
+/*
+ * Block exits.
+ */
+
+/** Leave translated code and go back to the caller. */
+static void
+exit_to_caller(struct trans_t* t)
+{
+    patch(t->jit, x_jmp(t->jit), t->jit->epilogue);
+}
+
+/**
+ * Continue at a block known at translation time. If the block is not
+ * translated yet, the jump goes back to the caller for now and it will be
+ * linked to the block once it is translated.
+ */
+static void
+exit_static(struct trans_t* t, address target)
+{
+    struct jit_t* jit = t->jit;
+    target &= ADDRESS_MASK;
+    int site = x_jmp(jit);
+
+    /* Jumps that couldn't be undone if the target were invalidated exit. */
+    if (jit->links_used < JIT_MAX_LINKS) {
+        struct link_t* link = &jit->links[jit->links_used];
+        link->site = site;
+        link->next = jit->links_head[target];
+        jit->links_head[target] = jit->links_used++;
+        if (jit->entry[target] != NULL) {
+            patch(jit, site, (byte*) jit->entry[target] - jit->code);
+            return;
+        }
+    }
+    x_store16_imm(jit, OFF_PC, target);
+    exit_to_caller(t);
+}
+
+/**
+ * Continue at the block whose address is in ECX. The block is looked up
+ * in the entry table when the exit is run.
+ */
+static void
+exit_dynamic(struct trans_t* t)
+{
+    struct jit_t* jit = t->jit;
+    x_store16(jit, RCX, OFF_PC);
+    x_mov_imm64(jit, RAX, (uint64_t) (uintptr_t) jit->entry);
+    /* mov rax, [rax + rcx * 8] */
+    emit8(jit, 0x48);
+    emit8(jit, 0x8B);
+    emit8(jit, 0x04);
+    emit8(jit, 0xC8);
+    /* test rax, rax */
+    emit8(jit, 0x48);
+    emit8(jit, 0x85);
+    emit8(jit, 0xC0);
+    patch(jit, x_jcc(jit, CC_E), jit->epilogue);
+    /* jmp rax */
+    emit8(jit, 0xFF);
+    emit8(jit, 0xE0);
+}
+
+/**
+ * Run an instruction using the handler chosen by the decoder. Registers
+ * are written back first and reloaded afterwards, since the handler could
+ * use or modify any of them.
+ */
+static void
+call_handler(struct trans_t* t, address pc)
+{
+    struct jit_t* jit = t->jit;
+    struct instr_t* in = &t->cpu->code[pc];
+    reg_flush(t);
+    reg_forget_all(t);
+    /* Handlers expect the program counter past the instruction. */
+    x_store16_imm(jit, OFF_PC, (pc + 2) & 0xFFF);
+    x_mov64(jit, RDI, RBX);
+    x_lea_cpu(jit, RSI, OFF_CODE + pc * sizeof(struct instr_t));
+    x_mov_imm64(jit, RAX, (uint64_t) (uintptr_t) in->exec);
+    /* call rax */
+    emit8(jit, 0xFF);
+    emit8(jit, 0xD0);
+}
+
+/**
+ * Finish a block on a skip instruction whose condition was just compared.
+ * @param cc condition code for the case where the next opcode is skipped.
+ */
+static void
+exit_skip(struct trans_t* t, address pc, int cc)
+{
+    reg_flush(t);
+    int skip = x_jcc(t->jit, cc);
+    exit_static(t, pc + 2);
+    patch(t->jit, skip, t->jit->used);
+    exit_static(t, pc + 4);
+}
+
+/**
+ * Finish a block on a skip instruction whose outcome is known at
+ * translation time.
+ */
+static void
+exit_known_skip(struct trans_t* t, address pc, int skip)
+{
+    reg_flush(t);
+    exit_static(t, pc + (skip ? 4 : 2));
+}
+
+/*
+ * Translator.
+ */
+
+/**
+ * Finds out after which instructions of a block the value of VF is read
+ * again before being overwritten. Flags are not computed when VF is dead.
+ * VF is assumed to be read once the block ends, and by every instruction
+ * that runs in a handler.
+ */
+static void
+find_live_flags(struct trans_t* t, address start, int len)
+{
+    int live = 1;
+    for (int i = len - 1; i >= 0; i--) {
+        const struct instr_t* in = &t->cpu->code[start + 2 * i];
+        int x = in->x, y = in->y;
+        t->vf_live[i] = live;
+        switch (in->opcode >> 12) {
+        case 0x6:
+            if (x == 0xF)
+                live = 0;
+            break;
+        case 0x7:
+            live = live || x == 0xF;
+            break;
+        case 0x8:
+            if (x == 0xF || y == 0xF) {
+                /* 8FY0 overwrites VF, anything else reads it. */
+                live = in->n == 0 && y != 0xF ? 0 : 1;
+            } else if (in->n == 4 || in->n == 5 || in->n == 6
+                       || in->n == 0xE || (in->n == 7 && x != y)) {
+                live = 0;
+            } else if (in->n > 3) {
+                live = 1;
+            }
+            break;
+        case 0xA:
+            break;
+        case 0xF:
+            switch (in->kk) {
+            case 0x07:
+                if (is_idle_loop(in))
+                    live = 1;
+                else if (x == 0xF)
+                    live = 0;
+                break;
+            case 0x65:
+                if (x == 0xF)
+                    live = 0;
+                break;
+            case 0x15:
+            case 0x18:
+            case 0x1E:
+            case 0x29:
+                live = live || x == 0xF;
+                break;
+            default:
+                live = 1;
+            }
+            break;
+        default:
+            live = 1;
+        }
+    }
+}
+
+/**
+ * Folds an 8XYN opcode whose operands are known at translation time.
+ * @return != 0 if the opcode was folded and no code has to be emitted.
+ */
+static int
+fold_alu(struct trans_t* t, const struct instr_t* in)
+{
+    int x = in->x, y = in->y;
+    int vx = t->value[x], vy = t->value[y];
+    int result, flag;
+
+    if (in->n == 0) {
+        if (!KNOWN(t, y))
+            return 0;
+        const_set(t, x, vy);
+        return 1;
+    }
+    if (x == y && in->n == 3) {
+        const_set(t, x, 0);
+        return 1;
+    }
+    if (!KNOWN(t, x))
+        return 0;
+    if (!KNOWN(t, y) && in->n != 6 && in->n != 0xE)
+        return 0;
+
+    switch (in->n) {
+    case 0x1: result = vx | vy; flag = -1; break;
+    case 0x2: result = vx & vy; flag = -1; break;
+    case 0x3: result = vx ^ vy; flag = -1; break;
+    case 0x4: result = vx + vy; flag = result > 0xFF; break;
+    case 0x5: result = vx - vy; flag = vx > vy; break;
+    case 0x6: result = vx >> 1; flag = vx & 1; break;
+    case 0x7: result = vy - vx; flag = vy > vx; break;
+    case 0xE: result = vx << 1; flag = vx >> 7; break;
+    default: return 0;
+    }
+    const_set(t, x, result & 0xFF);
+    if (flag != -1 && t->flags_live)
+        const_set(t, 0xF, flag);
+    return 1;
+}
+
+/**
+ * Translates an instruction.
+ * @return 0 if the block continues, != 0 if the instruction ended it.
+ */
+static int
+translate_instr(struct trans_t* t, address pc)
+{
+    struct jit_t* jit = t->jit;
+    const struct instr_t* in = &t->cpu->code[pc];
+    int x = in->x, y = in->y;
+    int hx, hy, hf, hi;
+
+    t->pinned = 0;
+    switch (in->opcode >> 12) {
+    case 0x0:
+        if (in->opcode == 0x00EE) {
+            /* RET */
+            reg_flush(t);
+            x_load8s(jit, RAX, OFF_SP);
+            x_mov_imm(jit, RCX, (pc + 2) & 0xFFF);
+            x_test(jit, RAX);
+            int underflow = x_jcc(jit, CC_LE);
+            x_alu_imm(jit, ALU_SUB, RAX, 1);
+            x_store8(jit, RAX, OFF_SP);
+            x_load16_index(jit, RCX, RAX, OFF_STACK);
+            patch(jit, underflow, jit->used);
+            exit_dynamic(t);
+            return 1;
+        }
+        call_handler(t, pc);
+        if (in->opcode == 0x00FD) {
+            exit_to_caller(t);
+            return 1;
+        }
+        return 0;
+    case 0x1:
+        /* JP NNN */
+        reg_flush(t);
+        exit_static(t, in->nnn);
+        return 1;
+    case 0x2:
+        /* CALL NNN */
+        reg_flush(t);
+        x_load8s(jit, RAX, OFF_SP);
+        x_alu_imm(jit, ALU_CMP, RAX, 16);
+        int overflow = x_jcc(jit, CC_GE);
+        x_store16_index_imm(jit, RAX, OFF_STACK, (pc + 2) & 0xFFF);
+        x_alu_imm(jit, ALU_ADD, RAX, 1);
+        x_store8(jit, RAX, OFF_SP);
+        exit_static(t, in->nnn);
+        patch(jit, overflow, jit->used);
+        exit_static(t, pc + 2);
+        return 1;
+    case 0x3:
+        /* SE VX, KK */
+        if (KNOWN(t, x)) {
+            exit_known_skip(t, pc, t->value[x] == in->kk);
+            return 1;
+        }
+        x_alu8_imm(jit, ALU_CMP, reg_get(t, x, 1), in->kk);
+        exit_skip(t, pc, CC_E);
+        return 1;
+    case 0x4:
+        /* SNE VX, KK */
+        if (KNOWN(t, x)) {
+            exit_known_skip(t, pc, t->value[x] != in->kk);
+            return 1;
+        }
+        x_alu8_imm(jit, ALU_CMP, reg_get(t, x, 1), in->kk);
+        exit_skip(t, pc, CC_NE);
+        return 1;
+    case 0x5:
+        /* SE VX, VY */
+        if (KNOWN(t, x) && KNOWN(t, y)) {
+            exit_known_skip(t, pc, t->value[x] == t->value[y]);
+            return 1;
+        }
+        alu8_guest(t, ALU_CMP, reg_get(t, x, 1), y);
+        exit_skip(t, pc, CC_E);
+        return 1;
+    case 0x6:
+        /* LD VX, KK */
+        const_set(t, x, in->kk);
+        return 0;
+    case 0x7:
+        /* ADD VX, KK */
+        if (KNOWN(t, x)) {
+            const_set(t, x, (t->value[x] + in->kk) & 0xFF);
+            return 0;
+        }
+        x_alu8_imm(jit, ALU_ADD, reg_get(t, x, 1), in->kk);
+        t->dirty[x] = 1;
+        return 0;
+    case 0x8:
+        /* Opcodes that set VF using VF as an operand run in the handler. */
+        if (in->n >= 4 && (x == 0xF || y == 0xF))
+            break;
+        if (in->n == 7 && x == y)
+            break;
+        if (fold_alu(t, in))
+            return 0;
+        switch (in->n) {
+        case 0x0:
+            hy = reg_get(t, y, 1);
+            hx = reg_get(t, x, 0);
+            x_mov(jit, hx, hy);
+            break;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            hx = reg_get(t, x, 1);
+            alu8_guest(t, in->n == 1 ? ALU_OR : in->n == 2 ? ALU_AND : ALU_XOR,
+                       hx, y);
+            break;
+        case 0x4:
+            hx = reg_get(t, x, 1);
+            if (!t->flags_live) {
+                alu8_guest(t, ALU_ADD, hx, y);
+                break;
+            }
+            hf = reg_get(t, 0xF, 0);
+            x_alu(jit, ALU_XOR, hf, hf);
+            alu8_guest(t, ALU_ADD, hx, y);
+            x_setcc(jit, CC_B, hf);
+            t->dirty[0xF] = 1;
+            break;
+        case 0x5:
+            hx = reg_get(t, x, 1);
+            if (!t->flags_live) {
+                alu8_guest(t, ALU_SUB, hx, y);
+                break;
+            }
+            hf = reg_get(t, 0xF, 0);
+            x_alu(jit, ALU_XOR, hf, hf);
+            alu8_guest(t, ALU_CMP, hx, y);
+            x_setcc(jit, CC_A, hf);
+            alu8_guest(t, ALU_SUB, hx, y);
+            t->dirty[0xF] = 1;
+            break;
+        case 0x6:
+            hx = reg_get(t, x, 1);
+            if (t->flags_live) {
+                hf = reg_get(t, 0xF, 0);
+                x_mov(jit, hf, hx);
+                x_alu_imm(jit, ALU_AND, hf, 1);
+                t->dirty[0xF] = 1;
+            }
+            x_shift8(jit, 5, hx);
+            break;
+        case 0x7:
+            hx = reg_get(t, x, 1);
+            if (t->flags_live) {
+                hf = reg_get(t, 0xF, 0);
+                x_alu(jit, ALU_XOR, hf, hf);
+                /* VY > VX is the same as VX < VY. */
+                alu8_guest(t, ALU_CMP, hx, y);
+                x_setcc(jit, CC_B, hf);
+                t->dirty[0xF] = 1;
+            }
+            x_neg8(jit, hx);
+            alu8_guest(t, ALU_ADD, hx, y);
+            break;
+        case 0xE:
+            hx = reg_get(t, x, 1);
+            if (t->flags_live) {
+                hf = reg_get(t, 0xF, 0);
+                x_mov(jit, hf, hx);
+                x_shr_imm(jit, hf, 7);
+                t->dirty[0xF] = 1;
+            }
+            x_shift8(jit, 4, hx);
+            break;
+        default:
+            /* Unknown opcode, nothing to do. */
+            return 0;
+        }
+        t->dirty[x] = 1;
+        return 0;
+    case 0x9:
+        /* SNE VX, VY */
+        if (KNOWN(t, x) && KNOWN(t, y)) {
+            exit_known_skip(t, pc, t->value[x] != t->value[y]);
+            return 1;
+        }
+        alu8_guest(t, ALU_CMP, reg_get(t, x, 1), y);
+        exit_skip(t, pc, CC_NE);
+        return 1;
+    case 0xA:
+        /* LD I, NNN */
+        const_set(t, GUEST_I, in->nnn);
+        return 0;
+    case 0xB:
+        /* JP V0, NNN */
+        if (KNOWN(t, 0)) {
+            reg_flush(t);
+            exit_static(t, (t->value[0] + in->nnn) & 0xFFF);
+            return 1;
+        }
+        x_mov(jit, RCX, reg_get(t, 0, 1));
+        reg_flush(t);
+        x_alu_imm(jit, ALU_ADD, RCX, in->nnn);
+        x_alu_imm(jit, ALU_AND, RCX, 0xFFF);
+        exit_dynamic(t);
+        return 1;
+    case 0xE:
+        if (in->kk == 0x9E || in->kk == 0xA1) {
+            /* SKP VX and SKNP VX test the keypad, unless there is a poller. */
+            x_mov(jit, RCX, reg_get(t, x, 1));
+            reg_flush(t);
+            x_load64(jit, RAX, OFF_KEYDOWN);
+            x_test64(jit, RAX);
+            int poller = x_jcc(jit, CC_NE);
+            x_alu_imm(jit, ALU_AND, RCX, 0xF);
+            x_load16(jit, RAX, OFF_KEYPAD);
+            x_bt(jit, RAX, RCX);
+            exit_skip(t, pc, in->kk == 0x9E ? CC_B : CC_AE);
+            patch(jit, poller, jit->used);
+        }
+        /* The handler asks the keyboard poller. */
+        call_handler(t, pc);
+        x_load16(jit, RCX, OFF_PC);
+        exit_dynamic(t);
+        return 1;
+    case 0xF:
+        switch (in->kk) {
+        case 0x07:
+            if (is_idle_loop(in)) {
+                /* Idle loops are fast-forwarded by the caller. */
+                call_handler(t, pc);
+                exit_to_caller(t);
+                return 1;
+            }
+            /* LD VX, DT */
+            x_load8(jit, reg_get(t, x, 0), OFF_DT);
+            t->dirty[x] = 1;
+            return 0;
+        case 0x15:
+            /* LD DT, VX */
+            if (KNOWN(t, x))
+                x_store8_imm(jit, OFF_DT, t->value[x]);
+            else
+                x_store8(jit, reg_get(t, x, 1), OFF_DT);
+            return 0;
+        case 0x18:
+            /* LD ST, VX */
+            if (KNOWN(t, x))
+                x_store8_imm(jit, OFF_ST, t->value[x]);
+            else
+                x_store8(jit, reg_get(t, x, 1), OFF_ST);
+            return 0;
+        case 0x1E:
+            /* ADD I, VX */
+            if (KNOWN(t, GUEST_I) && KNOWN(t, x)) {
+                const_set(t, GUEST_I,
+                          (t->value[GUEST_I] + t->value[x]) & 0xFFFF);
+                return 0;
+            }
+            if (KNOWN(t, GUEST_I)) {
+                /* ANNN followed by FX1E is a single LEA. */
+                int base = t->value[GUEST_I];
+                hx = reg_get(t, x, 1);
+                hi = reg_get(t, GUEST_I, 0);
+                x_lea_disp(jit, hi, hx, base);
+                if (base > 0xFFFF - 0xFF)
+                    x_movzx16(jit, hi, hi);
+                t->dirty[GUEST_I] = 1;
+                return 0;
+            }
+            hi = reg_get(t, GUEST_I, 1);
+            if (KNOWN(t, x))
+                x_alu_imm(jit, ALU_ADD, hi, t->value[x]);
+            else
+                x_alu(jit, ALU_ADD, hi, reg_get(t, x, 1));
+            x_movzx16(jit, hi, hi);
+            t->dirty[GUEST_I] = 1;
+            return 0;
+        case 0x29:
+            /* LD F, VX */
+            if (KNOWN(t, x)) {
+                const_set(t, GUEST_I, 0x50 + (t->value[x] & 0xF) * 5);
+                return 0;
+            }
+            x_mov(jit, RAX, reg_get(t, x, 1));
+            x_alu_imm(jit, ALU_AND, RAX, 0xF);
+            x_lea_x5(jit, reg_get(t, GUEST_I, 0), RAX, 0x50);
+            t->dirty[GUEST_I] = 1;
+            return 0;
+        case 0x65:
+            /* LD VX, [I] */
+            if (KNOWN(t, GUEST_I)) {
+                /*
+                 * Addresses are known, read them directly. Unless they
+                 * wrap, they are copied 8 registers at a time, then 4, 2
+                 * and 1, which keeps FF65 under 30 bytes.
+                 */
+                int start = t->value[GUEST_I] & ADDRESS_MASK;
+                int reg = 0;
+                int widest = start + x <= ADDRESS_MASK ? 8 : 1;
+                for (int size = widest; size > 0; size /= 2) {
+                    for (; reg + size <= x + 1; reg += size) {
+                        int addr = (start + reg) & ADDRESS_MASK;
+                        for (int n = reg; n < reg + size; n++)
+                            reg_forget(t, n);
+                        if (size == 8) {
+                            x_load64(jit, RDX, OFF_MEM + addr);
+                            x_store64(jit, RDX, OFF_V + reg);
+                        } else if (size == 4) {
+                            x_load32(jit, RDX, OFF_MEM + addr);
+                            x_store32(jit, RDX, OFF_V + reg);
+                        } else if (size == 2) {
+                            x_load16(jit, RDX, OFF_MEM + addr);
+                            x_store16(jit, RDX, OFF_V + reg);
+                        } else {
+                            x_load8(jit, RDX, OFF_MEM + addr);
+                            x_store8(jit, RDX, OFF_V + reg);
+                        }
+                    }
+                }
+                return 0;
+            }
+            x_mov(jit, RCX, reg_get(t, GUEST_I, 1));
+            for (int reg = 0; reg <= x; reg++) {
+                reg_forget(t, reg);
+                x_mov(jit, RAX, RCX);
+                x_alu_imm(jit, ALU_ADD, RAX, reg);
+                x_alu_imm(jit, ALU_AND, RAX, ADDRESS_MASK);
+                x_load8_index(jit, RDX, RAX, OFF_MEM);
+                x_store8(jit, RDX, OFF_V + reg);
+            }
+            return 0;
+        case 0x0A:
+        case 0x33:
+        case 0x55:
+            /*
+             * Waiting for a key and writing to memory go back to the caller,
+             * since the memory could contain code that has been translated.
+             */
+            call_handler(t, pc);
+            exit_to_caller(t);
+            return 1;
+        }
+        break;
+    }
+
+    /* Anything else runs in the handler. */
+    call_handler(t, pc);
+    return 0;
+}
+
+/** Discards every translated block. */
+static void
+jit_flush(struct jit_t* jit)
+{
+    jit->used = jit->base;
+    jit->links_used = 0;
+    jit->dead_count = 0;
+    jit->flush = 0;
+    for (int pc = 0; pc < MEMSIZ; pc++) {
+        jit->entry[pc] = NULL;
+        jit->links_head[pc] = -1;
+    }
+}
+
+/**
+ * Translates the instructions of a block. The code emitted right after
+ * them is run when the budget is not enough to run the block.
+ */
+static void
+translate_body(struct trans_t* t, address start, int len)
+{
+    struct jit_t* jit = t->jit;
+
+    /* Check the budget. cmp r13d, cost; jl bail; sub r13d, cost */
+    int cost = block_cost(t->cpu, start, len);
+    x_alu_imm(jit, ALU_CMP, R13, cost);
+    int bail = x_jcc(jit, 0xC);
+    x_alu_imm(jit, ALU_SUB, R13, cost);
+
+    find_live_flags(t, start, len);
+    int ended = 0;
+    address pc = start;
+    for (int i = 0; i < len; i++, pc += 2) {
+        t->flags_live = t->vf_live[i];
+        ended = translate_instr(t, pc);
+    }
+    if (!ended) {
+        /* Block was cut, or it draws and the machine may have to stop. */
+        reg_flush(t);
+        if (is_drawing(&t->cpu->code[pc - 2])) {
+            x_load32(jit, RAX, OFF_STOP_ON_DRAW);
+            x_test(jit, RAX);
+            patch(jit, x_jcc(jit, CC_NE), jit->epilogue);
+        }
+        exit_static(t, pc);
+    }
+    patch(jit, bail, jit->used);
+}
+
+/**
+ * Translates the block starting at the given address.
+ * @return the entry point for the translated block.
+ */
+static void*
+translate_block(struct machine_t* cpu, struct jit_t* jit, address start)
+{
+    if (jit->used + JIT_BLOCK_SIZE > JIT_CODE_SIZE) {
+        jit_flush(jit);
+    }
+
+    struct trans_t t;
+    t.jit = jit;
+    t.cpu = cpu;
+    t.victim = 0;
+    reg_forget_all(&t);
+
+    int len = build_block(cpu, start);
+    void* entry = jit->code + jit->used;
+
+    /*
+     * Blocks that start at a breakpoint are only reached from other
+     * blocks, and they just go back to the caller so that it stops.
+     */
+    if (!cpu->breakpoint[start]) {
+        translate_body(&t, start, len);
+    }
+    x_store16_imm(jit, OFF_PC, start);
+    exit_to_caller(&t);
+
+    /* Link the jumps to this block. */
+    jit->entry[start] = entry;
+    jit->len[start] = len;
+    int offset = (byte*) entry - jit->code;
+    for (int link = jit->links_head[start]; link != -1;
+         link = jit->links[link].next) {
+        patch(jit, jit->links[link].site, offset);
+    }
+    return entry;
+}
+
+/**
+ * Maps the buffer either for writing or for running, never both at once.
+ * @return 0 if the buffer is mapped as asked, -1 otherwise.
+ */
+static int
+jit_protect(struct jit_t* jit, int writable)
+{
+    if (jit->writable != writable) {
+        int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+        if (mprotect(jit->code, JIT_CODE_SIZE, prot)) {
+            return -1;
+        }
+        jit->writable = writable;
+    }
+    return 0;
+}
+
+/**
+ * Undoes the links to the blocks invalidated since translated code last
+ * ran: jumps to each of them go to a new exit that goes back to the
+ * caller. The code of the blocks is left in the buffer until it is
+ * flushed, since a handler that invalidates its own block still returns
+ * into it.
+ */
+static void
+jit_unlink_dead(struct jit_t* jit)
+{
+    for (int dead = 0; dead < jit->dead_count; dead++) {
+        address start = jit->dead[dead];
+        if (jit->entry[start] != NULL || jit->links_head[start] == -1) {
+            /* Translated again since then, or nothing jumps to it. */
+            continue;
+        }
+        if (jit->used + JIT_BLOCK_SIZE > JIT_CODE_SIZE) {
+            jit_flush(jit);
+            return;
+        }
+        int exit = jit->used;
+        x_store16_imm(jit, OFF_PC, start);
+        patch(jit, x_jmp(jit), jit->epilogue);
+        for (int link = jit->links_head[start]; link != -1;
+             link = jit->links[link].next) {
+            patch(jit, jit->links[link].site, exit);
+        }
+    }
+    jit->dead_count = 0;
+}
+
+/**
+ * Creates the JIT state for a machine and emits the code used to enter
+ * and leave translated code.
+ */
+static struct jit_t*
+jit_create(void)
+{
+    struct jit_t* jit = malloc(sizeof(struct jit_t));
+    if (jit == NULL)
+        return NULL;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->writable = 1;
+    jit->used = 0;
+
+    /* Entry: save callee-saved registers, then jump into the block. */
+    x_push(jit, RBX);
+    x_push(jit, RBP);
+    x_push(jit, R12);
+    x_push(jit, R13);
+    x_push(jit, R14);
+    x_push(jit, R15);
+    /* sub rsp, 8: keep the stack aligned for handler calls. */
+    emit8(jit, 0x48);
+    emit8(jit, 0x83);
+    emit8(jit, 0xEC);
+    emit8(jit, 0x08);
+    x_mov64(jit, RBX, RDI);
+    x_mov(jit, R13, RSI);
+    /* jmp rdx */
+    emit8(jit, 0xFF);
+    emit8(jit, 0xE2);
+
+    /* Exit: return the budget left and restore the registers. */
+    jit->epilogue = jit->used;
+    x_mov(jit, RAX, R13);
+    /* add rsp, 8 */
+    emit8(jit, 0x48);
+    emit8(jit, 0x83);
+    emit8(jit, 0xC4);
+    emit8(jit, 0x08);
+    x_pop(jit, R15);
+    x_pop(jit, R14);
+    x_pop(jit, R13);
+    x_pop(jit, R12);
+    x_pop(jit, RBP);
+    x_pop(jit, RBX);
+    emit8(jit, 0xC3);
+
+    jit->base = jit->used;
+    jit_flush(jit);
+    return jit;
+}
+
+int
+jit_execute(struct machine_t* cpu, int max_cycles)
+{
+    if (cpu->jit == NULL) {
+        cpu->jit = jit_create();
+        if (cpu->jit == NULL)
+            return 0;
+    }
+
+    struct jit_t* jit = cpu->jit;
+    jit_enter_t enter = (jit_enter_t) (uintptr_t) jit->code;
+    int retired = 0;
+    do {
+        address pc = cpu->pc & ADDRESS_MASK;
+        if (jit->flush || jit->dead_count > 0 || jit->entry[pc] == NULL) {
+            if (jit_protect(jit, 1)) {
+                break;
+            }
+            if (jit->flush) {
+                jit_flush(jit);
+            }
+            jit_unlink_dead(jit);
+            if (jit->entry[pc] == NULL) {
+                translate_block(cpu, jit, pc);
+            }
+        }
+        if (jit_protect(jit, 0)) {
+            break;
+        }
+        void* entry = jit->entry[pc];
+        int budget = max_cycles - retired;
+        int left = enter(cpu, budget, entry);
+        if (left == budget) {
+            /* The block didn't fit in the budget. */
+            break;
+        }
+        retired += budget - left;
+    } while (retired < max_cycles && !must_stop(cpu));
+    return retired;
+}
+
+void
+jit_invalidate(struct machine_t* cpu, address addr)
+{
+    struct jit_t* jit = cpu->jit;
+    if (jit == NULL)
+        return;
+
+    /*
+     * Blocks covering the address are dropped from the entry table right
+     * away. Blocks don't wrap around, so they start at most this far
+     * behind. Links to them are undone once the machine goes back to C,
+     * as the buffer can't be written while translated code runs.
+     */
+    for (int start = addr; start >= 0 && start > addr - 2 * BLOCK_MAX;
+         start--) {
+        if (jit->entry[start] == NULL || start + 2 * jit->len[start] <= addr) {
+            continue;
+        }
+        jit->entry[start] = NULL;
+        if (jit->dead_count < JIT_MAX_DEAD) {
+            jit->dead[jit->dead_count++] = start;
+        } else {
+            jit->flush = 1;
+        }
+    }
+}
+
+void
+jit_free(struct machine_t* cpu)
+{
+    if (cpu->jit != NULL) {
+        munmap(cpu->jit->code, JIT_CODE_SIZE);
+        free(cpu->jit);
+        cpu->jit = NULL;
+    }
+}
+
+#else
+
+/* There is no JIT for this platform, so the threaded engine is used. */
+
+int
+jit_execute(struct machine_t* cpu, int max_cycles)
+{
+    return 0;
+}
+
+void
+jit_invalidate(struct machine_t* cpu, address addr)
+{
+}
+
+void
+jit_free(struct machine_t* cpu)
+{
+}
+
+#endif
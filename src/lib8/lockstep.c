@@ -0,0 +1,783 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The fleet keeps a group of lanes in lockstep, all of them with the same
+ * program counter. Registers are kept as 16-bit words, and each vector
+ * holds a register of 16 lanes, so a single AVX2 instruction runs an
+ * opcode in 16 machines. Lanes out of the group are masked off. Opcodes
+ * that touch memory, the screen or the random generator are run by
+ * step_machine, one lane at a time. After a skip or a jump, the lanes
+ * that didn't go the same way as most of the group leave lockstep: their
+ * registers are copied back to their machines, where they run a few
+ * instructions at a time until they reach the program counter of the
+ * group and join it again. Lanes don't have to run in step: each one
+ * runs its own budget, whether it is in the group or not.
+ *
+ * Memory is not kept lane-wise: every machine keeps its own memory, which
+ * is the same image for all of them until some machine writes to it.
+ * Opcodes are fetched from the image, so once any machine writes to an
+ * address the instructions there always run one lane at a time.
+ *
+ * Machines that take different paths most of the time would only pay for
+ * copying their registers back and forth, so when too few instructions
+ * run in lockstep, every machine runs the rest of its budget on its own.
+ */
+
+#include "lockstep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LOCKSTEP_AVX2
+#endif
+
+#ifdef __GNUC__
+/** Amount of lanes in a vector. */
+#define CHUNK 16
+typedef word lanes_t __attribute__((vector_size(2 * CHUNK)));
+/** Converts a comparison to a mask where the lanes that match are set. */
+#define MASK(cond) ((lanes_t) (cond))
+#else
+/* Without vector extensions, the same code works a lane at a time. */
+#define CHUNK 1
+typedef word lanes_t;
+#define MASK(cond) ((lanes_t) -(cond))
+#endif
+
+/** Lanes of a lane-wise array that start at the given lane. */
+#define LANES(array, lane) (*(lanes_t*) &(array)[lane])
+
+/** Vector with every lane set to the given value. */
+#define SPLAT(value) ((lanes_t) {0} + (word) (value))
+
+/** Takes the lanes in mask from b and the rest from a. */
+#define BLEND(a, b, mask) (((a) & ~(mask)) | ((b) & (mask)))
+
+/** Instructions run by a lane out of lockstep before the group runs. */
+#define BURST 32
+
+/**
+ * Groups run between checks of how much of the fleet runs in lockstep.
+ * When more than 1 of every PEEL_RATIO instructions was run out of
+ * lockstep since the last check, lanes are better run one at a time.
+ */
+#define CHECK_GROUPS 32
+#define PEEL_RATIO 8
+
+#define OPCODE_NNN(opcode) (opcode & 0xFFF)
+#define OPCODE_KK(opcode) (opcode & 0xFF)
+#define OPCODE_N(opcode) (opcode & 0xF)
+#define OPCODE_X(opcode) ((opcode >> 8) & 0xF)
+#define OPCODE_Y(opcode) ((opcode >> 4) & 0xF)
+#define OPCODE_P(opcode) (opcode >> 12)
+
+/** Adds up the lanes of a vector. */
+static inline int
+sum_lanes(const lanes_t* lanes)
+{
+#ifdef __GNUC__
+    int sum = 0;
+    for (int lane = 0; lane < CHUNK; lane++) {
+        sum += (*lanes)[lane];
+    }
+    return sum;
+#else
+    return *lanes;
+#endif
+}
+
+/** Tells whether any lane of a vector is not zero. */
+static inline int
+any_lane(const lanes_t* lanes)
+{
+#ifdef __GNUC__
+    uint64_t words[sizeof(lanes_t) / sizeof(uint64_t)];
+    memcpy(words, lanes, sizeof(lanes_t));
+    uint64_t any = 0;
+    for (size_t pos = 0; pos < sizeof(words) / sizeof(uint64_t); pos++) {
+        any |= words[pos];
+    }
+    return any != 0;
+#else
+    return *lanes != 0;
+#endif
+}
+
+int
+init_lockstep(struct lockstep_t* fleet, int count)
+{
+    memset(fleet, 0, sizeof(struct lockstep_t));
+    fleet->count = count;
+    fleet->lanes = (count + CHUNK - 1) / CHUNK * CHUNK;
+    fleet->machines = calloc(count, sizeof(struct machine_t));
+
+    /* 42 lane-wise arrays, aligned to whole vectors. */
+    fleet->block = calloc(1, 42 * sizeof(word) * fleet->lanes
+                             + sizeof(lanes_t));
+    if (fleet->machines == NULL || fleet->block == NULL) {
+        free_lockstep(fleet);
+        return -1;
+    }
+    uintptr_t base = (uintptr_t) fleet->block;
+    word* lane = (word*) ((base + sizeof(lanes_t) - 1)
+                          & ~(uintptr_t) (sizeof(lanes_t) - 1));
+    for (int reg = 0; reg < 16; reg++) {
+        fleet->v[reg] = lane + reg * fleet->lanes;
+        fleet->stack[reg] = lane + (16 + reg) * fleet->lanes;
+    }
+    fleet->i = lane + 32 * fleet->lanes;
+    fleet->pc = lane + 33 * fleet->lanes;
+    fleet->sp = lane + 34 * fleet->lanes;
+    fleet->dt = lane + 35 * fleet->lanes;
+    fleet->st = lane + 36 * fleet->lanes;
+    fleet->todo = lane + 37 * fleet->lanes;
+    fleet->runnable = lane + 38 * fleet->lanes;
+    fleet->inside = lane + 39 * fleet->lanes;
+    fleet->left = lane + 40 * fleet->lanes;
+    fleet->keypad = lane + 41 * fleet->lanes;
+
+    for (int m = 0; m < count; m++) {
+        init_machine(&fleet->machines[m]);
+    }
+    memcpy(fleet->image, fleet->machines[0].mem, MEMSIZ);
+    return 0;
+}
+
+void
+free_lockstep(struct lockstep_t* fleet)
+{
+    if (fleet->machines != NULL) {
+        for (int m = 0; m < fleet->count; m++) {
+            free_machine(&fleet->machines[m]);
+        }
+    }
+    free(fleet->machines);
+    free(fleet->block);
+    fleet->machines = NULL;
+    fleet->block = NULL;
+}
+
+void
+load_lockstep(struct lockstep_t* fleet, const byte* program, int length)
+{
+    if (length > MEMSIZ - 0x200) {
+        length = MEMSIZ - 0x200;
+    }
+    memcpy(fleet->image + 0x200, program, length);
+    memset(fleet->written, 0, MEMSIZ);
+    for (int m = 0; m < fleet->count; m++) {
+        struct machine_t* cpu = &fleet->machines[m];
+        memcpy(cpu->mem + 0x200, program, length);
+        invalidate_code(cpu, 0x200, length);
+    }
+}
+
+/**
+ * Checks whether a machine waiting for a key can go on, as run_machine
+ * does, storing the key in the register given to FX0A if one is held.
+ * @return 0 if the machine can fetch opcodes, != 0 if it is still waiting.
+ */
+static int
+is_waiting_key(struct machine_t* cpu)
+{
+    if (cpu->wait_key == -1)
+        return 0;
+    for (int key = 0; key < 16; key++) {
+        int held = cpu->keydown ? cpu->keydown(key) != 0
+                                : (cpu->keypad >> key) & 1;
+        if (held) {
+            press_key(cpu, key);
+            break;
+        }
+    }
+    return cpu->wait_key != -1;
+}
+
+/** Copies the registers of a machine to its lane. */
+static void
+gather_lane(struct lockstep_t* fleet, int lane)
+{
+    const struct machine_t* cpu = &fleet->machines[lane];
+    for (int reg = 0; reg < 16; reg++) {
+        fleet->v[reg][lane] = cpu->v[reg];
+        fleet->stack[reg][lane] = cpu->stack[reg];
+    }
+    fleet->i[lane] = cpu->i;
+    fleet->pc[lane] = cpu->pc;
+    fleet->sp[lane] = cpu->sp;
+    fleet->dt[lane] = cpu->dt;
+    fleet->st[lane] = cpu->st;
+}
+
+/** Copies the registers in a lane back to its machine. */
+static void
+scatter_lane(struct lockstep_t* fleet, int lane)
+{
+    struct machine_t* cpu = &fleet->machines[lane];
+    for (int reg = 0; reg < 16; reg++) {
+        cpu->v[reg] = fleet->v[reg][lane];
+        cpu->stack[reg] = fleet->stack[reg][lane];
+    }
+    cpu->i = fleet->i[lane];
+    cpu->pc = fleet->pc[lane];
+    cpu->sp = fleet->sp[lane];
+    cpu->dt = fleet->dt[lane];
+    cpu->st = fleet->st[lane];
+}
+
+/**
+ * Marks the image as written wherever the memory of some machine is not
+ * the image any longer. Only step_lane marks it as it goes; machines that
+ * ran on their own in run_machine, and the host, write to memory behind
+ * its back.
+ */
+static void
+mark_written(struct lockstep_t* fleet)
+{
+    for (int m = 0; m < fleet->count; m++) {
+        const byte* mem = fleet->machines[m].mem;
+        for (int addr = 0; addr < MEMSIZ; addr += 64) {
+            if (memcmp(mem + addr, fleet->image + addr, 64) == 0) {
+                continue;
+            }
+            for (int pos = addr; pos < addr + 64; pos++) {
+                fleet->written[pos] |= mem[pos] != fleet->image[pos];
+            }
+        }
+    }
+}
+
+/**
+ * Runs the next instruction of a lane out of lockstep in its machine.
+ * The image is marked as written where the instruction stores registers
+ * in memory. Lanes that exit or wait for a key stop being runnable.
+ */
+static void
+step_lane(struct lockstep_t* fleet, int lane)
+{
+    struct machine_t* cpu = &fleet->machines[lane];
+    address pc = cpu->pc & ADDRESS_MASK;
+    word opcode = (cpu->mem[pc] << 8) | cpu->mem[(pc + 1) & ADDRESS_MASK];
+    int stored = 0;
+    if ((opcode & 0xF0FF) == 0xF033) {
+        stored = 3;
+    } else if ((opcode & 0xF0FF) == 0xF055) {
+        stored = OPCODE_X(opcode) + 1;
+    }
+    for (int pos = 0; pos < stored; pos++) {
+        fleet->written[(cpu->i + pos) & ADDRESS_MASK] = 1;
+    }
+
+    /* run_lockstep counts the cycles of the whole run. */
+    uint64_t cycles = cpu->cycles;
+    step_machine(cpu);
+    cpu->cycles = cycles;
+    fleet->left[lane]--;
+    fleet->peeled++;
+
+    /* A held key releases FX0A at once, storing the key in a register. */
+    if (cpu->exit || is_waiting_key(cpu) || fleet->left[lane] == 0) {
+        fleet->runnable[lane] = 0;
+    }
+}
+
+/**
+ * Tells whether an opcode can run in lockstep. These are the opcodes that
+ * only work on the registers kept lane-wise.
+ */
+static int
+is_lockstep_op(word opcode)
+{
+    switch (OPCODE_P(opcode)) {
+    case 0x0:
+        return opcode == 0x00EE;
+    case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6:
+    case 0x7: case 0x9: case 0xA: case 0xB:
+        return 1;
+    case 0x8:
+        return OPCODE_N(opcode) <= 0x7 || OPCODE_N(opcode) == 0xE;
+    case 0xE:
+        return OPCODE_KK(opcode) == 0x9E || OPCODE_KK(opcode) == 0xA1;
+    case 0xF:
+        switch (OPCODE_KK(opcode)) {
+        case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29:
+            return 1;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+/**
+ * Runs an instruction in the runnable lanes in lockstep whose program
+ * counter is pc. Mirrors the handlers in cpu.c, including the order in
+ * which VF is written.
+ * @return the amount of lanes that ran the instruction.
+ */
+static inline __attribute__((always_inline)) int
+run_group_lanes(struct lockstep_t* fleet, word pc, word opcode)
+{
+    const int x = OPCODE_X(opcode), y = OPCODE_Y(opcode);
+    const word kk = OPCODE_KK(opcode), nnn = OPCODE_NNN(opcode);
+    const word next = (pc + 2) & 0xFFF, skip = (pc + 4) & 0xFFF;
+    word** v = fleet->v;
+    lanes_t count = SPLAT(0);
+
+/** Sets the lanes of the group in a lane-wise array. */
+#define SET(array, value) \
+    (LANES(array, lane) = BLEND(LANES(array, lane), (value), m))
+
+    for (int lane = 0; lane < fleet->lanes; lane += CHUNK) {
+        lanes_t m = LANES(fleet->inside, lane) & LANES(fleet->runnable, lane)
+                  & MASK(LANES(fleet->pc, lane) == pc);
+        count -= m;
+        lanes_t npc = SPLAT(next);
+        switch (OPCODE_P(opcode)) {
+        case 0x0: {
+            /* 00EE */
+            lanes_t sp = LANES(fleet->sp, lane);
+            lanes_t ok = m & MASK(sp > 0);
+            lanes_t top = sp - 1;
+            for (int level = 0; level < 16; level++) {
+                npc = BLEND(npc, LANES(fleet->stack[level], lane),
+                            ok & MASK(top == (word) level));
+            }
+            LANES(fleet->sp, lane) = BLEND(sp, top, ok);
+            break;
+        }
+        case 0x1:
+            npc = SPLAT(nnn);
+            break;
+        case 0x2: {
+            lanes_t sp = LANES(fleet->sp, lane);
+            lanes_t ok = m & MASK(sp < 16);
+            for (int level = 0; level < 16; level++) {
+                lanes_t* stack = &LANES(fleet->stack[level], lane);
+                *stack = BLEND(*stack, npc, ok & MASK(sp == (word) level));
+            }
+            LANES(fleet->sp, lane) = BLEND(sp, sp + 1, ok);
+            npc = BLEND(npc, SPLAT(nnn), ok);
+            break;
+        }
+        case 0x3:
+            npc = BLEND(npc, SPLAT(skip), MASK(LANES(v[x], lane) == kk));
+            break;
+        case 0x4:
+            npc = BLEND(npc, SPLAT(skip), MASK(LANES(v[x], lane) != kk));
+            break;
+        case 0x5:
+            npc = BLEND(npc, SPLAT(skip),
+                        MASK(LANES(v[x], lane) == LANES(v[y], lane)));
+            break;
+        case 0x9:
+            npc = BLEND(npc, SPLAT(skip),
+                        MASK(LANES(v[x], lane) != LANES(v[y], lane)));
+            break;
+        case 0x6:
+            SET(v[x], SPLAT(kk));
+            break;
+        case 0x7:
+            SET(v[x], (LANES(v[x], lane) + kk) & 0xFF);
+            break;
+        case 0x8:
+            switch (OPCODE_N(opcode)) {
+            case 0x0:
+                SET(v[x], LANES(v[y], lane));
+                break;
+            case 0x1:
+                SET(v[x], LANES(v[x], lane) | LANES(v[y], lane));
+                break;
+            case 0x2:
+                SET(v[x], LANES(v[x], lane) & LANES(v[y], lane));
+                break;
+            case 0x3:
+                SET(v[x], LANES(v[x], lane) ^ LANES(v[y], lane));
+                break;
+            case 0x4:
+                SET(v[0xF], (LANES(v[x], lane) + LANES(v[y], lane)) >> 8);
+                SET(v[x], (LANES(v[x], lane) + LANES(v[y], lane)) & 0xFF);
+                break;
+            case 0x5:
+                SET(v[0xF], MASK(LANES(v[x], lane) > LANES(v[y], lane)) & 1);
+                SET(v[x], (LANES(v[x], lane) - LANES(v[y], lane)) & 0xFF);
+                break;
+            case 0x6:
+                SET(v[0xF], LANES(v[x], lane) & 1);
+                SET(v[x], LANES(v[x], lane) >> 1);
+                break;
+            case 0x7:
+                SET(v[0xF], MASK(LANES(v[y], lane) > LANES(v[x], lane)) & 1);
+                SET(v[x], (LANES(v[y], lane) - LANES(v[x], lane)) & 0xFF);
+                break;
+            case 0xE:
+                SET(v[0xF], LANES(v[x], lane) >> 7);
+                SET(v[x], (LANES(v[x], lane) << 1) & 0xFF);
+                break;
+            }
+            break;
+        case 0xA:
+            SET(fleet->i, SPLAT(nnn));
+            break;
+        case 0xE: {
+            /* Vectors can't shift each lane by a different amount. */
+            lanes_t key = LANES(v[x], lane) & 0xF, bit = SPLAT(0);
+            for (int pos = 0; pos < 16; pos++) {
+                bit |= MASK(key == (word) pos) & (word) (1 << pos);
+            }
+            lanes_t down = MASK((LANES(fleet->keypad, lane) & bit) != 0);
+            npc = BLEND(npc, SPLAT(skip), kk == 0x9E ? down : ~down);
+            break;
+        }
+        case 0xB:
+            npc = (LANES(v[0], lane) + nnn) & 0xFFF;
+            break;
+        case 0xF:
+            switch (kk) {
+            case 0x07:
+                SET(v[x], LANES(fleet->dt, lane));
+                break;
+            case 0x15:
+                SET(fleet->dt, LANES(v[x], lane));
+                break;
+            case 0x18:
+                SET(fleet->st, LANES(v[x], lane));
+                break;
+            case 0x1E:
+                SET(fleet->i, LANES(fleet->i, lane) + LANES(v[x], lane));
+                break;
+            case 0x29:
+                SET(fleet->i, (LANES(v[x], lane) & 0xF) * 5 + 0x50);
+                break;
+            }
+            break;
+        }
+        SET(fleet->pc, npc);
+
+        /* Lanes that spend their budget stop. */
+        lanes_t left = LANES(fleet->left, lane) + m;
+        LANES(fleet->left, lane) = left;
+        LANES(fleet->runnable, lane) &= ~(m & MASK(left == 0));
+    }
+#undef SET
+    return sum_lanes(&count);
+}
+
+#ifdef LOCKSTEP_AVX2
+__attribute__((target("avx2"))) static int
+run_group_avx2(struct lockstep_t* fleet, word pc, word opcode)
+{
+    return run_group_lanes(fleet, pc, opcode);
+}
+#endif
+
+static int
+run_group(struct lockstep_t* fleet, word pc, word opcode)
+{
+    return run_group_lanes(fleet, pc, opcode);
+}
+
+/**
+ * Tells whether the instruction at an address can run in lockstep. It
+ * has to be one of the opcodes run by run_group, and no machine can have
+ * written to it.
+ */
+static int
+can_lockstep(const struct lockstep_t* fleet, word pc)
+{
+    if (pc > ADDRESS_MASK || fleet->written[pc]
+        || fleet->written[(pc + 1) & ADDRESS_MASK])
+        return 0;
+    /* Keyboard pollers have to be asked by the handlers. */
+    if (fleet->image[pc] >> 4 == 0xE && fleet->polled)
+        return 0;
+    return is_lockstep_op((fleet->image[pc] << 8)
+                          | fleet->image[(pc + 1) & ADDRESS_MASK]);
+}
+
+/**
+ * Picks the runnable lanes that are in lockstep, or the ones that are
+ * not, as the lanes to visit using next_lane.
+ * @return whether any lane was picked.
+ */
+static int
+pick_lanes(struct lockstep_t* fleet, int inside)
+{
+    lanes_t flip = SPLAT(inside ? 0 : 0xFFFF), any = SPLAT(0);
+    for (int lane = 0; lane < fleet->lanes; lane += CHUNK) {
+        lanes_t todo = LANES(fleet->runnable, lane)
+                     & (LANES(fleet->inside, lane) ^ flip);
+        LANES(fleet->todo, lane) = todo;
+        any |= todo;
+    }
+    return any_lane(&any);
+}
+
+/** Finds the first picked lane from the given one. */
+static int
+next_lane(const struct lockstep_t* fleet, int lane)
+{
+    while (lane < fleet->count) {
+        /* Skip whole vectors while none of their lanes is picked. */
+        if (lane % CHUNK == 0 && !any_lane(&LANES(fleet->todo, lane))) {
+            lane += CHUNK;
+        } else if (fleet->todo[lane]) {
+            return lane;
+        } else {
+            lane++;
+        }
+    }
+    return fleet->count;
+}
+
+/** Takes a lane out of lockstep, back to its machine. */
+static void
+leave_lockstep(struct lockstep_t* fleet, int lane)
+{
+    scatter_lane(fleet, lane);
+    fleet->inside[lane] = 0;
+}
+
+/** Puts a lane in lockstep, taking its registers from its machine. */
+static void
+join_lockstep(struct lockstep_t* fleet, int lane)
+{
+    gather_lane(fleet, lane);
+    fleet->inside[lane] = 0xFFFF;
+}
+
+/**
+ * Splits the group if its lanes took different branches. The lanes that
+ * went the same way as most of the group stay in lockstep, and the rest
+ * leave it.
+ */
+static void
+split_group(struct lockstep_t* fleet)
+{
+    if (!pick_lanes(fleet, 1)) {
+        return;
+    }
+    int first = next_lane(fleet, 0);
+    word pc = fleet->pc[first];
+    lanes_t same = SPLAT(0), total = SPLAT(0);
+    for (int lane = 0; lane < fleet->lanes; lane += CHUNK) {
+        lanes_t todo = LANES(fleet->todo, lane);
+        total -= todo;
+        same -= todo & MASK(LANES(fleet->pc, lane) == pc);
+    }
+    int lanes = sum_lanes(&total), kept = sum_lanes(&same);
+    if (kept == lanes) {
+        return;
+    }
+    if (2 * kept < lanes) {
+        int lane = first;
+        while (fleet->pc[lane] == pc) {
+            lane = next_lane(fleet, lane + 1);
+        }
+        pc = fleet->pc[lane];
+    }
+    for (int lane = first; lane < fleet->count;
+         lane = next_lane(fleet, lane + 1)) {
+        if (fleet->pc[lane] != pc) {
+            leave_lockstep(fleet, lane);
+        }
+    }
+}
+
+/**
+ * Runs the instruction at pc in the group, in lockstep if possible or
+ * else one lane at a time, and splits the group if it has to.
+ * @param avx2 whether AVX2 is available.
+ */
+static void
+run_lockstep_group(struct lockstep_t* fleet, word pc, int avx2)
+{
+    if (can_lockstep(fleet, pc)) {
+        word opcode = (fleet->image[pc] << 8)
+                    | fleet->image[(pc + 1) & ADDRESS_MASK];
+#ifdef LOCKSTEP_AVX2
+        if (avx2) {
+            fleet->together += run_group_avx2(fleet, pc, opcode);
+        } else
+#endif
+        fleet->together += run_group(fleet, pc, opcode);
+        /* Only calls, returns, jumps and skips can split the group. */
+        switch (OPCODE_P(opcode)) {
+        case 0x0: case 0x2: case 0x3: case 0x4: case 0x5: case 0x9:
+        case 0xB:
+            split_group(fleet);
+        }
+        return;
+    }
+
+    pick_lanes(fleet, 1);
+    for (int lane = next_lane(fleet, 0); lane < fleet->count;
+         lane = next_lane(fleet, lane + 1)) {
+        scatter_lane(fleet, lane);
+        step_lane(fleet, lane);
+        if (fleet->runnable[lane]) {
+            gather_lane(fleet, lane);
+        } else {
+            fleet->inside[lane] = 0;
+        }
+    }
+    split_group(fleet);
+}
+
+/**
+ * Runs lanes out of lockstep in their machines, up to BURST instructions
+ * each, stopping early if they reach the program counter of the group so
+ * that they join it.
+ */
+static void
+run_diverged(struct lockstep_t* fleet, word pc)
+{
+    if (!pick_lanes(fleet, 0)) {
+        return;
+    }
+    for (int lane = next_lane(fleet, 0); lane < fleet->count;
+         lane = next_lane(fleet, lane + 1)) {
+        struct machine_t* cpu = &fleet->machines[lane];
+        for (int step = 0; step < BURST; step++) {
+            if (cpu->pc == pc) {
+                join_lockstep(fleet, lane);
+                break;
+            }
+            step_lane(fleet, lane);
+            if (!fleet->runnable[lane]) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Runs the rest of the budget of every lane in its machine using
+ * run_machine, one machine after the other.
+ */
+static void
+run_alone(struct lockstep_t* fleet)
+{
+    for (int lane = 0; lane < fleet->count; lane++) {
+        struct machine_t* cpu = &fleet->machines[lane];
+        if (fleet->inside[lane]) {
+            leave_lockstep(fleet, lane);
+        }
+        int drawn = cpu->drawn, stop_on_draw = cpu->stop_on_draw;
+        cpu->stop_on_draw = 0;
+        while (fleet->runnable[lane]) {
+            int ran = run_machine(cpu, fleet->left[lane]);
+            /* run_lockstep counts the cycles of the whole run. */
+            cpu->cycles -= ran;
+            fleet->left[lane] -= ran;
+            fleet->peeled += ran;
+            if (cpu->exit || cpu->wait_key != -1 || !fleet->left[lane]) {
+                fleet->runnable[lane] = 0;
+            }
+        }
+        cpu->drawn |= drawn;
+        cpu->stop_on_draw = stop_on_draw;
+    }
+}
+
+int
+run_lockstep(struct lockstep_t* fleet, int max_cycles)
+{
+    int avx2 = 0;
+#ifdef LOCKSTEP_AVX2
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    size_t size = sizeof(word) * fleet->lanes;
+    memset(fleet->inside, 0, size);
+    for (int lane = 0; lane < fleet->count; lane++) {
+        struct machine_t* cpu = &fleet->machines[lane];
+        cpu->drawn = 0;
+        cpu->idle = 0;
+        cpu->overrun = 0;
+    }
+
+    /* Budgets are kept in words, so long runs are split in slices. */
+    int run = 0;
+    while (run < max_cycles) {
+        int slice = max_cycles - run < 0xFFFF ? max_cycles - run : 0xFFFF;
+
+        /* The host or run_alone may have written since the last slice. */
+        mark_written(fleet);
+        memset(fleet->runnable, 0, size);
+        fleet->polled = 0;
+        for (int lane = 0; lane < fleet->count; lane++) {
+            struct machine_t* cpu = &fleet->machines[lane];
+            fleet->left[lane] = slice;
+            fleet->keypad[lane] = cpu->keypad;
+            fleet->polled |= cpu->keydown != NULL;
+            if (!cpu->exit && !is_waiting_key(cpu)) {
+                fleet->runnable[lane] = 0xFFFF;
+            }
+        }
+
+        uint64_t together = fleet->together, peeled = fleet->peeled;
+        for (int groups = 1;; groups++) {
+            if (groups % CHECK_GROUPS == 0) {
+                if ((fleet->peeled - peeled) * PEEL_RATIO
+                    > fleet->together - together) {
+                    run_alone(fleet);
+                    break;
+                }
+                together = fleet->together;
+                peeled = fleet->peeled;
+            }
+
+            /* Without a group, the first lane left leads a new one. */
+            pick_lanes(fleet, 1);
+            int leader = next_lane(fleet, 0);
+            if (leader == fleet->count) {
+                pick_lanes(fleet, 0);
+                leader = next_lane(fleet, 0);
+                if (leader == fleet->count) {
+                    break;
+                }
+                join_lockstep(fleet, leader);
+            }
+            word pc = fleet->pc[leader];
+            run_diverged(fleet, pc);
+            run_lockstep_group(fleet, pc, avx2);
+        }
+
+        int most = 0;
+        for (int lane = 0; lane < fleet->count; lane++) {
+            if (fleet->inside[lane]) {
+                leave_lockstep(fleet, lane);
+            }
+            int ran = slice - fleet->left[lane];
+            fleet->machines[lane].cycles += ran;
+            most = ran > most ? ran : most;
+        }
+        run += most;
+        if (most < slice) {
+            break;
+        }
+    }
+
+    for (int lane = 0; lane < fleet->count; lane++) {
+        struct machine_t* cpu = &fleet->machines[lane];
+        cpu->stop = cpu->exit ? STOP_EXIT
+                  : cpu->wait_key != -1 ? STOP_WAIT_KEY : STOP_BUDGET;
+    }
+    return run;
+}
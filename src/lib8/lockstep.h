@@ -0,0 +1,96 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include "cpu.h"
+
+/*
+ * Lockstep engine. It runs a fleet of machines that were loaded with the
+ * same program. The registers of the fleet are laid out lane-wise, one
+ * array per register with an entry per machine, so that the machines
+ * whose program counters agree run each instruction together using vector
+ * instructions. Machines that diverge are peeled off and run one at a
+ * time by step_machine until they catch up with the rest of the fleet.
+ */
+
+/**
+ * A fleet of machines run in lockstep. Between calls to run_lockstep the
+ * machines hold the whole state of the fleet, so they can be used as any
+ * other machine to press keys, tick the timers or look at the screen.
+ */
+struct lockstep_t
+{
+    int count;                  // Machines in the fleet.
+    int lanes;                  // Count rounded up to whole vectors.
+    struct machine_t* machines; // The machines, one per lane.
+    byte image[MEMSIZ];         // Memory every machine was loaded with.
+    byte written[MEMSIZ];       // Addresses of the image that were written.
+
+    word* v[16];                // Lane-wise registers, only valid for
+    word* i;                    // lanes in lockstep in run_lockstep.
+    word* pc;
+    word* sp;
+    word* dt, *st;
+    word* stack[16];
+    word* todo;                 // Lanes picked to be visited.
+    word* runnable;             // Lanes that can go on running.
+    word* inside;               // Lanes in lockstep.
+    word* left;                 // Instructions left to each lane.
+    word* keypad;               // Keys held down in each lane.
+    int polled;                 // Some machine has a keyboard poller.
+    void* block;                // Memory holding the lane-wise arrays.
+
+    uint64_t together;          // Instructions run by lanes in lockstep.
+    uint64_t peeled;            // Instructions run out of lockstep.
+};
+
+/**
+ * Initializes a fleet of machines. Each of them is initialized as done
+ * by init_machine, using the interpreter and the uniform timing profile.
+ * @return 0 if the fleet was initialized, -1 if memory ran out.
+ */
+int init_lockstep(struct lockstep_t* fleet, int count);
+
+/**
+ * Releases the machines of a fleet and the memory used by it.
+ */
+void free_lockstep(struct lockstep_t* fleet);
+
+/**
+ * Loads a program at 0x200 in the memory of every machine of a fleet.
+ * @param length size of the program; the bytes that don't fit in the
+ *        memory are left out.
+ */
+void load_lockstep(struct lockstep_t* fleet, const byte* program,
+                   int length);
+
+/**
+ * Runs every machine of a fleet up to max_cycles instructions. It is the
+ * same as calling run_machine on every machine using the uniform timing
+ * profile, except that stop_on_draw is not taken into account: machines
+ * only stop early when they exit or wait for a key, as told by their
+ * stop field. Machines should not have breakpoints. When the machines
+ * of the fleet take different paths too often, they run on their own
+ * using the engine each of them is set to.
+ * @return the most instructions run by a machine of the fleet.
+ */
+int run_lockstep(struct lockstep_t* fleet, int max_cycles);
+
+#endif // LOCKSTEP_H_
@@ -0,0 +1,429 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ahead of time translation. The program in the memory of a machine is
+ * walked from 0x200, following jumps, calls and skips, and every basic
+ * block that is found is written out as a C function. Once that source
+ * has been compiled as a shared object, it can be loaded into a machine
+ * that holds the same program and run by the native engine.
+ *
+ * The generated code accesses the machine using the offsets of its fields
+ * at translation time, so it doesn't depend on the headers of lib8. The
+ * shared object records the size of the machine and the hash of the
+ * program it was translated from, and it is only loaded if both match.
+ * Opcodes that are not simple enough to be written inline call back into
+ * lib8 to run their handler.
+ *
+ * Blocks are the same that the threaded engine builds. Code that was not
+ * found while walking the program, such as the targets of BNNN, and any
+ * block that is overwritten or gets a breakpoint, runs in the interpreter.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "cpu.h"
+#include "engine.h"
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NATIVE_VERSION 1 // Changes whenever the generated code changes.
+
+/**
+ * Signature of a translated block. The handler is used to run the opcodes
+ * that are not translated inline.
+ */
+typedef void (*native_handler_t)(struct machine_t*, address);
+typedef void (*native_block_t)(struct machine_t*, native_handler_t);
+
+/** Entry in the table of blocks exported by a shared object. */
+struct native_entry_t
+{
+    word start;                 // Address of the first instruction.
+    word len;                   // Amount of instructions in the block.
+    native_block_t run;         // Translated block.
+};
+
+/** Translated program loaded into a machine. */
+struct native_t
+{
+    void* handle;               // Shared object, as returned by dlopen.
+    native_block_t entry[MEMSIZ]; // Translated blocks, NULL if not found.
+    byte len[MEMSIZ];           // Length of the translated blocks.
+    int cost[MEMSIZ];           // Cycles taken by the blocks, 0 if unknown.
+};
+
+uint32_t
+hash_program(const struct machine_t* cpu)
+{
+    /* FNV-1a over the memory available to programs. */
+    uint32_t hash = 2166136261u;
+    for (int addr = 0x200; addr < MEMSIZ; addr++) {
+        hash = (hash ^ cpu->mem[addr]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Translator.
+ */
+
+/**
+ * Writes the C code for an instruction.
+ * @param pc address of the instruction.
+ * @return != 0 if the code sets the program counter.
+ */
+static int
+write_instr(FILE* out, const struct instr_t* in, address pc)
+{
+    int x = in->x, y = in->y, kk = in->kk;
+    int next = (pc + 2) & 0xFFF, skip = (pc + 4) & 0xFFF;
+
+    switch (in->opcode >> 12) {
+    case 0x0:
+        if (in->opcode != 0x00EE)
+            break;
+        fprintf(out, "    PC = SP > 0 ? STACK(--SP) : 0x%03X;\n", next);
+        return 1;
+    case 0x1:
+        fprintf(out, "    PC = 0x%03X;\n", in->nnn);
+        return 1;
+    case 0x2:
+        fprintf(out, "    if (SP < 16) {\n");
+        fprintf(out, "        STACK(SP++) = 0x%03X;\n", next);
+        fprintf(out, "        PC = 0x%03X;\n", in->nnn);
+        fprintf(out, "    } else {\n");
+        fprintf(out, "        PC = 0x%03X;\n", next);
+        fprintf(out, "    }\n");
+        return 1;
+    case 0x3:
+    case 0x4:
+        fprintf(out, "    PC = V(%d) %s 0x%02X ? 0x%03X : 0x%03X;\n", x,
+                in->opcode >> 12 == 0x3 ? "==" : "!=", kk, skip, next);
+        return 1;
+    case 0x5:
+    case 0x9:
+        fprintf(out, "    PC = V(%d) %s V(%d) ? 0x%03X : 0x%03X;\n", x,
+                in->opcode >> 12 == 0x5 ? "==" : "!=", y, skip, next);
+        return 1;
+    case 0x6:
+        fprintf(out, "    V(%d) = 0x%02X;\n", x, kk);
+        return 0;
+    case 0x7:
+        fprintf(out, "    V(%d) += 0x%02X;\n", x, kk);
+        return 0;
+    case 0x8:
+        /* Same statements as the handlers, so that VF is set alike. */
+        switch (in->n) {
+        case 0x0:
+            fprintf(out, "    V(%d) = V(%d);\n", x, y);
+            return 0;
+        case 0x1:
+            fprintf(out, "    V(%d) |= V(%d);\n", x, y);
+            return 0;
+        case 0x2:
+            fprintf(out, "    V(%d) &= V(%d);\n", x, y);
+            return 0;
+        case 0x3:
+            fprintf(out, "    V(%d) ^= V(%d);\n", x, y);
+            return 0;
+        case 0x4:
+            fprintf(out, "    V(15) = V(%d) > ((V(%d) + V(%d)) & 0xFF);\n",
+                    x, x, y);
+            fprintf(out, "    V(%d) += V(%d);\n", x, y);
+            return 0;
+        case 0x5:
+            fprintf(out, "    V(15) = V(%d) > V(%d);\n", x, y);
+            fprintf(out, "    V(%d) -= V(%d);\n", x, y);
+            return 0;
+        case 0x6:
+            fprintf(out, "    V(15) = V(%d) & 1;\n", x);
+            fprintf(out, "    V(%d) >>= 1;\n", x);
+            return 0;
+        case 0x7:
+            fprintf(out, "    V(15) = V(%d) > V(%d);\n", y, x);
+            fprintf(out, "    V(%d) = V(%d) - V(%d);\n", x, y, x);
+            return 0;
+        case 0xE:
+            fprintf(out, "    V(15) = (V(%d) & 0x80) != 0;\n", x);
+            fprintf(out, "    V(%d) <<= 1;\n", x);
+            return 0;
+        }
+        break;
+    case 0xA:
+        fprintf(out, "    I = 0x%03X;\n", in->nnn);
+        return 0;
+    case 0xF:
+        if (is_idle_loop(in))
+            break;
+        switch (kk) {
+        case 0x07:
+            fprintf(out, "    V(%d) = DT;\n", x);
+            return 0;
+        case 0x15:
+            fprintf(out, "    DT = V(%d);\n", x);
+            return 0;
+        case 0x18:
+            fprintf(out, "    ST = V(%d);\n", x);
+            return 0;
+        case 0x1E:
+            fprintf(out, "    I += V(%d);\n", x);
+            return 0;
+        case 0x29:
+            fprintf(out, "    I = 0x50 + (V(%d) & 0xF) * 5;\n", x);
+            return 0;
+        case 0x65:
+            for (int reg = 0; reg <= x; reg++) {
+                fprintf(out, "    V(%d) = MEM(I + %d);\n", reg, reg);
+            }
+            return 0;
+        }
+        break;
+    }
+
+    /* Anything else runs in the handler. */
+    fprintf(out, "    PC = 0x%03X;\n", next);
+    fprintf(out, "    handler(cpu, 0x%03X);\n", pc);
+    return 1;
+}
+
+/**
+ * Writes the C function for the block starting at the given address.
+ * @return the amount of instructions in the block.
+ */
+static int
+write_block(FILE* out, struct machine_t* cpu, address start)
+{
+    int len = build_block(cpu, start);
+    address pc = start;
+    int sets_pc = 0;
+    fprintf(out, "\nstatic void\nb%03X(byte* cpu, handler_t handler)\n{\n",
+            start);
+    for (int i = 0; i < len; i++, pc += 2) {
+        sets_pc = write_instr(out, &cpu->code[pc], pc);
+    }
+    if (!sets_pc) {
+        fprintf(out, "    PC = 0x%03X;\n", pc & 0xFFF);
+    }
+    fprintf(out, "}\n");
+    return len;
+}
+
+/**
+ * Adds to the work list the blocks that can follow the block that starts
+ * at the given address.
+ * @return the new amount of addresses in the work list.
+ */
+static int
+follow_block(struct machine_t* cpu, address start, int len,
+             address* work, int count, byte* seen)
+{
+    address last = start + 2 * (len - 1);
+    const struct instr_t* in = &cpu->code[last];
+    address next[2];
+    int targets = 0;
+
+    switch (in->opcode >> 12) {
+    case 0x0:
+        /* Returns go to the addresses that follow the calls. */
+        if (in->opcode != 0x00EE && in->opcode != 0x00FD)
+            next[targets++] = last + 2;
+        break;
+    case 0x1:
+        next[targets++] = in->nnn;
+        break;
+    case 0x2:
+        next[targets++] = in->nnn;
+        next[targets++] = last + 2;
+        break;
+    case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+        next[targets++] = last + 2;
+        next[targets++] = last + 4;
+        break;
+    case 0xB:
+        /* The target depends on V0, it is run by the interpreter. */
+        break;
+    default:
+        next[targets++] = last + 2;
+    }
+
+    for (int i = 0; i < targets; i++) {
+        address addr = next[i] & ADDRESS_MASK;
+        if (addr >= 0x200 && addr < ADDRESS_MASK && !seen[addr]) {
+            seen[addr] = 1;
+            work[count++] = addr;
+        }
+    }
+    return count;
+}
+
+int
+translate_program(struct machine_t* cpu, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return 1;
+
+    static const int offsets[] = {
+        offsetof(struct machine_t, v), offsetof(struct machine_t, mem),
+        offsetof(struct machine_t, pc), offsetof(struct machine_t, i),
+        offsetof(struct machine_t, sp), offsetof(struct machine_t, stack),
+        offsetof(struct machine_t, dt), offsetof(struct machine_t, st)
+    };
+    fprintf(out, "/* Generated by lib8 from a program with hash %08x. */\n\n",
+            hash_program(cpu));
+    fprintf(out, "typedef unsigned char byte;\n");
+    fprintf(out, "typedef unsigned short word;\n");
+    fprintf(out, "typedef void (*handler_t)(byte*, word);\n\n");
+    fprintf(out, "#define V(x) (cpu[%d + (x)])\n", offsets[0]);
+    fprintf(out, "#define MEM(a) (cpu[%d + ((a) & 0xFFF)])\n", offsets[1]);
+    fprintf(out, "#define PC (*(word*) (cpu + %d))\n", offsets[2]);
+    fprintf(out, "#define I (*(word*) (cpu + %d))\n", offsets[3]);
+    fprintf(out, "#define SP (*(char*) (cpu + %d))\n", offsets[4]);
+    fprintf(out, "#define STACK(n) (((word*) (cpu + %d))[(int) (n)])\n",
+            offsets[5]);
+    fprintf(out, "#define DT (cpu[%d])\n", offsets[6]);
+    fprintf(out, "#define ST (cpu[%d])\n", offsets[7]);
+
+    /* Walk the program, writing every block as soon as it is found. */
+    address work[MEMSIZ], starts[MEMSIZ];
+    byte lens[MEMSIZ], seen[MEMSIZ] = { 0 };
+    int count = 0, blocks = 0;
+    work[count++] = 0x200;
+    seen[0x200] = 1;
+    while (count > 0) {
+        address start = work[--count];
+        int len = write_block(out, cpu, start);
+        starts[blocks] = start;
+        lens[blocks++] = len;
+        count = follow_block(cpu, start, len, work, count, seen);
+    }
+
+    fprintf(out, "\nconst struct {\n");
+    fprintf(out, "    word start, len;\n");
+    fprintf(out, "    void (*run)(byte*, handler_t);\n");
+    fprintf(out, "} chip8_native_blocks[] = {\n");
+    for (int i = 0; i < blocks; i++) {
+        fprintf(out, "    { 0x%03X, %d, &b%03X },\n",
+                starts[i], lens[i], starts[i]);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const int chip8_native_count = %d;\n", blocks);
+    fprintf(out, "const unsigned chip8_native_hash = 0x%08xu;\n",
+            hash_program(cpu));
+    fprintf(out, "const unsigned chip8_native_version = %d;\n",
+            NATIVE_VERSION);
+    fprintf(out, "const unsigned chip8_native_machine = %d;\n",
+            (int) sizeof(struct machine_t));
+
+    return fclose(out) != 0;
+}
+
+/*
+ * Loader and engine.
+ */
+
+int
+load_native(struct machine_t* cpu, const char* path)
+{
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        return 1;
+
+    const unsigned* version = dlsym(handle, "chip8_native_version");
+    const unsigned* machine = dlsym(handle, "chip8_native_machine");
+    const unsigned* hash = dlsym(handle, "chip8_native_hash");
+    const int* count = dlsym(handle, "chip8_native_count");
+    const struct native_entry_t* blocks = dlsym(handle, "chip8_native_blocks");
+    if (version == NULL || machine == NULL || hash == NULL || count == NULL
+        || blocks == NULL || *version != NATIVE_VERSION
+        || *machine != sizeof(struct machine_t)
+        || *hash != hash_program(cpu)) {
+        dlclose(handle);
+        return 1;
+    }
+
+    struct native_t* native = calloc(1, sizeof(struct native_t));
+    if (native == NULL) {
+        dlclose(handle);
+        return 1;
+    }
+    native->handle = handle;
+    for (int i = 0; i < *count; i++) {
+        address start = blocks[i].start & ADDRESS_MASK;
+        native->entry[start] = blocks[i].run;
+        native->len[start] = blocks[i].len;
+    }
+    native_free(cpu);
+    cpu->native = native;
+    return 0;
+}
+
+int
+native_execute(struct machine_t* cpu, int max_cycles)
+{
+    struct native_t* native = cpu->native;
+    if (native == NULL)
+        return 0;
+
+    int retired = 0;
+    do {
+        address pc = cpu->pc & ADDRESS_MASK;
+        native_block_t entry = native->entry[pc];
+        if (entry == NULL) {
+            break;
+        }
+        if (native->cost[pc] == 0) {
+            native->cost[pc] = block_cost(cpu, pc, native->len[pc]);
+        }
+        if (native->cost[pc] > max_cycles - retired) {
+            /* It doesn't fit in the budget. */
+            break;
+        }
+        entry(cpu, &execute_at);
+        retired += native->cost[pc];
+    } while (retired < max_cycles && !must_stop(cpu));
+    return retired;
+}
+
+void
+native_invalidate(struct machine_t* cpu, address addr)
+{
+    struct native_t* native = cpu->native;
+    if (native == NULL)
+        return;
+    /* Blocks don't wrap around, so they start at most this far behind. */
+    for (int start = addr; start >= 0 && start > addr - 2 * BLOCK_MAX;
+         start--) {
+        if (native->entry[start] && start + 2 * native->len[start] > addr) {
+            native->entry[start] = NULL;
+        }
+    }
+}
+
+void
+native_free(struct machine_t* cpu)
+{
+    if (cpu->native != NULL) {
+        dlclose(cpu->native->handle);
+        free(cpu->native);
+        cpu->native = NULL;
+    }
+}
@@ -0,0 +1,420 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Pushes a job at the bottom of the deque of a worker, and wakes up a
+ * sleeping worker so that it can steal it. A deque never overflows,
+ * because a job is only in one deque at once.
+ */
+static void
+push_job(struct worker_t* worker, int job)
+{
+    struct scheduler_t* sched = worker->sched;
+    pthread_mutex_lock(&worker->lock);
+    worker->deque[worker->bottom & sched->mask] = job;
+    __atomic_store_n(&worker->bottom, worker->bottom + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+
+    /*
+     * Sleeping workers check queued after they announce themselves, and
+     * pushers check sleeping after they count the job, so either the
+     * sleeper sees the job or the pusher sees the sleeper.
+     */
+    __atomic_add_fetch(&sched->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+/** Takes the job queued last by a worker, or -1 if its deque is empty. */
+static int
+pop_job(struct worker_t* worker)
+{
+    int job = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->bottom != worker->top) {
+        __atomic_store_n(&worker->bottom, worker->bottom - 1,
+                         __ATOMIC_RELAXED);
+        job = worker->deque[worker->bottom & worker->sched->mask];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (job != -1) {
+        __atomic_sub_fetch(&worker->sched->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return job;
+}
+
+/**
+ * Steals the oldest job of another worker, starting at a random one so
+ * that thieves spread across the victims.
+ * @return the job, or -1 if every deque is empty.
+ */
+static int
+steal_job(struct worker_t* thief)
+{
+    struct scheduler_t* sched = thief->sched;
+    int count = sched->workers;
+    thief->random ^= thief->random << 13;
+    thief->random ^= thief->random >> 17;
+    thief->random ^= thief->random << 5;
+    int first = thief->random % count;
+    for (int n = 0; n < count; n++) {
+        struct worker_t* victim = &sched->worker[(first + n) % count];
+
+        /* Peeks without the lock, so that empty deques are skipped fast. */
+        if (victim == thief
+            || __atomic_load_n(&victim->bottom, __ATOMIC_RELAXED)
+               == __atomic_load_n(&victim->top, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        int job = -1;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom != victim->top) {
+            job = victim->deque[victim->top & sched->mask];
+            __atomic_store_n(&victim->top, victim->top + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (job != -1) {
+            __atomic_sub_fetch(&sched->queued, 1, __ATOMIC_SEQ_CST);
+            thief->steals++;
+            return job;
+        }
+    }
+    return -1;
+}
+
+/** Takes a job out of the active ones, waking up wait_scheduler. */
+static void
+retire_job(struct scheduler_t* sched, struct job_t* job, int state)
+{
+    pthread_mutex_lock(&sched->lock);
+    job->state = state;
+    if (--sched->active == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * Parks a job whose machine waits for a key, unless a key was sent to
+ * it while it was running.
+ * @return 1 if the job was parked, 0 if it can go on.
+ */
+static int
+park_job(struct scheduler_t* sched, struct job_t* job)
+{
+    pthread_mutex_lock(&sched->lock);
+    if (job->pending != -1) {
+        press_key(job->cpu, job->pending);
+        job->pending = -1;
+        pthread_mutex_unlock(&sched->lock);
+        return 0;
+    }
+    job->state = JOB_PARKED;
+    if (--sched->active == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return 1;
+}
+
+/**
+ * Runs a quantum of a job: whole frames until the quantum is spent, then
+ * the job goes back to the deque of the worker. A frame that waits for a
+ * key ends there, as the machine would do nothing else until the next one.
+ */
+static void
+run_quantum(struct worker_t* worker, int number)
+{
+    struct scheduler_t* sched = worker->sched;
+    struct job_t* job = &sched->jobs[number];
+    struct machine_t* cpu = job->cpu;
+    double start = now_seconds();
+    int spent = 0;
+
+    worker->quanta++;
+    while (spent < sched->quantum) {
+        if (job->left == 0) {
+            if (job->frame >= job->frames) {
+                job->seconds += now_seconds() - start;
+                retire_job(sched, job, JOB_DONE);
+                return;
+            }
+            if (job->on_frame) {
+                job->on_frame(cpu, job->frame, job->data);
+            }
+            tick_timers(cpu);
+            job->left = sched->speed;
+        }
+
+        int ran = run_machine(cpu, job->left);
+        spent += ran;
+        if (cpu->stop == STOP_DRAW || cpu->stop == STOP_BREAKPOINT) {
+            /* These end the quantum, but not the frame. */
+            job->left = ran < job->left ? job->left - ran : 0;
+            job->frame += job->left == 0;
+            break;
+        }
+        job->left = 0;
+        job->frame++;
+        if (cpu->stop == STOP_EXIT) {
+            job->seconds += now_seconds() - start;
+            retire_job(sched, job, JOB_DONE);
+            return;
+        }
+        if (cpu->stop == STOP_WAIT_KEY) {
+            /* Once parked, the job belongs to the host. */
+            double now = now_seconds();
+            job->seconds += now - start;
+            start = now;
+            if (park_job(sched, job)) {
+                return;
+            }
+        }
+    }
+    job->seconds += now_seconds() - start;
+    push_job(worker, number);
+}
+
+/** Worker thread: runs quanta of its jobs and steals when out of them. */
+static void*
+work(void* data)
+{
+    struct worker_t* worker = data;
+    struct scheduler_t* sched = worker->sched;
+
+    /* Waits until init_scheduler started every worker. */
+    pthread_mutex_lock(&sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+    for (;;) {
+        int job = pop_job(worker);
+        if (job == -1) {
+            job = steal_job(worker);
+        }
+        if (job != -1) {
+            run_quantum(worker, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        __atomic_add_fetch(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (!sched->stop
+               && __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&sched->work, &sched->lock);
+        }
+        __atomic_sub_fetch(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+        int stop = sched->stop;
+        pthread_mutex_unlock(&sched->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Makes a job active again and picks the worker to queue it on, taking
+ * the workers in turn. The lock of the scheduler must be held.
+ */
+static struct worker_t*
+activate_job(struct scheduler_t* sched, int job)
+{
+    sched->jobs[job].state = JOB_QUEUED;
+    sched->active++;
+    return &sched->worker[sched->next++ % sched->workers];
+}
+
+int
+init_scheduler(struct scheduler_t* sched, int workers, int capacity,
+               int speed, int quantum)
+{
+    memset(sched, 0, sizeof(struct scheduler_t));
+    sched->capacity = capacity;
+
+    /*
+     * Counters of the deques wrap around, so rings are a power of two
+     * long to keep every slot in order across the wrap.
+     */
+    unsigned ring = 1;
+    while (ring < (unsigned) capacity) {
+        ring <<= 1;
+    }
+    sched->mask = ring - 1;
+    sched->speed = speed;
+    sched->quantum = quantum;
+    sched->jobs = calloc(capacity, sizeof(struct job_t));
+    sched->worker = calloc(workers, sizeof(struct worker_t));
+    if (sched->jobs == NULL || sched->worker == NULL) {
+        free(sched->jobs);
+        free(sched->worker);
+        return -1;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    /* Deques are set up before any thread starts, as thieves scan them. */
+    for (int n = 0; n < workers; n++) {
+        struct worker_t* worker = &sched->worker[n];
+        worker->sched = sched;
+        worker->random = 2463534242u + n;
+        worker->deque = malloc(ring * sizeof(int));
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    pthread_mutex_lock(&sched->lock);
+    for (int n = 0; n < workers; n++) {
+        struct worker_t* worker = &sched->worker[n];
+        if (worker->deque == NULL
+            || pthread_create(&worker->thread, NULL, &work, worker)) {
+            break;
+        }
+        sched->workers++;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    for (int n = sched->workers; n < workers; n++) {
+        pthread_mutex_destroy(&sched->worker[n].lock);
+        free(sched->worker[n].deque);
+    }
+    if (sched->workers == 0) {
+        free_scheduler(sched);
+        return -1;
+    }
+    return 0;
+}
+
+void
+free_scheduler(struct scheduler_t* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = 1;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    for (int n = 0; n < sched->workers; n++) {
+        pthread_join(sched->worker[n].thread, NULL);
+    }
+
+    for (int n = 0; n < sched->workers; n++) {
+        pthread_mutex_destroy(&sched->worker[n].lock);
+        free(sched->worker[n].deque);
+    }
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->work);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->worker);
+    free(sched->jobs);
+    sched->worker = NULL;
+    sched->jobs = NULL;
+}
+
+int
+schedule_machine(struct scheduler_t* sched, struct machine_t* cpu,
+                 long frames, frame_handler_t on_frame, void* data)
+{
+    pthread_mutex_lock(&sched->lock);
+    if (sched->count == sched->capacity) {
+        pthread_mutex_unlock(&sched->lock);
+        return -1;
+    }
+    int number = sched->count++;
+    pthread_mutex_unlock(&sched->lock);
+
+    struct job_t* job = &sched->jobs[number];
+    job->cpu = cpu;
+    job->frames = frames;
+    job->pending = -1;
+    job->on_frame = on_frame;
+    job->data = data;
+    pthread_mutex_lock(&sched->lock);
+    struct worker_t* worker = activate_job(sched, number);
+    pthread_mutex_unlock(&sched->lock);
+    push_job(worker, number);
+    return number;
+}
+
+int
+wait_scheduler(struct scheduler_t* sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while (sched->active > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    int parked = 0;
+    for (int job = 0; job < sched->count; job++) {
+        parked += sched->jobs[job].state == JOB_PARKED;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return parked;
+}
+
+void
+send_key(struct scheduler_t* sched, int number, int key)
+{
+    struct job_t* job = &sched->jobs[number];
+    struct worker_t* worker = NULL;
+    pthread_mutex_lock(&sched->lock);
+    if (job->state == JOB_PARKED) {
+        press_key(job->cpu, key);
+        worker = activate_job(sched, number);
+    } else if (job->state != JOB_DONE) {
+        job->pending = key;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    if (worker) {
+        push_job(worker, number);
+    }
+}
+
+void
+resume_machine(struct scheduler_t* sched, int number, long frames)
+{
+    struct job_t* job = &sched->jobs[number];
+    struct worker_t* worker = NULL;
+    pthread_mutex_lock(&sched->lock);
+    if (job->state == JOB_PARKED) {
+        for (; frames > 0 && job->frame < job->frames; frames--) {
+            tick_timers(job->cpu);
+            job->frame++;
+        }
+        if (job->frame < job->frames) {
+            worker = activate_job(sched, number);
+        } else {
+            job->state = JOB_DONE;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    if (worker) {
+        push_job(worker, number);
+    }
+}
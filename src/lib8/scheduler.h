@@ -0,0 +1,151 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "cpu.h"
+#include <pthread.h>
+
+/*
+ * Scheduler for large fleets of machines. Each machine runs a given
+ * amount of frames in quanta, on a pool of worker threads. A quantum
+ * runs whole frames until it spends its cycles, the machine runs all
+ * its frames or exits, or it waits for a key. Every worker keeps a deque
+ * of the machines it has to run: it takes the last one it queued, so that
+ * a machine stays in the cache of the worker that ran it, and workers
+ * without machines steal the oldest one from the deque of other workers.
+ * Machines that wait for a key are parked out of the deques until the
+ * host sends a key or resumes them.
+ */
+
+/** Quantum used by default, in cycles. */
+#define DEFAULT_QUANTUM 4096
+
+/**
+ * Called before each frame that a machine runs, on the worker running
+ * it, with the number of the frame and the data given to
+ * schedule_machine. It can change the keypad or press keys.
+ */
+typedef void (*frame_handler_t)(struct machine_t* cpu, long frame,
+                                void* data);
+
+/** States of a job. */
+enum job_state_t
+{
+    JOB_QUEUED,                 // Queued or being run by a worker.
+    JOB_PARKED,                 // Waiting for a key, see send_key.
+    JOB_DONE                    // Ran every frame or exited.
+};
+
+/** A machine run by the scheduler. */
+struct job_t
+{
+    struct machine_t* cpu;      // Machine being run.
+    long frame;                 // Frames run so far.
+    long frames;                // Frames to run.
+    int left;                   // Cycles left in the frame, 0 between frames.
+    int state;                  // See job_state_t.
+    int pending;                // Key sent while not waiting, or -1.
+    frame_handler_t on_frame;   // Called before every frame, or NULL.
+    void* data;                 // Given to on_frame.
+    double seconds;             // Host time spent running the machine.
+};
+
+/** A worker thread and the deque of jobs it has to run. */
+struct worker_t
+{
+    struct scheduler_t* sched;  // Scheduler the worker belongs to.
+    pthread_t thread;           // Thread running the worker.
+    pthread_mutex_t lock;       // Guards the deque.
+    int* deque;                 // Ring of job numbers, see mask.
+    unsigned top, bottom;       // Thieves take from top, the owner from
+                                // bottom; both are stored atomically.
+    uint32_t random;            // State of the generator picking victims.
+    uint64_t quanta;            // Quanta run.
+    uint64_t steals;            // Jobs stolen from other workers.
+};
+
+/** Pool of workers running a fleet of jobs. */
+struct scheduler_t
+{
+    int workers;                // Worker threads started.
+    struct worker_t* worker;    // The workers.
+    int capacity;               // Most jobs that can be scheduled.
+    unsigned mask;              // Rings hold mask + 1 >= capacity jobs.
+    int count;                  // Jobs scheduled.
+    struct job_t* jobs;         // The jobs.
+    int speed;                  // Cycles run per frame.
+    int quantum;                // Cycles run before a job is queued again.
+
+    pthread_mutex_t lock;       // Guards the fields below and job states.
+    pthread_cond_t work;        // Signaled when jobs are queued.
+    pthread_cond_t idle;        // Signaled when no job is active.
+    int active;                 // Jobs queued or running.
+    int next;                   // Worker given the next job from the host.
+    int stop;                   // Workers have to exit.
+    int queued;                 // Jobs in the deques, updated atomically.
+    int sleeping;               // Workers waiting for jobs, same.
+};
+
+/**
+ * Starts a pool of worker threads.
+ * @param workers amount of worker threads.
+ * @param capacity most jobs that can be scheduled.
+ * @param speed cycles that each machine runs per frame.
+ * @param quantum cycles run by a job before it goes back to the deque.
+ * @return 0 if at least one worker started, -1 otherwise.
+ */
+int init_scheduler(struct scheduler_t* sched, int workers, int capacity,
+                   int speed, int quantum);
+
+/**
+ * Stops the workers and releases the scheduler. Jobs that didn't end
+ * are left as they are.
+ */
+void free_scheduler(struct scheduler_t* sched);
+
+/**
+ * Schedules a machine to run the given amount of frames. Before each
+ * frame, on_frame is called, if given, and the timers are ticked. The
+ * machine belongs to the scheduler until its job ends or is parked.
+ * @return the number of the job, or -1 if the scheduler is full.
+ */
+int schedule_machine(struct scheduler_t* sched, struct machine_t* cpu,
+                     long frames, frame_handler_t on_frame, void* data);
+
+/**
+ * Waits until every job either ended or is parked.
+ * @return the amount of parked jobs.
+ */
+int wait_scheduler(struct scheduler_t* sched);
+
+/**
+ * Sends a key to a job. If the job is parked, the key is pressed and the
+ * job is queued again; otherwise it is kept until the machine waits.
+ */
+void send_key(struct scheduler_t* sched, int job, int key);
+
+/**
+ * Queues a parked job again after the given amount of frames passed
+ * while it waited. Those frames only tick the timers. Until it is
+ * resumed, the host can use the machine, for instance to hold keys.
+ */
+void resume_machine(struct scheduler_t* sched, int job, long frames);
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,412 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Screen routines. The screen is stored one bit per pixel, with one word
+ * per row in low resolution mode and two words per row in extended screen
+ * mode, so sprites are drawn and scrolled a whole row at a time. Every
+ * routine is written once, taking the size of the screen as parameters,
+ * and it is specialised for each screen mode by calling it with constant
+ * sizes, so that the compiler can unroll the loops over the words of a
+ * row. The set of routines in use is chosen by the screen mode, which is
+ * changed by 00FE and 00FF.
+ *
+ * On x86-64 processors that have AVX2, as told by CPUID, the horizontal
+ * scrolls use vector kernels. The scalar routines are used otherwise; on
+ * SSE2 they are as fast as a vector kernel, since the compiler already
+ * vectorises them. Scrolling down and clearing are left to memmove and
+ * memset, which the C library already vectorises.
+ */
+
+#include "cpu.h"
+#include "engine.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCREEN_VECTOR
+#include <immintrin.h>
+#endif
+
+#define LOW_WIDTH 64
+#define LOW_HEIGHT 32
+#define HIGH_WIDTH 128
+#define HIGH_HEIGHT 64
+
+/** Amount of words used by each row of the screen. */
+#define ROW_WORDS(width) ((width) / 64)
+
+/** Leftmost pixels of a word, kept by scroll_right. */
+#define LEFT_PIXELS 0xF000000000000000ull
+
+/** Rightmost pixels of a word, kept by scroll_left. */
+#define RIGHT_PIXELS 0xFull
+
+#ifdef SCREEN_VECTOR
+
+/*
+ * AVX2 kernels for the horizontal scrolls. They work on the words of the
+ * whole screen, four low resolution rows or two extended mode rows per
+ * register. Each word is shifted by 4 pixels and keeps the pixels at the
+ * edge of the screen. In extended mode, each word also takes the pixels
+ * pushed out of the other word of its row. AVX2 byte shifts work on each
+ * half of the register, which holds a whole row.
+ */
+
+__attribute__((target("avx2"))) static void
+scroll_right_avx2(uint64_t* screen, int words, int count)
+{
+    __m256i* at = (__m256i*) screen;
+    if (words == 1) {
+        __m256i keep = _mm256_set1_epi64x(LEFT_PIXELS);
+        for (int i = 0; i < count / 4; i++) {
+            __m256i row = _mm256_loadu_si256(at + i);
+            row = _mm256_or_si256(_mm256_srli_epi64(row, 4),
+                                  _mm256_and_si256(row, keep));
+            _mm256_storeu_si256(at + i, row);
+        }
+    } else {
+        __m256i keep = _mm256_set_epi64x(0, LEFT_PIXELS, 0, LEFT_PIXELS);
+        for (int i = 0; i < count / 4; i++) {
+            __m256i row = _mm256_loadu_si256(at + i);
+            __m256i in = _mm256_slli_si256(_mm256_slli_epi64(row, 60), 8);
+            row = _mm256_or_si256(_mm256_or_si256(_mm256_srli_epi64(row, 4),
+                                                  in),
+                                  _mm256_and_si256(row, keep));
+            _mm256_storeu_si256(at + i, row);
+        }
+    }
+}
+
+__attribute__((target("avx2"))) static void
+scroll_left_avx2(uint64_t* screen, int words, int count)
+{
+    __m256i* at = (__m256i*) screen;
+    if (words == 1) {
+        __m256i keep = _mm256_set1_epi64x(RIGHT_PIXELS);
+        for (int i = 0; i < count / 4; i++) {
+            __m256i row = _mm256_loadu_si256(at + i);
+            row = _mm256_or_si256(_mm256_slli_epi64(row, 4),
+                                  _mm256_and_si256(row, keep));
+            _mm256_storeu_si256(at + i, row);
+        }
+    } else {
+        __m256i keep = _mm256_set_epi64x(RIGHT_PIXELS, 0, RIGHT_PIXELS, 0);
+        for (int i = 0; i < count / 4; i++) {
+            __m256i row = _mm256_loadu_si256(at + i);
+            __m256i in = _mm256_srli_si256(_mm256_srli_epi64(row, 60), 8);
+            row = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi64(row, 4),
+                                                  in),
+                                  _mm256_and_si256(row, keep));
+            _mm256_storeu_si256(at + i, row);
+        }
+    }
+}
+
+#endif
+
+/**
+ * Scrolls the screen down. Rows at the top of the screen are kept.
+ */
+static inline void
+scroll_down(struct machine_t* cpu, int n, int width, int height)
+{
+    int words = ROW_WORDS(width);
+    MARK_DIRTY(cpu, ALL_ROWS << n);
+    memmove(cpu->screen + n * words, cpu->screen,
+            (height - n) * words * sizeof(uint64_t));
+}
+
+/**
+ * Scrolls the screen 4 pixels to the right. Columns at the left of the
+ * screen are kept.
+ */
+static inline void
+scroll_right(struct machine_t* cpu, int width, int height)
+{
+    int words = ROW_WORDS(width);
+    MARK_DIRTY(cpu, ALL_ROWS);
+#ifdef SCREEN_VECTOR
+    if (__builtin_cpu_supports("avx2")) {
+        scroll_right_avx2(cpu->screen, words, words * height);
+        return;
+    }
+#endif
+    for (int y = 0; y < height; y++) {
+        uint64_t* row = cpu->screen + y * words;
+        /* Each word takes the pixels pushed out of the word at its left. */
+        for (int w = words - 1; w > 0; w--) {
+            row[w] = row[w] >> 4 | row[w - 1] << 60;
+        }
+        row[0] = row[0] >> 4 | (row[0] & LEFT_PIXELS);
+    }
+}
+
+/**
+ * Scrolls the screen 4 pixels to the left. Columns at the right of the
+ * screen are kept.
+ */
+static inline void
+scroll_left(struct machine_t* cpu, int width, int height)
+{
+    int words = ROW_WORDS(width);
+    MARK_DIRTY(cpu, ALL_ROWS);
+#ifdef SCREEN_VECTOR
+    if (__builtin_cpu_supports("avx2")) {
+        scroll_left_avx2(cpu->screen, words, words * height);
+        return;
+    }
+#endif
+    for (int y = 0; y < height; y++) {
+        uint64_t* row = cpu->screen + y * words;
+        int last = words - 1;
+        for (int w = 0; w < last; w++) {
+            row[w] = row[w] << 4 | row[w + 1] >> 60;
+        }
+        row[last] = row[last] << 4 | (row[last] & RIGHT_PIXELS);
+    }
+}
+
+/**
+ * XORs a row of a sprite into a row of the screen. The sprite is rotated
+ * into place, so that pixels out of the screen wrap around.
+ * @param bits row of the sprite, leftmost pixel in the most significant bit.
+ * @param x column of the leftmost pixel of the sprite.
+ * @return the pixels that were cleared.
+ */
+static inline uint64_t
+xor_row(uint64_t* row, uint64_t bits, int x, int width)
+{
+    if (width == 64) {
+        int shift = x & 63;
+        bits = bits >> shift | bits << ((64 - shift) & 63);
+        uint64_t collision = row[0] & bits;
+        row[0] ^= bits;
+        return collision;
+    }
+
+    /* Rotate the 128 pixels of the row, made of two words. */
+    uint64_t left = bits, right = 0;
+    if (x & 64) {
+        left = 0;
+        right = bits;
+    }
+    int shift = x & 63;
+    if (shift) {
+        uint64_t carry = left << (64 - shift);
+        left = left >> shift | right << (64 - shift);
+        right = right >> shift | carry;
+    }
+    uint64_t collision = (row[0] & left) | (row[1] & right);
+    row[0] ^= left;
+    row[1] ^= right;
+    return collision;
+}
+
+/**
+ * Draws a sprite that is 8 pixels wide and N rows tall. Pixels out of the
+ * screen wrap around.
+ * @return != 0 if any pixel was cleared.
+ */
+static inline int
+draw_sprite(struct machine_t* cpu, const struct instr_t* in,
+            int width, int height)
+{
+    byte x = cpu->v[in->x], y = cpu->v[in->y];
+    uint64_t collision = 0, rows = 0;
+    for (int j = 0; j < in->n; j++) {
+        uint64_t sprite = cpu->mem[(cpu->i + j) & ADDRESS_MASK];
+        int row = (y + j) & (height - 1);
+        collision |= xor_row(cpu->screen + row * ROW_WORDS(width),
+                             sprite << 56, x, width);
+        rows |= 1ull << row;
+    }
+    MARK_DIRTY(cpu, rows);
+    return collision != 0;
+}
+
+/**
+ * Draws a 16x16 sprite, made of 16 rows of 2 bytes each. These sprites
+ * are only available in extended screen mode.
+ * @return != 0 if any pixel was cleared.
+ */
+static int
+draw_sprite16(struct machine_t* cpu, const struct instr_t* in)
+{
+    byte x = cpu->v[in->x], y = cpu->v[in->y];
+    uint64_t collision = 0, rows = 0;
+    for (int j = 0; j < 16; j++) {
+        uint64_t hi = cpu->mem[(cpu->i + 2 * j) & ADDRESS_MASK];
+        uint64_t lo = cpu->mem[(cpu->i + 2 * j + 1) & ADDRESS_MASK];
+        int row = (y + j) & (HIGH_HEIGHT - 1);
+        collision |= xor_row(cpu->screen + row * ROW_WORDS(HIGH_WIDTH),
+                             hi << 56 | lo << 48, x, HIGH_WIDTH);
+        rows |= 1ull << row;
+    }
+    MARK_DIRTY(cpu, rows);
+    return collision != 0;
+}
+
+/*
+ * Low resolution mode, 64x32 pixels.
+ */
+
+static void
+low_scroll_down(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_down(cpu, in->n, LOW_WIDTH, LOW_HEIGHT);
+}
+
+static void
+low_scroll_right(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_right(cpu, LOW_WIDTH, LOW_HEIGHT);
+}
+
+static void
+low_scroll_left(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_left(cpu, LOW_WIDTH, LOW_HEIGHT);
+}
+
+static void
+low_draw(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* VF is cleared before reading the coordinates, as it may be one. */
+    cpu->v[15] = 0;
+    cpu->v[15] = draw_sprite(cpu, in, LOW_WIDTH, LOW_HEIGHT);
+}
+
+/*
+ * Extended screen mode, 128x64 pixels.
+ */
+
+static void
+high_scroll_down(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_down(cpu, in->n, HIGH_WIDTH, HIGH_HEIGHT);
+}
+
+static void
+high_scroll_right(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_right(cpu, HIGH_WIDTH, HIGH_HEIGHT);
+}
+
+static void
+high_scroll_left(struct machine_t* cpu, const struct instr_t* in)
+{
+    scroll_left(cpu, HIGH_WIDTH, HIGH_HEIGHT);
+}
+
+static void
+high_draw(struct machine_t* cpu, const struct instr_t* in)
+{
+    /* VF is cleared before reading the coordinates, as it may be one. */
+    cpu->v[15] = 0;
+    if (in->n == 0) {
+        cpu->v[15] = draw_sprite16(cpu, in);
+    } else {
+        cpu->v[15] = draw_sprite(cpu, in, HIGH_WIDTH, HIGH_HEIGHT);
+    }
+}
+
+const struct screen_mode_t screen_modes[2] = {
+    {
+        LOW_WIDTH, LOW_HEIGHT,
+        &low_scroll_down, &low_scroll_right, &low_scroll_left, &low_draw
+    },
+    {
+        HIGH_WIDTH, HIGH_HEIGHT,
+        &high_scroll_down, &high_scroll_right, &high_scroll_left, &high_draw
+    }
+};
+
+/*
+ * Screen helpers.
+ */
+
+/**
+ * Gets the word that holds a pixel.
+ * @param mask set to the bit of the pixel in the word.
+ */
+static uint64_t*
+pixel_word(struct machine_t* cpu, int row, int column, uint64_t* mask)
+{
+    int words = ROW_WORDS(SCREEN_MODE(cpu)->width);
+    *mask = 1ull << (63 - (column & 63));
+    return cpu->screen + row * words + column / 64;
+}
+
+void
+screen_fill_column(struct machine_t* cpu, int column)
+{
+    uint64_t mask;
+    for (int y = 0; y < SCREEN_MODE(cpu)->height; y++) {
+        *pixel_word(cpu, y, column, &mask) |= mask;
+    }
+    MARK_DIRTY(cpu, ALL_ROWS);
+}
+
+void
+screen_clear_column(struct machine_t* cpu, int column)
+{
+    uint64_t mask;
+    for (int y = 0; y < SCREEN_MODE(cpu)->height; y++) {
+        *pixel_word(cpu, y, column, &mask) &= ~mask;
+    }
+    MARK_DIRTY(cpu, ALL_ROWS);
+}
+
+void
+screen_fill_row(struct machine_t* cpu, int row)
+{
+    int words = ROW_WORDS(SCREEN_MODE(cpu)->width);
+    memset(cpu->screen + words * row, 0xFF, words * sizeof(uint64_t));
+    MARK_DIRTY(cpu, 1ull << row);
+}
+
+void
+screen_clear_row(struct machine_t* cpu, int row)
+{
+    int words = ROW_WORDS(SCREEN_MODE(cpu)->width);
+    memset(cpu->screen + words * row, 0, words * sizeof(uint64_t));
+    MARK_DIRTY(cpu, 1ull << row);
+}
+
+int
+screen_get_pixel(struct machine_t* cpu, int row, int column)
+{
+    uint64_t mask;
+    return (*pixel_word(cpu, row, column, &mask) & mask) != 0;
+}
+
+void
+screen_set_pixel(struct machine_t* cpu, int row, int column)
+{
+    uint64_t mask;
+    *pixel_word(cpu, row, column, &mask) |= mask;
+    MARK_DIRTY(cpu, 1ull << row);
+}
+
+void
+screen_clear_pixel(struct machine_t* cpu, int row, int column)
+{
+    uint64_t mask;
+    *pixel_word(cpu, row, column, &mask) &= ~mask;
+    MARK_DIRTY(cpu, 1ull << row);
+}
@@ -0,0 +1,1429 @@
+/*
+ * chip8 is a CHIP-8 emulator done in C
+ * Copyright (C) 2015-2016 Dani Rodríguez <danirod@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File: tests/engine.c
+ * Description: Unit test related to the execution engines.
+ */
+
+#include <check.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lib8/cpu.h>
+#include <lib8/lockstep.h>
+#include <lib8/scheduler.h>
+
+static struct machine_t cpu;
+
+static void
+setup_cpu(void)
+{
+    init_machine(&cpu);
+}
+
+static void
+teardown_cpu(void)
+{
+    free_machine(&cpu);
+}
+
+static TCase*
+setup_tcase(char* name)
+{
+    TCase* tcase = tcase_create(name);
+    tcase_add_checked_fixture(tcase, setup_cpu, teardown_cpu);
+    return tcase;
+}
+
+static void
+put_opcode(word opcode, address pos)
+{
+    cpu.mem[pos] = opcode >> 8;
+    cpu.mem[pos + 1] = opcode & 0xFF;
+}
+
+/* Counts from 0 to 10 in V[0] and then exits. */
+static void
+put_counter(void)
+{
+    put_opcode(0x6000, 0x200);
+    put_opcode(0x7001, 0x202);
+    put_opcode(0x300A, 0x204);
+    put_opcode(0x1202, 0x206);
+    put_opcode(0x00FD, 0x208);
+}
+
+static void
+check_counter(int engine)
+{
+    cpu.engine = engine;
+    put_counter();
+    ck_assert_int_eq(31, run_machine(&cpu, 1000));
+    ck_assert_int_eq(10, cpu.v[0]);
+    ck_assert_int_eq(0x20A, cpu.pc);
+    ck_assert_int_ne(0, cpu.exit);
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+}
+
+START_TEST(test_run_interpreter)
+{
+    check_counter(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_run_threaded)
+{
+    check_counter(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_run_jit)
+{
+    check_counter(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_run()
+{
+    TCase* tcase = setup_tcase("Run");
+    tcase_add_test(tcase, test_run_interpreter);
+    tcase_add_test(tcase, test_run_threaded);
+    tcase_add_test(tcase, test_run_jit);
+    return tcase;
+}
+
+static void
+check_budget(int engine)
+{
+    cpu.engine = engine;
+    put_counter();
+    /* Budget ends in the middle of the block at 0x200. */
+    ck_assert_int_eq(2, run_machine(&cpu, 2));
+    ck_assert_int_eq(STOP_BUDGET, cpu.stop);
+    ck_assert_int_eq(0x204, cpu.pc);
+    ck_assert_int_eq(1, cpu.v[0]);
+    ck_assert_int_eq(4, run_machine(&cpu, 4));
+    ck_assert_int_eq(0x206, cpu.pc);
+    ck_assert_int_eq(2, cpu.v[0]);
+}
+
+START_TEST(test_budget_interpreter)
+{
+    check_budget(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_budget_threaded)
+{
+    check_budget(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_budget_jit)
+{
+    check_budget(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_budget()
+{
+    TCase* tcase = setup_tcase("Budget");
+    tcase_add_test(tcase, test_budget_interpreter);
+    tcase_add_test(tcase, test_budget_threaded);
+    tcase_add_test(tcase, test_budget_jit);
+    return tcase;
+}
+
+static int
+mock_poller(char key)
+{
+    return key == 2;
+}
+
+static int
+mock_poller_none(char key)
+{
+    return 0;
+}
+
+static void
+check_wait_key(int engine)
+{
+    cpu.engine = engine;
+    cpu.keydown = &mock_poller_none;
+    put_opcode(0x6001, 0x200);
+    put_opcode(0xF30A, 0x202);
+    put_opcode(0x6104, 0x204);
+    ck_assert_int_eq(2, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_WAIT_KEY, cpu.stop);
+    ck_assert_int_eq(0, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_WAIT_KEY, cpu.stop);
+    ck_assert_int_eq(0, cpu.v[1]);
+    cpu.keydown = &mock_poller;
+    ck_assert_int_eq(1, run_machine(&cpu, 1));
+    ck_assert_int_eq(2, cpu.v[3]);
+    ck_assert_int_eq(4, cpu.v[1]);
+}
+
+START_TEST(test_wait_key_interpreter)
+{
+    check_wait_key(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_wait_key_threaded)
+{
+    check_wait_key(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_wait_key_jit)
+{
+    check_wait_key(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_wait_key()
+{
+    TCase* tcase = setup_tcase("Wait key");
+    tcase_add_test(tcase, test_wait_key_interpreter);
+    tcase_add_test(tcase, test_wait_key_threaded);
+    tcase_add_test(tcase, test_wait_key_jit);
+    return tcase;
+}
+
+/* Without a keyboard poller, keys are given by the host. */
+static void
+check_press_key(int engine)
+{
+    cpu.engine = engine;
+    put_opcode(0xF30A, 0x200);
+    put_opcode(0x6104, 0x202);
+    put_opcode(0x00FD, 0x204);
+    ck_assert_int_eq(1, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_WAIT_KEY, cpu.stop);
+    ck_assert_int_eq(0, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_WAIT_KEY, cpu.stop);
+    press_key(&cpu, 0xB);
+    ck_assert_int_eq(2, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(0xB, cpu.v[3]);
+    ck_assert_int_eq(4, cpu.v[1]);
+}
+
+START_TEST(test_press_key_interpreter)
+{
+    check_press_key(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_press_key_threaded)
+{
+    check_press_key(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_press_key_jit)
+{
+    check_press_key(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_press_key()
+{
+    TCase* tcase = setup_tcase("Press key");
+    tcase_add_test(tcase, test_press_key_interpreter);
+    tcase_add_test(tcase, test_press_key_threaded);
+    tcase_add_test(tcase, test_press_key_jit);
+    return tcase;
+}
+
+/* Checks key 5 and then waits for a key, using the keypad. */
+static void
+put_keypad_test(void)
+{
+    put_opcode(0x6005, 0x200);
+    put_opcode(0xE09E, 0x202);
+    put_opcode(0x6101, 0x204);
+    put_opcode(0xE0A1, 0x206);
+    put_opcode(0x6201, 0x208);
+    put_opcode(0xF30A, 0x20A);
+    put_opcode(0x00FD, 0x20C);
+}
+
+static void
+check_keypad(int engine)
+{
+    cpu.engine = engine;
+    cpu.keypad = 1 << 5;
+    put_keypad_test();
+    run_machine(&cpu, 100);
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(0, cpu.v[1]);
+    ck_assert_int_eq(1, cpu.v[2]);
+    ck_assert_int_eq(5, cpu.v[3]);
+
+    free_machine(&cpu);
+    init_machine(&cpu);
+    cpu.engine = engine;
+    put_keypad_test();
+    run_machine(&cpu, 100);
+    ck_assert_int_eq(STOP_WAIT_KEY, cpu.stop);
+    ck_assert_int_eq(1, cpu.v[1]);
+    ck_assert_int_eq(0, cpu.v[2]);
+    cpu.keypad = 1 << 9 | 1 << 12;
+    run_machine(&cpu, 100);
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(9, cpu.v[3]);
+}
+
+START_TEST(test_keypad_interpreter)
+{
+    check_keypad(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_keypad_threaded)
+{
+    check_keypad(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_keypad_jit)
+{
+    check_keypad(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_keypad()
+{
+    TCase* tcase = setup_tcase("Keypad");
+    tcase_add_test(tcase, test_keypad_interpreter);
+    tcase_add_test(tcase, test_keypad_threaded);
+    tcase_add_test(tcase, test_keypad_jit);
+    return tcase;
+}
+
+/* Draws the sprite for 0 in a loop. */
+static void
+put_draw_loop(void)
+{
+    put_opcode(0x6000, 0x200);
+    put_opcode(0xA050, 0x202);
+    put_opcode(0xD005, 0x204);
+    put_opcode(0x7001, 0x206);
+    put_opcode(0x1204, 0x208);
+}
+
+static void
+check_draw(int engine)
+{
+    cpu.engine = engine;
+    put_draw_loop();
+    ck_assert_int_eq(10, run_machine(&cpu, 10));
+    ck_assert_int_eq(STOP_BUDGET, cpu.stop);
+    ck_assert_int_ne(0, cpu.drawn);
+
+    free_machine(&cpu);
+    init_machine(&cpu);
+    cpu.engine = engine;
+    cpu.stop_on_draw = 1;
+    put_draw_loop();
+    ck_assert_int_eq(3, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_DRAW, cpu.stop);
+    ck_assert_int_eq(0x206, cpu.pc);
+    ck_assert_int_eq(3, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_DRAW, cpu.stop);
+    ck_assert_int_eq(0x206, cpu.pc);
+    ck_assert_int_eq(1, cpu.v[0]);
+}
+
+START_TEST(test_draw_interpreter)
+{
+    check_draw(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_draw_threaded)
+{
+    check_draw(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_draw_jit)
+{
+    check_draw(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_draw()
+{
+    TCase* tcase = setup_tcase("Draw");
+    tcase_add_test(tcase, test_draw_interpreter);
+    tcase_add_test(tcase, test_draw_threaded);
+    tcase_add_test(tcase, test_draw_jit);
+    return tcase;
+}
+
+static void
+check_breakpoint(int engine)
+{
+    cpu.engine = engine;
+    put_counter();
+    set_breakpoint(&cpu, 0x204, 1);
+    ck_assert_int_eq(2, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_BREAKPOINT, cpu.stop);
+    ck_assert_int_eq(0x204, cpu.pc);
+
+    /* Resuming runs the instruction at the breakpoint. */
+    ck_assert_int_eq(3, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_BREAKPOINT, cpu.stop);
+    ck_assert_int_eq(0x204, cpu.pc);
+    ck_assert_int_eq(2, cpu.v[0]);
+
+    set_breakpoint(&cpu, 0x204, 0);
+    ck_assert_int_eq(26, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(10, cpu.v[0]);
+}
+
+START_TEST(test_breakpoint_interpreter)
+{
+    check_breakpoint(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_breakpoint_threaded)
+{
+    check_breakpoint(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_breakpoint_jit)
+{
+    check_breakpoint(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_breakpoint()
+{
+    TCase* tcase = setup_tcase("Breakpoint");
+    tcase_add_test(tcase, test_breakpoint_interpreter);
+    tcase_add_test(tcase, test_breakpoint_threaded);
+    tcase_add_test(tcase, test_breakpoint_jit);
+    return tcase;
+}
+
+/* Waits for DT to reach 0 and then exits. */
+static void
+check_idle(int engine)
+{
+    cpu.engine = engine;
+    put_opcode(0xF507, 0x200);
+    put_opcode(0x3500, 0x202);
+    put_opcode(0x1200, 0x204);
+    put_opcode(0x00FD, 0x206);
+    cpu.dt = 3;
+
+    /* The program counter must end where running the loop leaves it. */
+    ck_assert_int_eq(1000, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_IDLE, cpu.stop);
+    ck_assert_int_eq(0x202, cpu.pc);
+    ck_assert_int_eq(3, cpu.v[5]);
+    ck_assert_int_eq(1000, run_machine(&cpu, 1000));
+    ck_assert_int_eq(0x204, cpu.pc);
+    ck_assert_int_eq(1000, run_machine(&cpu, 1000));
+    ck_assert_int_eq(0x200, cpu.pc);
+
+    cpu.dt = 0;
+    ck_assert_int_eq(3, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(0, cpu.v[5]);
+}
+
+START_TEST(test_idle_interpreter)
+{
+    check_idle(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_idle_threaded)
+{
+    check_idle(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_idle_jit)
+{
+    check_idle(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_idle()
+{
+    TCase* tcase = setup_tcase("Idle loop");
+    tcase_add_test(tcase, test_idle_interpreter);
+    tcase_add_test(tcase, test_idle_threaded);
+    tcase_add_test(tcase, test_idle_jit);
+    return tcase;
+}
+
+/* Overwrites an instruction that has already been executed. */
+static void
+check_self_modifying(int engine)
+{
+    cpu.engine = engine;
+    put_opcode(0xA208, 0x200);
+    put_opcode(0x6062, 0x202);
+    put_opcode(0x6155, 0x204);
+    put_opcode(0xF155, 0x206);
+    put_opcode(0x6211, 0x208);
+    put_opcode(0x00FD, 0x20A);
+
+    cpu.pc = 0x208;
+    ck_assert_int_eq(1, run_machine(&cpu, 1));
+    ck_assert_int_eq(0x11, cpu.v[2]);
+
+    cpu.pc = 0x200;
+    ck_assert_int_eq(6, run_machine(&cpu, 100));
+    ck_assert_int_eq(0x55, cpu.v[2]);
+}
+
+/*
+ * Overwrites a block that other blocks jump to, once every block was run,
+ * so engines that link blocks have to undo the links.
+ */
+static void
+check_self_modifying_linked(int engine)
+{
+    cpu.engine = engine;
+    put_opcode(0x7201, 0x200);
+    put_opcode(0x120C, 0x202);
+    put_opcode(0x7101, 0x20C);
+    put_opcode(0x1200, 0x20E);
+    put_opcode(0xA20D, 0x210);
+    put_opcode(0x6005, 0x212);
+    put_opcode(0xF055, 0x214);
+    put_opcode(0x1200, 0x216);
+
+    cpu.pc = 0x200;
+    ck_assert_int_eq(8, run_machine(&cpu, 8));
+    ck_assert_int_eq(2, cpu.v[1]);
+
+    /* 7101 becomes 7105. */
+    cpu.pc = 0x210;
+    ck_assert_int_eq(8, run_machine(&cpu, 8));
+    ck_assert_int_eq(3, cpu.v[2]);
+    ck_assert_int_eq(7, cpu.v[1]);
+    ck_assert_int_eq(0x200, cpu.pc);
+}
+
+/*
+ * Rewrites a block of the largest instructions on every pass, so that it
+ * is translated again until the JIT runs out of space and starts over.
+ */
+static void
+check_self_modifying_largest(int engine)
+{
+    cpu.engine = engine;
+    for (address pos = 0x200; pos < 0x27E; pos += 2) {
+        put_opcode(0xFF65, pos);
+    }
+    put_opcode(0x1300, 0x27E);
+    put_opcode(0x60FF, 0x300);
+    put_opcode(0xA202, 0x302);
+    put_opcode(0xF055, 0x304);
+    put_opcode(0x1200, 0x306);
+
+    struct machine_t* interpreter = malloc(sizeof(struct machine_t));
+    init_machine(interpreter);
+    memcpy(interpreter->mem, cpu.mem, MEMSIZ);
+    ck_assert_int_eq(100000, run_machine(&cpu, 100000));
+    ck_assert_int_eq(100000, run_machine(interpreter, 100000));
+    ck_assert(hash_state(&cpu) == hash_state(interpreter));
+    free_machine(interpreter);
+    free(interpreter);
+}
+
+START_TEST(test_self_modifying_interpreter)
+{
+    check_self_modifying(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_self_modifying_threaded)
+{
+    check_self_modifying(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_self_modifying_jit)
+{
+    check_self_modifying(ENGINE_JIT);
+}
+END_TEST
+
+START_TEST(test_self_modifying_linked_threaded)
+{
+    check_self_modifying_linked(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_self_modifying_linked_jit)
+{
+    check_self_modifying_linked(ENGINE_JIT);
+}
+END_TEST
+
+START_TEST(test_self_modifying_largest_threaded)
+{
+    check_self_modifying_largest(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_self_modifying_largest_jit)
+{
+    check_self_modifying_largest(ENGINE_JIT);
+}
+END_TEST
+
+static TCase*
+tcase_self_modifying()
+{
+    TCase* tcase = setup_tcase("Self modifying");
+    tcase_add_test(tcase, test_self_modifying_interpreter);
+    tcase_add_test(tcase, test_self_modifying_threaded);
+    tcase_add_test(tcase, test_self_modifying_jit);
+    tcase_add_test(tcase, test_self_modifying_linked_threaded);
+    tcase_add_test(tcase, test_self_modifying_linked_jit);
+    tcase_add_test(tcase, test_self_modifying_largest_threaded);
+    tcase_add_test(tcase, test_self_modifying_largest_jit);
+    return tcase;
+}
+
+/*
+ * Arithmetic opcodes must set the same registers and flags everywhere.
+ * When known is set the operands are loaded by the program, so that the
+ * JIT folds them.
+ */
+static void
+check_alu(int known)
+{
+    static const byte values[] = { 0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF };
+    static const byte regs[][2] = { { 1, 2 }, { 3, 3 }, { 15, 4 }, { 5, 15 } };
+    static const byte ops[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+    struct machine_t* jit = malloc(sizeof(struct machine_t));
+    for (int op = 0; op < sizeof(ops); op++) {
+        for (int r = 0; r < 4; r++) {
+            for (int a = 0; a < 6; a++) {
+                for (int b = 0; b < 6; b++) {
+                    byte x = regs[r][0], y = regs[r][1];
+                    word opcode = 0x8000 | x << 8 | y << 4 | ops[op];
+                    init_machine(&cpu);
+                    if (known) {
+                        put_opcode(0x6000 | x << 8 | values[a], 0x200);
+                        put_opcode(0x6000 | y << 8 | values[b], 0x202);
+                    } else {
+                        put_opcode(0x7000, 0x200);
+                        put_opcode(0x7000, 0x202);
+                        cpu.v[x] = values[a];
+                        cpu.v[y] = values[b];
+                    }
+                    put_opcode(opcode, 0x204);
+                    put_opcode(0x7101, 0x206);
+                    put_opcode(0x00FD, 0x208);
+                    memcpy(jit, &cpu, sizeof(struct machine_t));
+                    jit->engine = ENGINE_JIT;
+                    run_machine(&cpu, 10);
+                    run_machine(jit, 10);
+                    for (int v = 0; v < 16; v++) {
+                        ck_assert_int_eq(cpu.v[v], jit->v[v]);
+                    }
+                    free_machine(jit);
+                }
+            }
+        }
+    }
+    free(jit);
+}
+
+START_TEST(test_alu_jit)
+{
+    check_alu(0);
+}
+END_TEST
+
+START_TEST(test_alu_known_jit)
+{
+    check_alu(1);
+}
+END_TEST
+
+/*
+ * FX65 must read the same registers everywhere, for every X and for an I
+ * that wraps around the memory. When known is set I is loaded by the
+ * program, so that the JIT reads the addresses directly.
+ */
+static void
+check_load_regs(int known)
+{
+    static const word starts[] = { 0x300, 0x301, 0xFF8, 0xFFF };
+    struct machine_t* jit = malloc(sizeof(struct machine_t));
+    for (int s = 0; s < 4; s++) {
+        for (int x = 0; x < 16; x++) {
+            init_machine(&cpu);
+            for (int pos = 0; pos < 16; pos++) {
+                cpu.mem[(starts[s] + pos) & 0xFFF] = 0x11 * pos + 1;
+            }
+            if (known) {
+                put_opcode(0xA000 | starts[s], 0x200);
+            } else {
+                put_opcode(0x7000, 0x200);
+                cpu.i = starts[s];
+            }
+            put_opcode(0xF065 | x << 8, 0x202);
+            put_opcode(0x00FD, 0x204);
+            memcpy(jit, &cpu, sizeof(struct machine_t));
+            jit->engine = ENGINE_JIT;
+            run_machine(&cpu, 10);
+            run_machine(jit, 10);
+            for (int v = 0; v < 16; v++) {
+                ck_assert_int_eq(cpu.v[v], jit->v[v]);
+            }
+            free_machine(jit);
+        }
+    }
+    free(jit);
+}
+
+START_TEST(test_load_regs_jit)
+{
+    check_load_regs(0);
+}
+END_TEST
+
+START_TEST(test_load_regs_known_jit)
+{
+    check_load_regs(1);
+}
+END_TEST
+
+/* Flags that are overwritten before being read are not computed. */
+START_TEST(test_dead_flags_jit)
+{
+    put_opcode(0x6105, 0x200);  // LD V1, 5
+    put_opcode(0xA300, 0x202);  // LD I, 300
+    put_opcode(0xF11E, 0x204);  // ADD I, V1
+    put_opcode(0x8124, 0x206);  // ADD V1, V2
+    put_opcode(0x8126, 0x208);  // SHR V1
+    put_opcode(0x8125, 0x20A);  // SUB V1, V2
+    put_opcode(0x8F20, 0x20C);  // LD VF, V2
+    put_opcode(0x00FD, 0x20E);  // EXIT
+    cpu.v[2] = 0xFE;
+    cpu.engine = ENGINE_JIT;
+    ck_assert_int_eq(8, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(0x305, cpu.i);
+    ck_assert_int_eq(0x03, cpu.v[1]);
+    ck_assert_int_eq(0xFE, cpu.v[15]);
+}
+END_TEST
+
+/*
+ * Translates the program in memory ahead of time, compiles it and loads
+ * it into the machine, which is set to use the native engine.
+ */
+static void
+load_translated(const char* name)
+{
+    char command[256], path[64];
+    snprintf(path, sizeof(path), "%s.c", name);
+    ck_assert_int_eq(0, translate_program(&cpu, path));
+    snprintf(command, sizeof(command),
+             "${CC:-cc} -shared -fPIC -o %s.so %s.c", name, name);
+    ck_assert_int_eq(0, system(command));
+    snprintf(path, sizeof(path), "./%s.so", name);
+    ck_assert_int_eq(0, load_native(&cpu, path));
+    cpu.engine = ENGINE_NATIVE;
+}
+
+START_TEST(test_native_run)
+{
+    put_counter();
+    load_translated("native_run");
+    ck_assert_int_eq(31, run_machine(&cpu, 1000));
+    ck_assert_int_eq(10, cpu.v[0]);
+    ck_assert_int_eq(0x20A, cpu.pc);
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+}
+END_TEST
+
+START_TEST(test_native_budget)
+{
+    put_counter();
+    load_translated("native_budget");
+    ck_assert_int_eq(2, run_machine(&cpu, 2));
+    ck_assert_int_eq(STOP_BUDGET, cpu.stop);
+    ck_assert_int_eq(0x204, cpu.pc);
+    ck_assert_int_eq(1, cpu.v[0]);
+    ck_assert_int_eq(4, run_machine(&cpu, 4));
+    ck_assert_int_eq(0x206, cpu.pc);
+    ck_assert_int_eq(2, cpu.v[0]);
+}
+END_TEST
+
+/* Code reached by BNNN was not translated and runs in the interpreter. */
+START_TEST(test_native_untranslated)
+{
+    put_opcode(0x6004, 0x200);  // LD V0, 4
+    put_opcode(0xB300, 0x202);  // JP V0, 300
+    put_opcode(0x6107, 0x304);  // LD V1, 7
+    put_opcode(0x00FD, 0x306);  // EXIT
+    load_translated("native_untranslated");
+    ck_assert_int_eq(4, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(7, cpu.v[1]);
+}
+END_TEST
+
+/* Blocks that are overwritten are not run anymore. */
+START_TEST(test_native_self_modifying)
+{
+    put_opcode(0x6060, 0x200);  // LD V0, 60
+    put_opcode(0x6105, 0x202);  // LD V1, 5
+    put_opcode(0xA20A, 0x204);  // LD I, 20A
+    put_opcode(0xF155, 0x206);  // LD [I], V1
+    put_opcode(0x120A, 0x208);  // JP 20A
+    put_opcode(0x00FD, 0x20A);  // EXIT, becomes LD V0, 5
+    put_opcode(0x00FD, 0x20C);  // EXIT
+    load_translated("native_self_modifying");
+    ck_assert_int_eq(7, run_machine(&cpu, 100));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(5, cpu.v[0]);
+}
+END_TEST
+
+/* Shared objects are only loaded into machines with the same program. */
+START_TEST(test_native_other_program)
+{
+    put_counter();
+    ck_assert_int_eq(0, translate_program(&cpu, "native_other.c"));
+    ck_assert_int_eq(0, system("${CC:-cc} -shared -fPIC "
+                               "-o native_other.so native_other.c"));
+    put_opcode(0x7002, 0x202);
+    ck_assert_int_ne(0, load_native(&cpu, "./native_other.so"));
+}
+END_TEST
+
+/* Timers must tick 60 times per second, even if 1000 / 60 is not whole. */
+START_TEST(test_update_time)
+{
+    cpu.dt = 200;
+    for (int ms = 0; ms < 1000; ms++) {
+        update_time(&cpu, 1);
+    }
+    ck_assert_int_eq(140, cpu.dt);
+    update_time(&cpu, 3000);
+    ck_assert_int_eq(0, cpu.dt);
+}
+END_TEST
+
+/* Machines keep their own state, so running one doesn't change another. */
+START_TEST(test_machines_independent)
+{
+    struct machine_t* other = malloc(sizeof(struct machine_t));
+    init_machine(other);
+    cpu.dt = other->dt = 200;
+    for (int ms = 0; ms < 1000; ms++) {
+        update_time(&cpu, 1);
+        update_time(other, 1);
+    }
+    ck_assert_int_eq(140, cpu.dt);
+    ck_assert_int_eq(140, other->dt);
+
+    /* Both run CXFF from the same state, interleaved. */
+    put_opcode(0xC1FF, 0x200);
+    memcpy(other->mem, cpu.mem, MEMSIZ);
+    for (int i = 0; i < 16; i++) {
+        cpu.pc = other->pc = 0x200;
+        step_machine(&cpu);
+        step_machine(other);
+        ck_assert_int_eq(cpu.v[1], other->v[1]);
+    }
+    free_machine(other);
+    free(other);
+}
+END_TEST
+
+/* Machines in the same state hash the same, whatever engine ran them. */
+START_TEST(test_hash_state)
+{
+    struct machine_t* other = malloc(sizeof(struct machine_t));
+    init_machine(other);
+    ck_assert(hash_state(&cpu) == hash_state(other));
+
+    put_opcode(0x6105, 0x200);
+    put_opcode(0x1200, 0x202);
+    memcpy(other->mem, cpu.mem, MEMSIZ);
+    uint32_t loaded = hash_state(&cpu);
+    ck_assert(loaded == hash_state(other));
+
+    other->engine = ENGINE_THREADED;
+    run_machine(&cpu, 10);
+    run_machine(other, 10);
+    ck_assert(loaded != hash_state(&cpu));
+    ck_assert(hash_state(&cpu) == hash_state(other));
+
+    other->v[1]++;
+    ck_assert(hash_state(&cpu) != hash_state(other));
+    free_machine(other);
+    free(other);
+}
+END_TEST
+
+static int speaker_state = -1;
+
+static void
+mock_speaker(int enabled)
+{
+    speaker_state = enabled;
+}
+
+START_TEST(test_tick_timers)
+{
+    cpu.speaker = &mock_speaker;
+    cpu.dt = 1;
+    cpu.st = 2;
+    tick_timers(&cpu);
+    ck_assert_int_eq(0, cpu.dt);
+    ck_assert_int_eq(1, speaker_state);
+    tick_timers(&cpu);
+    ck_assert_int_eq(0, cpu.dt);
+    ck_assert_int_eq(0, cpu.st);
+    ck_assert_int_eq(0, speaker_state);
+}
+END_TEST
+
+/*
+ * In the VIP profile the counter takes 46 cycles for 6000, 10 times 50
+ * for 7001 and 300A, 9 times 52 for 1202 and 40 for 00FD.
+ */
+#define COUNTER_VIP_CYCLES 1554
+
+static void
+check_timing(int engine)
+{
+    cpu.engine = engine;
+    cpu.timing = TIMING_VIP;
+    put_counter();
+    ck_assert_int_eq(COUNTER_VIP_CYCLES, run_machine(&cpu, 100000));
+    ck_assert_int_eq(STOP_EXIT, cpu.stop);
+    ck_assert_int_eq(10, cpu.v[0]);
+    ck_assert(cpu.cycles == COUNTER_VIP_CYCLES);
+}
+
+/*
+ * Small budgets cut blocks, and the cycles run past each budget are taken
+ * from the next one, so every engine stops at the same places.
+ */
+static void
+check_timing_budget(int engine)
+{
+    static const address pcs[] = {
+        0x204, 0x206, 0x202, 0x204, 0x202, 0x204, 0x206, 0x202
+    };
+    cpu.engine = engine;
+    cpu.timing = TIMING_VIP;
+    put_counter();
+    int total = 0;
+    for (int i = 0; i < 8; i++) {
+        total += run_machine(&cpu, 60);
+        ck_assert_int_eq(STOP_BUDGET, cpu.stop);
+        ck_assert_int_eq(pcs[i], cpu.pc);
+        ck_assert_int_eq(total - 60 * (i + 1), cpu.overrun);
+        ck_assert_int_lt(cpu.overrun, 52);
+    }
+    while (cpu.stop != STOP_EXIT) {
+        total += run_machine(&cpu, 60);
+    }
+    ck_assert_int_eq(COUNTER_VIP_CYCLES, total);
+}
+
+START_TEST(test_timing_interpreter)
+{
+    check_timing(ENGINE_INTERPRETER);
+    init_machine(&cpu);
+    check_timing_budget(ENGINE_INTERPRETER);
+}
+END_TEST
+
+START_TEST(test_timing_threaded)
+{
+    check_timing(ENGINE_THREADED);
+    init_machine(&cpu);
+    check_timing_budget(ENGINE_THREADED);
+}
+END_TEST
+
+START_TEST(test_timing_jit)
+{
+    check_timing(ENGINE_JIT);
+    free_machine(&cpu);
+    init_machine(&cpu);
+    check_timing_budget(ENGINE_JIT);
+}
+END_TEST
+
+START_TEST(test_timing_native)
+{
+    /* Translating the program decodes it, so the profile is set first. */
+    cpu.timing = TIMING_VIP;
+    put_counter();
+    load_translated("native_timing");
+    check_timing(ENGINE_NATIVE);
+}
+END_TEST
+
+/* The idle loop is skipped in whole cycles of the VIP profile. */
+START_TEST(test_timing_idle)
+{
+    cpu.timing = TIMING_VIP;
+    put_opcode(0xF507, 0x200);
+    put_opcode(0x3500, 0x202);
+    put_opcode(0x1200, 0x204);
+    cpu.dt = 3;
+
+    /*
+     * F507 takes 50 cycles, then 6 loops of 152 cycles are skipped and
+     * 3500 takes the budget 12 cycles past 1000.
+     */
+    ck_assert_int_eq(1012, run_machine(&cpu, 1000));
+    ck_assert_int_eq(STOP_IDLE, cpu.stop);
+    ck_assert_int_eq(12, cpu.overrun);
+    ck_assert_int_eq(0x204, cpu.pc);
+}
+END_TEST
+
+static TCase*
+tcase_timing()
+{
+    TCase* tcase = setup_tcase("Timing");
+    tcase_add_test(tcase, test_timing_interpreter);
+    tcase_add_test(tcase, test_timing_threaded);
+    tcase_add_test(tcase, test_timing_jit);
+    tcase_add_test(tcase, test_timing_native);
+    tcase_add_test(tcase, test_timing_idle);
+    return tcase;
+}
+
+static TCase*
+tcase_timers()
+{
+    TCase* tcase = setup_tcase("Timers");
+    tcase_add_test(tcase, test_update_time);
+    tcase_add_test(tcase, test_tick_timers);
+    tcase_add_test(tcase, test_machines_independent);
+    tcase_add_test(tcase, test_hash_state);
+    return tcase;
+}
+
+static TCase*
+tcase_native()
+{
+    TCase* tcase = setup_tcase("Native");
+    tcase_add_test(tcase, test_native_run);
+    tcase_add_test(tcase, test_native_budget);
+    tcase_add_test(tcase, test_native_untranslated);
+    tcase_add_test(tcase, test_native_self_modifying);
+    tcase_add_test(tcase, test_native_other_program);
+    return tcase;
+}
+
+static TCase*
+tcase_alu()
+{
+    TCase* tcase = setup_tcase("ALU");
+    tcase_add_test(tcase, test_alu_jit);
+    tcase_add_test(tcase, test_alu_known_jit);
+    tcase_add_test(tcase, test_dead_flags_jit);
+    return tcase;
+}
+
+static TCase*
+tcase_load_regs()
+{
+    TCase* tcase = setup_tcase("Load registers");
+    tcase_add_test(tcase, test_load_regs_jit);
+    tcase_add_test(tcase, test_load_regs_known_jit);
+    return tcase;
+}
+
+/** Writes a ROM of the given length, byte N being N & 0xFF. */
+static void
+write_rom(const char* file, int length)
+{
+    FILE* fp = fopen(file, "wb");
+    ck_assert(fp != NULL);
+    for (int pos = 0; pos < length; pos++) {
+        fputc(pos & 0xFF, fp);
+    }
+    fclose(fp);
+}
+
+START_TEST(test_load_rom)
+{
+    write_rom("load_rom.ch8", MEMSIZ - 0x200);
+    ck_assert_int_eq(ROM_OK, load_rom(&cpu, "load_rom.ch8"));
+    remove("load_rom.ch8");
+    for (int pos = 0; pos < MEMSIZ - 0x200; pos++) {
+        ck_assert_int_eq(pos & 0xFF, cpu.mem[0x200 + pos]);
+    }
+}
+END_TEST
+
+START_TEST(test_load_rom_errors)
+{
+    write_rom("load_rom.ch8", MEMSIZ - 0x200 + 1);
+    ck_assert_int_eq(ROM_TOO_LARGE, load_rom(&cpu, "load_rom.ch8"));
+    remove("load_rom.ch8");
+    ck_assert_int_eq(ROM_CANNOT_OPEN, load_rom(&cpu, "load_rom.ch8"));
+    ck_assert_int_eq(ROM_CANNOT_READ, load_rom(&cpu, "."));
+
+    /* Memory is untouched when the ROM is not loaded. */
+    for (int pos = 0x200; pos < MEMSIZ; pos++) {
+        ck_assert_int_eq(0, cpu.mem[pos]);
+    }
+}
+END_TEST
+
+static TCase*
+tcase_load_rom()
+{
+    TCase* tcase = setup_tcase("Load ROM");
+    tcase_add_test(tcase, test_load_rom);
+    tcase_add_test(tcase, test_load_rom_errors);
+    return tcase;
+}
+
+/*
+ * Mixes random numbers, subroutines, the ALU, the timers, drawing and
+ * code that writes an opcode depending on a random number, so that the
+ * machines of a fleet diverge.
+ */
+static const word lockstep_program[] = {
+    0xC00F, 0x6100, 0x2230, 0x7101, 0x3108, 0x1204, 0xA300, 0xF033,
+    0xF265, 0xD015, 0x6078, 0xC101, 0xA21E, 0xF155, 0x8A94, 0x00E0,
+    0xB200, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x8014, 0x8305, 0x8346, 0x830E, 0x8537, 0x4007, 0x6601, 0x5030,
+    0x9540, 0x8F04, 0xF707, 0xF018, 0xF315, 0xF01E, 0xF229, 0x00EE,
+};
+
+static void
+put_lockstep_program(byte* program)
+{
+    memset(program, 0, 0x80);
+    for (size_t pos = 0; pos < sizeof(lockstep_program) / 2; pos++) {
+        program[2 * pos] = lockstep_program[pos] >> 8;
+        program[2 * pos + 1] = lockstep_program[pos] & 0xFF;
+    }
+    /* B200 jumps to 0x278, which goes back to the start. */
+    program[0x78] = 0x12;
+}
+
+START_TEST(test_lockstep_matches_machines)
+{
+    struct lockstep_t fleet;
+    byte program[0x80];
+    ck_assert_int_eq(0, init_lockstep(&fleet, 37));
+    put_lockstep_program(program);
+    load_lockstep(&fleet, program, sizeof(program));
+    for (int lane = 0; lane < fleet.count; lane++) {
+        seed_random(&fleet.machines[lane], lane);
+    }
+    for (int frame = 0; frame < 10; frame++) {
+        ck_assert_int_eq(200, run_lockstep(&fleet, 200));
+        for (int lane = 0; lane < fleet.count; lane++) {
+            tick_timers(&fleet.machines[lane]);
+        }
+    }
+    ck_assert(fleet.together > 0);
+    ck_assert(fleet.peeled > 0);
+
+    /* Every machine ends as if it had been run on its own. */
+    for (int lane = 0; lane < fleet.count; lane++) {
+        init_machine(&cpu);
+        memcpy(cpu.mem, fleet.image, MEMSIZ);
+        seed_random(&cpu, lane);
+        for (int frame = 0; frame < 10; frame++) {
+            run_machine(&cpu, 200);
+            tick_timers(&cpu);
+        }
+        ck_assert(hash_state(&cpu) == hash_state(&fleet.machines[lane]));
+        ck_assert(cpu.cycles == fleet.machines[lane].cycles);
+        free_machine(&cpu);
+    }
+    free_lockstep(&fleet);
+}
+END_TEST
+
+START_TEST(test_lockstep_wait_key)
+{
+    struct lockstep_t fleet;
+    const byte program[] = { 0xF3, 0x0A, 0x73, 0x01, 0x12, 0x02 };
+    ck_assert_int_eq(0, init_lockstep(&fleet, 20));
+    load_lockstep(&fleet, program, sizeof(program));
+    for (int lane = 0; lane < fleet.count; lane += 2) {
+        fleet.machines[lane].keypad = 1 << 5;
+    }
+
+    /* Held keys release FX0A at once, the rest of the fleet waits. */
+    ck_assert_int_eq(10, run_lockstep(&fleet, 10));
+    for (int lane = 0; lane < fleet.count; lane++) {
+        struct machine_t* machine = &fleet.machines[lane];
+        if (lane % 2 == 0) {
+            ck_assert_int_eq(STOP_BUDGET, machine->stop);
+            ck_assert_int_eq(10, machine->v[3]);
+            ck_assert(machine->cycles == 10);
+        } else {
+            ck_assert_int_eq(STOP_WAIT_KEY, machine->stop);
+            ck_assert(machine->cycles == 1);
+        }
+    }
+
+    /* Once every machine is waiting, no round is run. */
+    for (int lane = 0; lane < fleet.count; lane += 2) {
+        fleet.machines[lane].wait_key = 3;
+        fleet.machines[lane].keypad = 0;
+    }
+    ck_assert_int_eq(0, run_lockstep(&fleet, 10));
+    press_key(&fleet.machines[1], 7);
+    ck_assert_int_eq(10, run_lockstep(&fleet, 10));
+    ck_assert_int_eq(12, fleet.machines[1].v[3]);
+    ck_assert_int_eq(STOP_WAIT_KEY, fleet.machines[2].stop);
+    free_lockstep(&fleet);
+}
+END_TEST
+
+/*
+ * Machines diverge on random numbers until the fleet runs on its own,
+ * and then they rewrite an opcode. The next call must not fetch it from
+ * the image the fleet was loaded with.
+ */
+START_TEST(test_lockstep_written_alone)
+{
+    struct lockstep_t fleet;
+    const word code[] = {
+        0xC001, 0x3000, 0x7201, 0x7101, 0x3140, 0x1200, 0xA300, 0x6065,
+        0x6199, 0xF155, 0x1300,
+    };
+    byte program[0x104] = { 0 };
+    for (size_t pos = 0; pos < sizeof(code) / 2; pos++) {
+        program[2 * pos] = code[pos] >> 8;
+        program[2 * pos + 1] = code[pos] & 0xFF;
+    }
+    /* 6577 becomes 6599 once the loop is done. */
+    program[0x100] = 0x65;
+    program[0x101] = 0x77;
+    program[0x102] = 0x13;
+    ck_assert_int_eq(0, init_lockstep(&fleet, 16));
+    load_lockstep(&fleet, program, sizeof(program));
+    for (int lane = 0; lane < fleet.count; lane++) {
+        seed_random(&fleet.machines[lane], lane + 1);
+    }
+    ck_assert_int_eq(2000, run_lockstep(&fleet, 2000));
+    ck_assert_int_eq(100, run_lockstep(&fleet, 100));
+
+    for (int lane = 0; lane < fleet.count; lane++) {
+        init_machine(&cpu);
+        memcpy(cpu.mem + 0x200, program, sizeof(program));
+        seed_random(&cpu, lane + 1);
+        run_machine(&cpu, 2000);
+        run_machine(&cpu, 100);
+        ck_assert_int_eq(0x99, fleet.machines[lane].v[5]);
+        ck_assert(hash_state(&cpu) == hash_state(&fleet.machines[lane]));
+        free_machine(&cpu);
+    }
+    free_lockstep(&fleet);
+}
+END_TEST
+
+static TCase*
+tcase_lockstep()
+{
+    TCase* tcase = setup_tcase("Lockstep");
+    tcase_add_test(tcase, test_lockstep_matches_machines);
+    tcase_add_test(tcase, test_lockstep_wait_key);
+    tcase_add_test(tcase, test_lockstep_written_alone);
+    return tcase;
+}
+
+START_TEST(test_scheduler_matches_machines)
+{
+    struct scheduler_t sched;
+    struct machine_t machines[12];
+    ck_assert_int_eq(0, init_scheduler(&sched, 3, 12, 200, 1000));
+    for (int n = 0; n < 12; n++) {
+        init_machine(&machines[n]);
+        put_lockstep_program(machines[n].mem + 0x200);
+        seed_random(&machines[n], n);
+        ck_assert_int_eq(n, schedule_machine(&sched, &machines[n], 10,
+                                             NULL, NULL));
+    }
+    ck_assert_int_eq(0, wait_scheduler(&sched));
+
+    /* Every machine ends as if it had been run on its own. */
+    for (int n = 0; n < 12; n++) {
+        init_machine(&cpu);
+        put_lockstep_program(cpu.mem + 0x200);
+        seed_random(&cpu, n);
+        for (int frame = 0; frame < 10; frame++) {
+            tick_timers(&cpu);
+            run_machine(&cpu, 200);
+        }
+        ck_assert_int_eq(JOB_DONE, sched.jobs[n].state);
+        ck_assert_int_eq(10, sched.jobs[n].frame);
+        ck_assert(hash_state(&cpu) == hash_state(&machines[n]));
+        ck_assert(cpu.cycles == machines[n].cycles);
+        free_machine(&cpu);
+        free_machine(&machines[n]);
+    }
+    free_scheduler(&sched);
+}
+END_TEST
+
+START_TEST(test_scheduler_parks_waiting)
+{
+    struct scheduler_t sched;
+    struct machine_t machines[3];
+    const byte program[] = { 0xF3, 0x0A, 0x73, 0x01, 0x12, 0x02 };
+    ck_assert_int_eq(0, init_scheduler(&sched, 2, 3, 10, DEFAULT_QUANTUM));
+    for (int n = 0; n < 3; n++) {
+        init_machine(&machines[n]);
+        memcpy(machines[n].mem + 0x200, program, sizeof(program));
+    }
+    machines[0].keypad = 1 << 5;
+    for (int n = 0; n < 3; n++) {
+        schedule_machine(&sched, &machines[n], 5, NULL, NULL);
+    }
+
+    /* A held key releases FX0A at once, the rest of the machines park. */
+    ck_assert_int_eq(2, wait_scheduler(&sched));
+    ck_assert_int_eq(JOB_DONE, sched.jobs[0].state);
+    ck_assert_int_eq(5, sched.jobs[0].frame);
+    for (int n = 1; n < 3; n++) {
+        ck_assert_int_eq(JOB_PARKED, sched.jobs[n].state);
+        ck_assert_int_eq(1, sched.jobs[n].frame);
+        ck_assert(machines[n].cycles == 1);
+    }
+
+    /* A key sent to a parked machine lets it run its frames. */
+    send_key(&sched, 1, 7);
+    ck_assert_int_eq(1, wait_scheduler(&sched));
+    ck_assert_int_eq(JOB_DONE, sched.jobs[1].state);
+    ck_assert_int_eq(5, sched.jobs[1].frame);
+    ck_assert_int_eq(27, machines[1].v[3]);
+
+    /* Resumed without a key, a machine runs a frame and parks again. */
+    machines[2].dt = 10;
+    resume_machine(&sched, 2, 2);
+    ck_assert_int_eq(1, wait_scheduler(&sched));
+    ck_assert_int_eq(4, sched.jobs[2].frame);
+    ck_assert_int_eq(7, machines[2].dt);
+    resume_machine(&sched, 2, 10);
+    ck_assert_int_eq(0, wait_scheduler(&sched));
+    ck_assert_int_eq(JOB_DONE, sched.jobs[2].state);
+    ck_assert_int_eq(5, sched.jobs[2].frame);
+
+    for (int n = 0; n < 3; n++) {
+        free_machine(&machines[n]);
+    }
+    free_scheduler(&sched);
+}
+END_TEST
+
+START_TEST(test_scheduler_wraps)
+{
+    struct scheduler_t sched;
+    struct machine_t machines[3];
+    ck_assert_int_eq(0, init_scheduler(&sched, 1, 3, 50, 100));
+
+    /* Counters of the deque wrap around while the jobs go through it. */
+    pthread_mutex_lock(&sched.worker[0].lock);
+    sched.worker[0].top = sched.worker[0].bottom = UINT_MAX - 1;
+    pthread_mutex_unlock(&sched.worker[0].lock);
+    for (int n = 0; n < 3; n++) {
+        init_machine(&machines[n]);
+        put_lockstep_program(machines[n].mem + 0x200);
+        seed_random(&machines[n], n);
+        schedule_machine(&sched, &machines[n], 20, NULL, NULL);
+    }
+    ck_assert_int_eq(0, wait_scheduler(&sched));
+    for (int n = 0; n < 3; n++) {
+        ck_assert_int_eq(JOB_DONE, sched.jobs[n].state);
+        ck_assert_int_eq(20, sched.jobs[n].frame);
+        ck_assert(machines[n].cycles == 20 * 50);
+        free_machine(&machines[n]);
+    }
+    free_scheduler(&sched);
+}
+END_TEST
+
+static TCase*
+tcase_scheduler()
+{
+    TCase* tcase = setup_tcase("Scheduler");
+    tcase_add_test(tcase, test_scheduler_matches_machines);
+    tcase_add_test(tcase, test_scheduler_parks_waiting);
+    tcase_add_test(tcase, test_scheduler_wraps);
+    return tcase;
+}
+
+Suite*
+create_engine_suite()
+{
+    Suite* suite = suite_create("Execution engines");
+    suite_add_tcase(suite, tcase_run());
+    suite_add_tcase(suite, tcase_budget());
+    suite_add_tcase(suite, tcase_wait_key());
+    suite_add_tcase(suite, tcase_press_key());
+    suite_add_tcase(suite, tcase_keypad());
+    suite_add_tcase(suite, tcase_draw());
+    suite_add_tcase(suite, tcase_breakpoint());
+    suite_add_tcase(suite, tcase_idle());
+    suite_add_tcase(suite, tcase_self_modifying());
+    suite_add_tcase(suite, tcase_alu());
+    suite_add_tcase(suite, tcase_load_regs());
+    suite_add_tcase(suite, tcase_timers());
+    suite_add_tcase(suite, tcase_timing());
+    suite_add_tcase(suite, tcase_native());
+    suite_add_tcase(suite, tcase_load_rom());
+    suite_add_tcase(suite, tcase_lockstep());
+    suite_add_tcase(suite, tcase_scheduler());
+    return suite;
+}
@@ -51,13 +51,15 @@ put_opcode(word opcode, address pos)
 /* Should test that upon execution of CLS the screen is cleant. */
 START_TEST(test_cls)
 {
-    memset(cpu.screen, 0x55, 2048);
+    memset(cpu.screen, 0x55, sizeof(cpu.screen));
     put_opcode(0x00E0, 0x00);
     cpu.pc = 0x00;
     step_machine(&cpu);
-    for (int i = 0; i < 2048; i++) {
-        ck_assert_int_eq(0, cpu.screen[i]);
+    for (int i = 0; i < 128; i++) {
+        ck_assert(cpu.screen[i] == 0);
     }
+    ck_assert(cpu.dirty == ~0ull);
+    ck_assert_int_ne(0, cpu.generation);
 }
 END_TEST
 
@@ -556,6 +558,128 @@ tcase_jp()
     return tcase;
 }
 
+/* Runs CXKK at 0 and returns the value put in VX. */
+static byte
+run_rnd(word opcode)
+{
+    cpu.pc = 0;
+    put_opcode(opcode, 0);
+    step_machine(&cpu);
+    return cpu.v[(opcode >> 8) & 0xF];
+}
+
+START_TEST(test_rnd_mask)
+{
+    for (int i = 0; i < 64; i++) {
+        ck_assert_int_eq(0, run_rnd(0xC300));
+        ck_assert_int_eq(0, run_rnd(0xC30F) & 0xF0);
+    }
+}
+END_TEST
+
+/* The same seed gives the same numbers, and other seeds other numbers. */
+START_TEST(test_rnd_seed)
+{
+    byte first[16], differ = 0;
+    seed_random(&cpu, 1234);
+    for (int i = 0; i < 16; i++) {
+        first[i] = run_rnd(0xC1FF);
+    }
+    seed_random(&cpu, 1234);
+    for (int i = 0; i < 16; i++) {
+        ck_assert_int_eq(first[i], run_rnd(0xC1FF));
+    }
+    seed_random(&cpu, 1235);
+    for (int i = 0; i < 16; i++) {
+        differ |= first[i] != run_rnd(0xC1FF);
+    }
+    ck_assert(differ);
+}
+END_TEST
+
+static TCase*
+tcase_rnd()
+{
+    TCase* tcase = setup_tcase("RND");
+    tcase_add_test(tcase, test_rnd_mask);
+    tcase_add_test(tcase, test_rnd_seed);
+    return tcase;
+}
+
+/* Sprites that cross the edges of the screen should wrap around. */
+START_TEST(test_drw_wrap)
+{
+    cpu.mem[0x300] = 0xFF;
+    cpu.mem[0x301] = 0x81;
+    cpu.i = 0x300;
+    cpu.v[0] = 60;
+    cpu.v[1] = 31;
+    put_opcode(0xD012, 0);
+    cpu.pc = 0;
+    step_machine(&cpu);
+    ck_assert_int_eq(0, cpu.v[15]);
+    for (int row = 0; row < 32; row++) {
+        for (int col = 0; col < 64; col++) {
+            int lit = (row == 31 && (col >= 60 || col < 4))
+                   || (row == 0 && (col == 60 || col == 3));
+            ck_assert_int_eq(lit, screen_get_pixel(&cpu, row, col));
+        }
+    }
+}
+END_TEST
+
+/* Drawing over lit pixels should clear them and set VF. */
+START_TEST(test_drw_collision)
+{
+    cpu.mem[0x300] = 0xF0;
+    cpu.i = 0x300;
+    cpu.v[0] = 10;
+    cpu.v[1] = 5;
+    put_opcode(0xD011, 0);
+    cpu.pc = 0;
+    step_machine(&cpu);
+    ck_assert_int_eq(0, cpu.v[15]);
+    ck_assert_int_ne(0, screen_get_pixel(&cpu, 5, 13));
+
+    cpu.mem[0x300] = 0x18;
+    cpu.pc = 0;
+    step_machine(&cpu);
+    ck_assert_int_eq(1, cpu.v[15]);
+    ck_assert_int_eq(0, screen_get_pixel(&cpu, 5, 13));
+    ck_assert_int_ne(0, screen_get_pixel(&cpu, 5, 14));
+}
+END_TEST
+
+/* Drawing should mark the rows it touched as dirty, after wrapping. */
+START_TEST(test_drw_dirty)
+{
+    cpu.i = 0x300;
+    cpu.v[0] = 0;
+    cpu.v[1] = 30;
+    put_opcode(0xD013, 0);
+    cpu.pc = 0;
+    step_machine(&cpu);
+    ck_assert(cpu.dirty == (1ull << 30 | 1ull << 31 | 1ull << 0));
+    unsigned generation = cpu.generation;
+
+    cpu.dirty = 0;
+    cpu.pc = 0;
+    step_machine(&cpu);
+    ck_assert(cpu.dirty == (1ull << 30 | 1ull << 31 | 1ull << 0));
+    ck_assert_int_ne(generation, cpu.generation);
+}
+END_TEST
+
+static TCase*
+tcase_drw()
+{
+    TCase* tcase = setup_tcase("DRW");
+    tcase_add_test(tcase, test_drw_wrap);
+    tcase_add_test(tcase, test_drw_collision);
+    tcase_add_test(tcase, test_drw_dirty);
+    return tcase;
+}
+
 static int
 mock_poller(char key)
 {
@@ -734,11 +858,32 @@ START_TEST(test_ldb)
 }
 END_TEST
 
+/* Code overwritten by LD B must not run from a stale decoded copy. */
+START_TEST(test_ldb_code)
+{
+    put_opcode(0x6011, 0x10);
+    cpu.pc = 0x10;
+    step_machine(&cpu);
+    ck_assert_int_eq(0x11, cpu.v[0]);
+
+    cpu.v[1] = 162; /* KK of the LD at 0x10 becomes 0x01. */
+    cpu.i = 0x11;
+    put_opcode(0xF133, 0);
+    cpu.pc = 0x00;
+    step_machine(&cpu);
+
+    cpu.pc = 0x10;
+    step_machine(&cpu);
+    ck_assert_int_eq(0x01, cpu.v[0]);
+}
+END_TEST
+
 static TCase*
 tcase_ldb()
 {
     TCase* tcase = setup_tcase("LDB");
     tcase_add_test(tcase, test_ldb);
+    tcase_add_test(tcase, test_ldb_code);
     return tcase;
 }
 
@@ -774,12 +919,34 @@ START_TEST(test_ldix_in)
 }
 END_TEST
 
+/* Code overwritten by LD [I] must not run from a stale decoded copy. */
+START_TEST(test_ldix_code)
+{
+    put_opcode(0x6011, 0x10);
+    cpu.pc = 0x10;
+    step_machine(&cpu);
+    ck_assert_int_eq(0x11, cpu.v[0]);
+
+    cpu.v[0] = 0x60;
+    cpu.v[1] = 0x22;
+    cpu.i = 0x10;
+    put_opcode(0xF155, 0);
+    cpu.pc = 0x00;
+    step_machine(&cpu);
+
+    cpu.pc = 0x10;
+    step_machine(&cpu);
+    ck_assert_int_eq(0x22, cpu.v[0]);
+}
+END_TEST
+
 static TCase*
 tcase_ldix()
 {
     TCase* tcase = setup_tcase("LDIX");
     tcase_add_test(tcase, test_ldix_in);
     tcase_add_test(tcase, test_ldix_out);
+    tcase_add_test(tcase, test_ldix_code);
     return tcase;
 }
 
@@ -808,6 +975,8 @@ create_chip8_opcodes_suite()
     suite_add_tcase(suite, tcase_snexy());
     suite_add_tcase(suite, tcase_ldi());
     suite_add_tcase(suite, tcase_jp());
+    suite_add_tcase(suite, tcase_rnd());
+    suite_add_tcase(suite, tcase_drw());
     suite_add_tcase(suite, tcase_skp());
     suite_add_tcase(suite, tcase_sknp());
     suite_add_tcase(suite, tcase_lddt());
@@ -53,7 +53,7 @@ START_TEST(test_scd_esm_off)
 {
     /* Clear the screen, but put an horizontal line on Y = 0. */
     cpu.esm = 0;
-    memset(cpu.screen, 0, 2048);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_row(&cpu, 0);
 
     /* Execute SCD 4. */
@@ -80,7 +80,7 @@ START_TEST(test_scd_esm_on)
 {
     /* Clear the screen, put an horizontal line on Y = 0. */
     cpu.esm = 1;
-    memset(cpu.screen, 0, 8192);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_row(&cpu, 0);
 
     /* Execute SCD 4. */
@@ -117,7 +117,7 @@ START_TEST(test_scr_esm_off)
 {
     /* Clear the screen and put a vertical line on X = 0. */
     cpu.esm = 0;
-    memset(cpu.screen, 0, 2048);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_column(&cpu, 0);
     
     /* Execute SCR. */
@@ -144,7 +144,7 @@ START_TEST(test_scr_esm_on)
 {
     /* Clear screen, put vertical line on X = 0. */
     cpu.esm = 1;
-    memset(cpu.screen, 0, 8192);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_column(&cpu, 0);
 
     /* Execute SCR. */
@@ -180,7 +180,7 @@ tcase_scr()
 START_TEST(test_scl_esm_off)
 {
     /* Clear the screen and put a vertical line on X = 0. */
-    memset(cpu.screen, 0, 2048);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_column(&cpu, 4);
     
     /* Execute SCL. */
@@ -207,7 +207,7 @@ START_TEST(test_scl_esm_on)
 {
     /* Clear thes creen and put a vertical line on X = 4. */
     cpu.esm = 1;
-    memset(cpu.screen, 0, 8192);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     screen_fill_column(&cpu, 4);
 
     /* Execute SCL. */
@@ -309,7 +309,7 @@ START_TEST(test_draw_esm)
 
     /* Set up machine. */
     cpu.esm = 1;
-    memset(cpu.screen, 0, 8192);
+    memset(cpu.screen, 0, sizeof(cpu.screen));
     cpu.i = 0x800;
     put_opcode(0xD110, 0x200);
     step_machine(&cpu);
@@ -328,11 +328,49 @@ START_TEST(test_draw_esm)
 }
 END_TEST
 
+/* Sprites in extended mode should wrap around the 128x64 screen. */
+START_TEST(test_draw_esm_wrap)
+{
+    /* Set up a 16x16 sprite whose first and last columns are lit. */
+    for (int i = 0; i < 16; i++) {
+        cpu.mem[0x800 + 2 * i] = 0x80;
+        cpu.mem[0x801 + 2 * i] = 0x01;
+    }
+
+    cpu.esm = 1;
+    memset(cpu.screen, 0, sizeof(cpu.screen));
+    cpu.i = 0x800;
+    cpu.v[1] = 120;
+    cpu.v[2] = 56;
+    put_opcode(0xD120, 0x200);
+    step_machine(&cpu);
+
+    ck_assert_int_eq(0, cpu.v[15]);
+    for (int row = 0; row < 64; row++) {
+        for (int col = 0; col < 128; col++) {
+            int lit = (row >= 56 || row < 8) && (col == 120 || col == 7);
+            ck_assert_int_eq(lit, screen_get_pixel(&cpu, row, col));
+        }
+    }
+
+    /* A sprite across the middle of a row sets pixels in both words. */
+    cpu.v[1] = 57;
+    cpu.v[2] = 20;
+    cpu.pc = 0x200;
+    step_machine(&cpu);
+    ck_assert_int_eq(0, cpu.v[15]);
+    ck_assert_int_ne(0, screen_get_pixel(&cpu, 20, 57));
+    ck_assert_int_ne(0, screen_get_pixel(&cpu, 35, 72));
+    ck_assert_int_eq(0, screen_get_pixel(&cpu, 20, 64));
+}
+END_TEST
+
 static TCase*
 tcase_draw_esm()
 {
     TCase* tcase = setup_tcase("DRW ESM");
     tcase_add_test(tcase, test_draw_esm);
+    tcase_add_test(tcase, test_draw_esm_wrap);
     return tcase;
 }
 
@@ -391,12 +429,47 @@ START_TEST(test_ld_r_v_partial)
 }
 END_TEST
 
+START_TEST(test_ld_r_v_wraps)
+{
+    /* Decode the code at 0x000 before FX75 could spill over R. */
+    put_opcode(0x6305, 0x000);
+    cpu.pc = 0x000;
+    step_machine(&cpu);
+    for (int rg = 0; rg < 16; rg++) {
+        cpu.v[rg] = 0xAB;
+    }
+    cpu.v[3] = 0;
+    put_opcode(0xFF75, 0x200);
+    put_opcode(0xFF85, 0x202);
+    cpu.pc = 0x200;
+    step_machine(&cpu);
+    for (int rg = 0; rg < 8; rg++) {
+        ck_assert_int_eq(rg == 3 ? 0 : 0xAB, cpu.r[rg]);
+    }
+    ck_assert_int_eq(ENGINE_INTERPRETER, cpu.engine);
+    for (int rg = 8; rg < 16; rg++) {
+        cpu.v[rg] = 0xCD;
+    }
+    step_machine(&cpu);
+    for (int rg = 8; rg < 16; rg++) {
+        ck_assert_int_eq(0xCD, cpu.v[rg]);
+    }
+
+    /* Code at 0x000 still runs as it was decoded. */
+    cpu.pc = 0x000;
+    step_machine(&cpu);
+    ck_assert_int_eq(5, cpu.v[3]);
+    ck_assert_int_eq(0x002, cpu.pc);
+}
+END_TEST
+
 static TCase*
 tcase_ld_r_v()
 {
     TCase* tcase = setup_tcase("LD R, V");
     tcase_add_test(tcase, test_ld_r_v);
     tcase_add_test(tcase, test_ld_r_v_partial);
+    tcase_add_test(tcase, test_ld_r_v_wraps);
     return tcase;
 }
 
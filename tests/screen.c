@@ -49,9 +49,9 @@ START_TEST(test_screen_fill_column)
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (x == 4) {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             } else {
-                ck_assert_int_eq(0, cpu.screen[64 * y + x]);
+                ck_assert_int_eq(0, screen_get_pixel(&cpu, y, x));
             }
         }
     }
@@ -61,14 +61,14 @@ END_TEST
 START_TEST(test_screen_clear_column)
 {
     cpu.esm = 0;
-    memset(cpu.screen, 1, sizeof (cpu.screen));
+    memset(cpu.screen, 0xFF, sizeof (cpu.screen));
     screen_clear_column(&cpu, 8);
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (x == 8) {
-                ck_assert_int_eq(0, cpu.screen[64 * y + x]);
+                ck_assert_int_eq(0, screen_get_pixel(&cpu, y, x));
             } else {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             }
         }
     }
@@ -83,9 +83,9 @@ START_TEST(test_screen_fill_row)
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (y == 4) {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             } else {
-                ck_assert_int_eq(0, cpu.screen[64 * y + x]);
+                ck_assert_int_eq(0, screen_get_pixel(&cpu, y, x));
             }
         }
     }
@@ -95,14 +95,14 @@ END_TEST
 START_TEST(test_screen_clear_row)
 {
     cpu.esm = 0;
-    memset(cpu.screen, 1, sizeof(cpu.screen));
+    memset(cpu.screen, 0xFF, sizeof(cpu.screen));
     screen_clear_row(&cpu, 6);
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (y == 6) {
-                ck_assert_int_eq(0, cpu.screen[64 * y + x]);
+                ck_assert_int_eq(0, screen_get_pixel(&cpu, y, x));
             } else {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             }
         }
     }
@@ -113,8 +113,8 @@ START_TEST(test_screen_get_pixel)
 {
     cpu.esm = 0;
     memset(cpu.screen, 0, sizeof (cpu.screen));
-    cpu.screen[64 * 10 + 10] = 1;
-    cpu.screen[64 * 20 + 20] = 1;
+    screen_set_pixel(&cpu, 10, 10);
+    screen_set_pixel(&cpu, 20, 20);
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (x == 10 && y == 10) {
@@ -138,11 +138,11 @@ START_TEST(test_screen_set_pixel)
     for (int y = 0; y < 32; y++) {
         for (int x = 0; x < 64; x++) {
             if (x == 10 && y == 10) {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             } else if (x == 20 && y == 20) {
-                ck_assert_int_ne(0, cpu.screen[64 * y + x]);
+                ck_assert_int_ne(0, screen_get_pixel(&cpu, y, x));
             } else {
-                ck_assert_int_eq(0, cpu.screen[64 * y + x]);
+                ck_assert_int_eq(0, screen_get_pixel(&cpu, y, x));
             }
         }
     }
@@ -153,12 +153,12 @@ START_TEST(test_screen_clear_pixel)
 {
     cpu.esm = 0;
     memset(cpu.screen, 0, sizeof (cpu.screen));
-    cpu.screen[64 * 10 + 10] = 1;
-    cpu.screen[64 * 20 + 20] = 1;
+    screen_set_pixel(&cpu, 10, 10);
+    screen_set_pixel(&cpu, 20, 20);
     screen_clear_pixel(&cpu, 10, 10);
     screen_clear_pixel(&cpu, 20, 20);
-    ck_assert_int_eq(0, cpu.screen[64 * 10 + 10]);
-    ck_assert_int_eq(0, cpu.screen[64 * 20 + 20]);
+    ck_assert_int_eq(0, screen_get_pixel(&cpu, 10, 10));
+    ck_assert_int_eq(0, screen_get_pixel(&cpu, 20, 20));
 }
 END_TEST
 